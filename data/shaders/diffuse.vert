@@ -12,5 +12,5 @@ out vec4 v_color;
 void main()
 {
     v_color = color;
-    gl_Position = _Projection * _View * vec4(position.xyz, 1.0);
+    gl_Position = _Projection * _View * _Model * vec4(position.xyz, 1.0);
 }
\ No newline at end of file
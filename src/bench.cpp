@@ -0,0 +1,481 @@
+#pragma region INCLUDE
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#define SATANIA_MULTITHREADING 1
+#define SATANIA_PROFILING 0
+
+#include "binning.hpp"
+#include "bvh.hpp"
+#include "cpu_voxelizer.hpp"
+#include "hollow.hpp"
+#include "mca.hpp"
+#include "mesh.hpp"
+#include "nbt.hpp"
+#include "obj.hpp"
+#include "pack.hpp"
+#include "planner.hpp"
+#include "scene.hpp"
+#include "timer.hpp"
+#include "wide_bvh.hpp"
+
+#pragma endregion
+
+// Benchmarks of the CPU side of the pipeline, runs without a window or a GPU:
+//
+//   satania_bench [output.json] [max_generated_triangles] [min_seconds]
+//
+// Every result is printed and written as JSON. An "op" is the unit named by the result
+// (a triangle, a voxel, a chunk or a region), ns_per_op is taken from the fastest iteration.
+
+#pragma region DATA TYPES
+
+struct Result {
+    std::string name;
+    std::string input;
+    std::string unit;
+    size_t iterations;
+    double ops;          // ops done by one iteration
+    double ns_per_op;
+    double ops_per_second;
+    double bytes_per_op; // bytes produced (or consumed for compression) by one op
+};
+
+struct Input {
+    std::string name;
+    Mesh mesh;
+};
+
+#pragma endregion
+
+static double min_seconds = 0.5;
+static std::vector<Result> results;
+
+/**
+ * @brief Run a function until it took min_seconds and at least 3 times, keep the fastest iteration.
+ * The result is printed by the caller, once bytes_per_op is known when it depends on the output.
+ */
+template <typename Function>
+void measure(const std::string &name, const std::string &input, const std::string &unit, double ops,
+             double bytes_per_op, Function &&function) {
+    constexpr size_t min_iterations = 3;
+
+    double best_ns = 0.0;
+    double total_ns = 0.0;
+    size_t iterations = 0;
+    while (iterations < min_iterations || total_ns < min_seconds * 1e9) {
+        Timer timer;
+        timer.start();
+        function();
+        timer.stop();
+
+        double ns = (double)timer.elapsed<std::chrono::nanoseconds>().count();
+        best_ns = iterations == 0 ? ns : std::min(best_ns, ns);
+        total_ns += ns;
+        iterations++;
+    }
+
+    results.push_back(Result{name, input, unit, iterations, ops, best_ns / ops, ops * 1e9 / best_ns, bytes_per_op});
+}
+
+void printResult(const Result &r) {
+    printf("%-18s %-20s %12.2f ns/%-8s %14.0f %s/s %10.1f B/%s (%zu iterations)\n", r.name.c_str(), r.input.c_str(),
+           r.ns_per_op, r.unit.c_str(), r.ops_per_second, r.unit.c_str(), r.bytes_per_op, r.unit.c_str(),
+           r.iterations);
+}
+
+/**
+ * @brief UV sphere of about triangle_count triangles, a stand-in for scanned meshes of any size
+ */
+Mesh generateSphere(size_t triangle_count) {
+    int stacks = std::max(2, (int)std::sqrt(triangle_count / 4.0));
+    int slices = stacks * 2;
+
+    Mesh mesh;
+    mesh.vertices.reserve((size_t)(stacks + 1) * (slices + 1));
+    for (int i = 0; i <= stacks; i++) {
+        float phi = glm::pi<float>() * i / stacks;
+        for (int j = 0; j <= slices; j++) {
+            float theta = 2.0f * glm::pi<float>() * j / slices;
+
+            Vertex vertex{};
+            vertex.position =
+                glm::vec3(std::sin(phi) * std::cos(theta), std::cos(phi), std::sin(phi) * std::sin(theta));
+            vertex.color = glm::vec4(1.0f);
+            mesh.vertices.push_back(vertex);
+        }
+    }
+
+    mesh.elements.reserve((size_t)stacks * slices * 6);
+    for (int i = 0; i < stacks; i++) {
+        for (int j = 0; j < slices; j++) {
+            unsigned int a = i * (slices + 1) + j;
+            unsigned int b = a + slices + 1;
+
+            // The poles only have one triangle per quad
+            if (i != 0) {
+                mesh.elements.insert(mesh.elements.end(), {a, b, a + 1});
+            }
+            if (i + 1 != stacks) {
+                mesh.elements.insert(mesh.elements.end(), {a + 1, b, b + 1});
+            }
+        }
+    }
+
+    return mesh;
+}
+
+/**
+ * @brief Sphere shell filling a whole region, the same kind of data the voxelizer outputs
+ */
+std::vector<int> generateShell(glm::ivec3 size, pack::Layout layout) {
+    std::vector<int> voxels((size_t)size.x * size.y * size.z, 0);
+    glm::vec3 center = glm::vec3(size) / 2.0f;
+    float radius = std::min({size.x, size.y, size.z}) * 0.45f;
+
+    for (int z = 0; z < size.z; z++) {
+        for (int y = 0; y < size.y; y++) {
+            for (int x = 0; x < size.x; x++) {
+                float distance = glm::length(glm::vec3(x, y, z) + 0.5f - center);
+                voxels[pack::voxelIndex(glm::ivec3(x, y, z), size, layout)] = std::abs(distance - radius) < 1.0f;
+            }
+        }
+    }
+
+    return voxels;
+}
+
+/**
+ * @brief Solid sphere filling a whole region, what a closed mesh with inner parts looks like once voxelized
+ */
+std::vector<int> generateBall(glm::ivec3 size, pack::Layout layout) {
+    std::vector<int> voxels((size_t)size.x * size.y * size.z, 0);
+    glm::vec3 center = glm::vec3(size) / 2.0f;
+    float radius = std::min({size.x, size.y, size.z}) * 0.45f;
+
+    for (int z = 0; z < size.z; z++) {
+        for (int y = 0; y < size.y; y++) {
+            for (int x = 0; x < size.x; x++) {
+                float distance = glm::length(glm::vec3(x, y, z) + 0.5f - center);
+                voxels[pack::voxelIndex(glm::ivec3(x, y, z), size, layout)] = distance < radius;
+            }
+        }
+    }
+
+    return voxels;
+}
+
+/**
+ * @brief The packing loop main.cpp had before pack::packRegion, kept as the baseline of the pack results.
+ * It packs the grid in its own order, without moving the rows to their sections.
+ */
+void packScalar(const int *voxels, size_t voxel_count, std::vector<uint64_t> &data) {
+    data.assign(voxel_count / 16, 0);
+    for (size_t i = 0; i < data.size(); i++) {
+        for (int j = 0; j < 16; j++) {
+            uint64_t mask = static_cast<uint64_t>(1) << (j * 4);
+            size_t index = i * 16;
+
+            data[i] |= (static_cast<uint64_t>(voxels[index + j]) << (j * 4)) & mask;
+        }
+    }
+}
+
+bool writeJSON(const std::string &filename) {
+    FILE *file = fopen(filename.c_str(), "wb");
+    if (file == nullptr) {
+        fprintf(stderr, "Cannot write \"%s\"\n", filename.c_str());
+        return false;
+    }
+
+    fprintf(file, "{\n  \"hardware_concurrency\": %u,\n  \"results\": [\n", std::thread::hardware_concurrency());
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &r = results[i];
+        fprintf(file,
+                "    {\"name\": \"%s\", \"input\": \"%s\", \"unit\": \"%s\", \"iterations\": %zu, \"ops\": %.0f, "
+                "\"ns_per_op\": %.3f, \"ops_per_second\": %.1f, \"bytes_per_op\": %.3f}%s\n",
+                r.name.c_str(), r.input.c_str(), r.unit.c_str(), r.iterations, r.ops, r.ns_per_op, r.ops_per_second,
+                r.bytes_per_op, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+
+    bool success = ferror(file) == 0;
+    fclose(file);
+    return success;
+}
+
+int main(int argc, char **argv) {
+    std::string output_filename = "satania_bench.json";
+    size_t max_generated_triangles = 1'000'000;
+
+    if (argc > 1) {
+        output_filename = argv[1];
+    }
+    if (argc > 2) {
+        max_generated_triangles = (size_t)atoll(argv[2]);
+    }
+    if (argc > 3) {
+        min_seconds = atof(argv[3]);
+    }
+
+    // Same BVH settings as the voxelizer defaults
+    constexpr int leaf_max_size = 64;
+    constexpr int depth_max_size = 32;
+    constexpr int voxelize_grid_size = 64;
+
+#pragma region INPUTS
+
+    std::vector<Input> inputs;
+    for (const char *filename : {"./data/meshes/suzanne.obj", "./data/meshes/triangle_field.obj"}) {
+        Input input;
+        input.name = std::filesystem::path(filename).filename().string();
+        if (!obj::loadOBJ(filename, input.mesh)) {
+            fprintf(stderr, "Cannot load \"%s\", skipping it\n", filename);
+            continue;
+        }
+        inputs.push_back(std::move(input));
+    }
+    for (size_t triangle_count = 10'000; triangle_count <= max_generated_triangles; triangle_count *= 10) {
+        inputs.push_back(Input{"sphere_" + std::to_string(triangle_count), generateSphere(triangle_count)});
+    }
+
+#pragma endregion
+
+#pragma region MESH
+
+    for (const auto &input : inputs) {
+        double triangles = (double)triangleCount(input.mesh);
+        if (triangles == 0) {
+            continue;
+        }
+
+        size_t bvh_bytes = 0;
+        measure("bvh_build", input.name, "triangle", triangles, 0.0, [&]() {
+            BVH bvh(input.mesh, leaf_max_size, depth_max_size);
+            bvh_bytes = bvh.m_nodes.size() * (sizeof(BVH::Node) + sizeof(int)) +
+                        bvh.m_triangles.size() * sizeof(BVH::Triangle);
+        });
+        results.back().bytes_per_op = bvh_bytes / triangles;
+        printResult(results.back());
+
+        Scene scene;
+        scene.meshes.push_back(input.mesh);
+        scene.instances.push_back(Instance{glm::mat4(1.0f), 0});
+        SceneBVH bvh(scene, leaf_max_size, depth_max_size);
+
+        // Fit the grid to the mesh, about the voxel size a user would pick for it
+        glm::vec3 extent = bvh.aabb().max - bvh.aabb().min;
+        cpu_voxelizer::Grid grid;
+        grid.resolution = std::max({extent.x, extent.y, extent.z}) / (voxelize_grid_size - 4.0);
+        grid.min = glm::dvec3(bvh.aabb().min) - grid.resolution;
+        grid.size = glm::ivec3(voxelize_grid_size);
+        grid.layout = pack::LAYOUT_BRICK;
+
+        std::vector<int> voxels;
+        double voxel_count = (double)grid.size.x * grid.size.y * grid.size.z;
+        measure("voxelize_cpu", input.name, "voxel", voxel_count, sizeof(int),
+                [&]() { cpu_voxelizer::voxelize(bvh, grid, voxels); });
+        printResult(results.back());
+
+        // Overlap test in float around the voxel center, counted against the double reference
+        cpu_voxelizer::Grid float_grid = grid;
+        float_grid.precision = cpu_voxelizer::PRECISION_FLOAT;
+        std::vector<int> float_voxels;
+        measure("voxelize_cpu_f32", input.name, "voxel", voxel_count, sizeof(int),
+                [&]() { cpu_voxelizer::voxelize(bvh, float_grid, float_voxels); });
+        printResult(results.back());
+        size_t float_differences = 0;
+        for (size_t i = 0; i < voxels.size(); i++) {
+            float_differences += float_voxels[i] != voxels[i];
+        }
+        if (float_differences > 0) {
+            fprintf(stderr, "voxelize_cpu_f32 of %s differs from double on %zu voxels\n", input.name.c_str(),
+                    float_differences);
+        }
+
+        // Same walk on the BVH collapsed to 4 and 8 children, the voxels must not change
+        auto measure_wide = [&](const char *name, const auto &wide, const char *path) {
+            std::vector<int> wide_voxels;
+            measure(name, input.name, "voxel", voxel_count, sizeof(int),
+                    [&]() { cpu_voxelizer::voxelize(wide, grid, wide_voxels); });
+            printResult(results.back());
+            printf("%-18s node test in %s\n", name, path);
+            if (wide_voxels != voxels) {
+                fprintf(stderr, "%s of %s differs from the binary BVH\n", name, input.name.c_str());
+            }
+        };
+        measure("wide_bvh_build", input.name, "node", (double)bvh.m_nodes.size(), 0.0,
+                [&]() { wide_bvh::WideBVH<4> wide(bvh); });
+        printResult(results.back());
+        measure_wide("voxelize_cpu_bvh4", wide_bvh::WideBVH<4>(bvh), wide_bvh::intersectMaskPath<4>());
+        measure_wide("voxelize_cpu_bvh8", wide_bvh::WideBVH<8>(bvh), wide_bvh::intersectMaskPath<8>());
+
+        // The overlap kernel alone, every block of 4 triangles against the voxel at its first vertex
+        using cpu_voxelizer::TriangleBlock;
+        std::vector<TriangleBlock> blocks(bvh.m_triangles.size() / TriangleBlock::size);
+        std::vector<glm::dvec3> block_centers(blocks.size());
+        for (size_t i = 0; i < blocks.size(); i++) {
+            for (int lane = 0; lane < TriangleBlock::size; lane++) {
+                const BVH::Triangle &triangle = bvh.m_triangles[i * TriangleBlock::size + lane];
+                const glm::dvec3 vertices[3] = {glm::dvec3(triangle.vertices[0].position),
+                                                glm::dvec3(triangle.vertices[1].position),
+                                                glm::dvec3(triangle.vertices[2].position)};
+                blocks[i].set(lane, vertices);
+            }
+            block_centers[i] =
+                grid.min + glm::round((blocks[i].vertex(0, 0) - grid.min) / grid.resolution) * grid.resolution;
+        }
+
+        std::vector<uint32_t> scalar_masks(blocks.size());
+        std::vector<uint32_t> masks(blocks.size());
+        auto measure_overlap = [&](const char *name, auto &&overlap) {
+            measure(name, input.name, "triangle", (double)blocks.size() * TriangleBlock::size, 0.0, [&]() {
+                for (size_t i = 0; i < blocks.size(); i++) {
+                    masks[i] = overlap(blocks[i], TriangleBlock::size, block_centers[i], grid.resolution / 2.0,
+                                       grid.splat_threshold);
+                }
+            });
+            printResult(results.back());
+        };
+        measure_overlap("overlap_scalar", cpu_voxelizer::triangleBlockOverlapScalar);
+        scalar_masks = masks;
+#if SATANIA_OVERLAP_AVX2
+        if (cpu_voxelizer::hasAVX2()) {
+            measure_overlap("overlap_avx2", cpu_voxelizer::triangleBlockOverlapAVX2);
+            if (masks != scalar_masks) {
+                fprintf(stderr, "overlap_avx2 of %s differs from the scalar test\n", input.name.c_str());
+            }
+        }
+#endif
+
+        // Same grid in section wide tiles, each one walking the instances binned in it
+        planner::Budget budget;
+        budget.max_tile_size = glm::ivec2(16);
+        const glm::vec3 origin(grid.min);
+        std::vector<int> tile_voxels;
+        measure("voxelize_cpu_tiled", input.name, "voxel", voxel_count, sizeof(int), [&]() {
+            planner::Plan plan = planner::planTiles(bvh, grid.size, origin, (float)grid.resolution, 1, budget);
+            binning::TileTriangles tile_triangles = binning::binTriangles(bvh, plan, origin, (float)grid.resolution);
+            binning::removeEmptyTiles(plan, tile_triangles);
+
+            for (size_t i = 0; i < plan.tiles.size(); i++) {
+                binning::TileBVH tile_bvh(bvh, tile_triangles[i]);
+                cpu_voxelizer::Grid tile_grid = grid;
+                tile_grid.min = grid.min + glm::dvec3(plan.tiles[i].voxel_offset) * grid.resolution;
+                tile_grid.size = plan.tile_size;
+                cpu_voxelizer::voxelize(tile_bvh, tile_grid, tile_voxels);
+            }
+        });
+        printResult(results.back());
+    }
+
+#pragma endregion
+
+#pragma region REGION
+
+    const glm::ivec3 region_size(512, 256, 512);
+    const double region_voxels = (double)region_size.x * region_size.y * region_size.z;
+    const std::vector<std::string> palette = {"minecraft:air", "minecraft:stone"};
+    const int bits = mca::bitsPerBlock(palette.size());
+
+    std::vector<uint64_t> data;
+    for (int layout = 0; layout < pack::LAYOUT_MAX; layout++) {
+        static const char *layout_names[pack::LAYOUT_MAX] = {"linear", "brick", "morton"};
+
+        std::vector<int> shell = generateShell(region_size, (pack::Layout)layout);
+        if (layout == pack::LAYOUT_LINEAR) {
+            measure("pack_scalar", "shell_linear", "voxel", region_voxels, sizeof(int),
+                    [&]() { packScalar(shell.data(), shell.size(), data); });
+            printResult(results.back());
+        }
+        measure("pack", std::string("shell_") + layout_names[layout], "voxel", region_voxels, sizeof(int),
+                [&]() { pack::packRegion(shell.data(), region_size, bits, data, 1, (pack::Layout)layout); });
+        printResult(results.back());
+        measure("pack_mt", std::string("shell_") + layout_names[layout], "voxel", region_voxels, sizeof(int),
+                [&]() { pack::packRegion(shell.data(), region_size, bits, data); });
+        printResult(results.back());
+    }
+
+    // Interior of a solid ball emptied under a 2 blocks shell, the copy of the ball is included
+    const std::vector<int> ball = generateBall(region_size, pack::LAYOUT_BRICK);
+    std::vector<int> hollow_ball;
+    size_t emptied = 0;
+    measure("hollow_shell", "ball_brick", "voxel", region_voxels, sizeof(int), [&]() {
+        hollow_ball = ball;
+        emptied = hollow::keepShell(hollow_ball.data(), region_size, pack::LAYOUT_BRICK, 2);
+    });
+    printResult(results.back());
+    printf("%-18s %-20s %zu of %zu voxels emptied\n", "", "", emptied,
+           (size_t)std::count_if(ball.begin(), ball.end(), [](int v) { return v != 0; }));
+
+    std::vector<nbt::bytes> chunks(mca::entries);
+    measure("nbt_encode", "shell", "chunk", (double)mca::entries, 0.0, [&]() {
+        for (size_t i = 0; i < mca::entries; i++) {
+            chunks[i].clear();
+            mca::writeChunk(chunks[i], 0, 0, (int)(i % 32), (int)(i / 32), palette, data);
+        }
+    });
+    size_t encoded_size = 0;
+    for (const auto &chunk : chunks) {
+        encoded_size += chunk.size();
+    }
+    results.back().bytes_per_op = (double)encoded_size / mca::entries;
+    printResult(results.back());
+
+    // Only the chunks the shell crosses, empty chunks would make the compression look faster than it is
+    std::vector<const nbt::bytes *> solid_chunks;
+    for (size_t i = 0; i < mca::entries; i++) {
+        if (mca::chunkTouched((int)(i % 32), (int)(i / 32), palette, data)) {
+            solid_chunks.push_back(&chunks[i]);
+        }
+    }
+    size_t solid_size = 0;
+    for (const auto *chunk : solid_chunks) {
+        solid_size += chunk->size();
+    }
+
+    std::vector<uint8_t> compressed;
+    measure("compress", "shell_chunks", "chunk", (double)solid_chunks.size(), (double)solid_size / solid_chunks.size(),
+            [&]() {
+                for (const auto *chunk : solid_chunks) {
+                    mca::compressMemory((void *)chunk->data(), chunk->size(), compressed);
+                }
+            });
+    printResult(results.back());
+
+    std::string mca_filename = (std::filesystem::temp_directory_path() / "satania_bench.mca").string();
+    measure("write_mca", "shell", "region", 1.0, 0.0,
+            [&]() { mca::writeMCA(mca_filename, 0, 0, palette, data); });
+    results.back().bytes_per_op = (double)std::filesystem::file_size(mca_filename);
+    printResult(results.back());
+
+    // A new cache each time so every iteration starts cold, repeated chunks still hit within the region
+    measure("write_mca", "shell_cached", "region", 1.0, 0.0, [&]() {
+        mca::ChunkCache cache;
+        mca::writeMCA(mca_filename, 0, 0, palette, data, &cache);
+    });
+    results.back().bytes_per_op = (double)std::filesystem::file_size(mca_filename);
+    printResult(results.back());
+
+    std::error_code error;
+    std::filesystem::remove(mca_filename, error);
+
+#pragma endregion
+
+    if (!writeJSON(output_filename)) {
+        return 1;
+    }
+    printf("Results saved to \"%s\"\n", output_filename.c_str());
+
+    return 0;
+}
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "cpu_voxelizer.hpp"
+#include "planner.hpp"
+#include "scene.hpp"
+
+/**
+ * Bins the triangles of a scene into the tiles of a plan, so a dispatch walks the instances of its
+ * tile only instead of the whole scene from the root.
+ *
+ * Triangles are binned by their world bounds, then by a separating axis test against the tile box
+ * when they span several tiles. They are never cut: a triangle crossing tiles is binned whole in each
+ * of them, so the voxelizer runs the exact same tests as with the scene BVH. Tiles left without a
+ * triangle are empty and dropped from the plan.
+ */
+namespace binning
+{
+    struct TriangleRef
+    {
+        int instance; // in SceneBVH::m_instances
+        int triangle; // in SceneBVH::m_triangles
+    };
+
+    using TileTriangles = std::vector<std::vector<TriangleRef>>; // one list per tile of the plan
+
+    /**
+     * @brief World space vertices of a triangle, transformed in float like the voxelizer does
+     */
+    inline void worldTriangle(const SceneBVH &bvh, const TriangleRef &ref, glm::dvec3 vertices[3])
+    {
+        const glm::mat4 &transform = bvh.m_instances[ref.instance].transform;
+        const BVH::Triangle &triangle = bvh.m_triangles[ref.triangle];
+        for (int v = 0; v < 3; v++)
+        {
+            vertices[v] = glm::dvec3(glm::vec3(transform * glm::vec4(triangle.vertices[v].position, 1.0f)));
+        }
+    }
+
+    /**
+     * @brief Bin every instanced triangle of a scene into the tiles of a plan it may touch
+     *
+     * @param origin world position of voxel (0, 0, 0), as given to planner::planTiles
+     * @param num_thread number of threads, each one bins a range of the instanced triangles
+     */
+    inline TileTriangles binTriangles(const SceneBVH &bvh, const planner::Plan &plan, const glm::vec3 &origin,
+                                      float resolution, int num_thread = std::thread::hardware_concurrency())
+    {
+        // Tile of every cell of the grid, -1 for the tiles the planner left out
+        const glm::ivec2 grid_tiles(plan.grid_size.x / plan.tile_size.x, plan.grid_size.z / plan.tile_size.z);
+        std::vector<int> tile_indices((size_t)grid_tiles.x * grid_tiles.y, -1);
+        for (size_t i = 0; i < plan.tiles.size(); i++)
+        {
+            glm::ivec3 cell = plan.tiles[i].voxel_offset / plan.tile_size;
+            tile_indices[(size_t)cell.z * grid_tiles.x + cell.x] = (int)i;
+        }
+
+        // Instanced triangles are numbered instance after instance, first[i] is the first one of instance i
+        std::vector<size_t> first(bvh.m_instances.size() + 1, 0);
+        for (size_t i = 0; i < bvh.m_instances.size(); i++)
+        {
+            int triangle_count = 0;
+            for (const auto &range : bvh.m_meshes)
+            {
+                if (range.triangle_count > 0 && range.triangle_offset == bvh.m_instances[i].triangle_offset)
+                {
+                    triangle_count = range.triangle_count;
+                    break;
+                }
+            }
+            first[i + 1] = first[i] + triangle_count;
+        }
+
+        // Tiles reach half a voxel out of their grid cells like the voxels of the shader, plus some
+        // slack for the float rounding of the dispatch origin
+        const glm::dvec3 grid_min = glm::dvec3(origin) - 0.5 * resolution;
+        const glm::dvec3 tile_size = glm::dvec3(plan.tile_size) * (double)resolution;
+        const double slack = 1e-3 * resolution + 1e-6 * (1.0 + glm::length(glm::dvec3(origin)));
+
+        auto bin_range = [&](size_t begin, size_t end, TileTriangles &bins) {
+            bins.assign(plan.tiles.size(), {});
+            size_t instance = std::upper_bound(first.begin(), first.end(), begin) - first.begin() - 1;
+
+            for (size_t i = begin; i < end; i++)
+            {
+                while (i >= first[instance + 1])
+                {
+                    instance++;
+                }
+                TriangleRef ref{(int)instance, bvh.m_instances[instance].triangle_offset + (int)(i - first[instance])};
+
+                glm::dvec3 vertices[3];
+                worldTriangle(bvh, ref, vertices);
+                glm::dvec3 triangle_min = glm::min(glm::min(vertices[0], vertices[1]), vertices[2]);
+                glm::dvec3 triangle_max = glm::max(glm::max(vertices[0], vertices[1]), vertices[2]);
+
+                if (triangle_max.y < grid_min.y - slack || triangle_min.y > grid_min.y + tile_size.y + slack)
+                {
+                    continue;
+                }
+
+                glm::ivec2 cell_min(std::floor((triangle_min.x - slack - grid_min.x) / tile_size.x),
+                                    std::floor((triangle_min.z - slack - grid_min.z) / tile_size.z));
+                glm::ivec2 cell_max(std::floor((triangle_max.x + slack - grid_min.x) / tile_size.x),
+                                    std::floor((triangle_max.z + slack - grid_min.z) / tile_size.z));
+                cell_min = glm::max(cell_min, glm::ivec2(0));
+                cell_max = glm::min(cell_max, grid_tiles - 1);
+                const bool spans_tiles = cell_min != cell_max;
+
+                for (int z = cell_min.y; z <= cell_max.y; z++)
+                {
+                    for (int x = cell_min.x; x <= cell_max.x; x++)
+                    {
+                        int tile = tile_indices[(size_t)z * grid_tiles.x + x];
+                        if (tile < 0)
+                        {
+                            continue;
+                        }
+
+                        if (spans_tiles)
+                        {
+                            // Scaled so the tile is the unit cube of the voxel test, scaling keeps the separation
+                            glm::dvec3 half_size = tile_size / 2.0 + slack;
+                            glm::dvec3 center = grid_min + glm::dvec3(x, 0, z) * tile_size + tile_size / 2.0;
+                            glm::dvec3 scaled[3];
+                            for (int v = 0; v < 3; v++)
+                            {
+                                scaled[v] = (vertices[v] - center) / half_size;
+                            }
+                            if (!cpu_voxelizer::triangleBoxOverlap(glm::dvec3(0.0), 1.0, scaled[0], scaled[1],
+                                                                   scaled[2]))
+                            {
+                                continue;
+                            }
+                        }
+                        bins[tile].push_back(ref);
+                    }
+                }
+            }
+        };
+
+        const size_t triangle_count = first.back();
+        num_thread = (int)std::clamp<size_t>(num_thread, 1, std::max<size_t>(triangle_count / 4096, 1));
+
+        std::vector<TileTriangles> thread_bins(num_thread);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < num_thread; t++)
+        {
+            threads.push_back(std::thread(bin_range, triangle_count * t / num_thread,
+                                          triangle_count * (t + 1) / num_thread, std::ref(thread_bins[t])));
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+
+        // Threads took consecutive ranges, appending them in order keeps the bins deterministic
+        TileTriangles bins = std::move(thread_bins[0]);
+        for (int t = 1; t < num_thread; t++)
+        {
+            for (size_t tile = 0; tile < bins.size(); tile++)
+            {
+                bins[tile].insert(bins[tile].end(), thread_bins[t][tile].begin(), thread_bins[t][tile].end());
+            }
+        }
+        return bins;
+    }
+
+    /**
+     * @brief Drop the tiles no triangle was binned in, the regions of the plan are flagged again
+     *
+     * @return number of tiles dropped
+     */
+    inline size_t removeEmptyTiles(planner::Plan &plan, TileTriangles &bins)
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i < plan.tiles.size(); i++)
+        {
+            if (bins[i].empty())
+            {
+                continue;
+            }
+            if (kept != i)
+            {
+                plan.tiles[kept] = plan.tiles[i];
+                bins[kept] = std::move(bins[i]);
+            }
+            kept++;
+        }
+
+        size_t removed = plan.tiles.size() - kept;
+        plan.tiles.resize(kept);
+        bins.resize(kept);
+        planner::markRegions(plan.tiles);
+        return removed;
+    }
+
+    /**
+     * @brief Hash of the triangles binned in a tile, in world space as the voxelizer sees them
+     *
+     * Triangles are hashed one by one and summed, so the hash does not depend on their order: a mesh
+     * exported again with its triangles shuffled keeps the hashes of its tiles.
+     *
+     * @param with_materials also hash the colors, uvs and textures, only when they pick the blocks. Otherwise
+     * they change nothing in the voxels, and the window recolors the triangles for display.
+     */
+    inline uint64_t tileHash(const SceneBVH &bvh, const std::vector<TriangleRef> &triangles,
+                             const glm::ivec3 &tile_size, bool with_materials)
+    {
+        auto mix = [](uint64_t h, const void *data, size_t size) {
+            for (size_t i = 0; i < size; i++)
+            {
+                h = (h ^ static_cast<const unsigned char *>(data)[i]) * 1099511628211ull;
+            }
+            return h;
+        };
+
+        uint64_t sum = mix(14695981039346656037ull, &tile_size, sizeof(tile_size));
+        for (const TriangleRef &ref : triangles)
+        {
+            const glm::mat4 &transform = bvh.m_instances[ref.instance].transform;
+            uint64_t h = 14695981039346656037ull;
+            for (const Vertex &vertex : bvh.m_triangles[ref.triangle].vertices)
+            {
+                glm::vec3 position = glm::vec3(transform * glm::vec4(vertex.position, 1.0f));
+                h = mix(h, &position, sizeof(position));
+                if (with_materials)
+                {
+                    h = mix(h, &vertex.color, sizeof(vertex.color));
+                    h = mix(h, &vertex.uv, sizeof(vertex.uv));
+                    h = mix(h, &vertex.texture, sizeof(vertex.texture));
+                }
+            }
+
+            // Finalizer of splitmix64, FNV alone sums badly
+            h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+            h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+            sum += h ^ (h >> 31);
+        }
+        return sum;
+    }
+
+    /**
+     * @brief Top level over the instances with a triangle binned in one tile. Their mesh BVHs are the ones
+     * of the scene, walked in place: only the instances and the top nodes are built for the tile.
+     */
+    class TileBVH
+    {
+    public:
+        std::vector<SceneBVH::GPUInstance> m_instances;
+        std::vector<BVH::Node> m_top_nodes;
+        std::vector<int> m_top_escapes;
+
+        TileBVH(const SceneBVH &bvh, const std::vector<TriangleRef> &triangles, int top_leaf_max_size = 2)
+            : m_bvh{&bvh}
+        {
+            std::vector<bool> binned(bvh.m_instances.size(), false);
+            for (const TriangleRef &ref : triangles)
+            {
+                binned[ref.instance] = true;
+            }
+            for (size_t i = 0; i < binned.size(); i++)
+            {
+                if (binned[i])
+                {
+                    m_instances.push_back(bvh.m_instances[i]);
+                }
+            }
+
+            SceneBVH::buildTopLevel(m_instances, top_leaf_max_size, m_top_nodes, m_top_escapes);
+        }
+
+        const SceneBVH &scene() const
+        {
+            return *m_bvh;
+        }
+
+        bool empty() const
+        {
+            return m_top_nodes.empty();
+        }
+
+    private:
+        const SceneBVH *m_bvh;
+    };
+
+    /**
+     * @brief Value of one voxel of a tile, see cpu_voxelizer::voxelValue
+     */
+    inline int voxelValue(const TileBVH &tile, const cpu_voxelizer::Voxel &voxel, float splat_threshold,
+                          stats::Traversal *traversal = nullptr, const material::Materials *materials = nullptr)
+    {
+        return cpu_voxelizer::voxelValue(tile.scene(), tile, voxel, splat_threshold, traversal, materials);
+    }
+
+    inline int voxelValue(const TileBVH &tile, const cpu_voxelizer::LocalMeshes &local,
+                          const cpu_voxelizer::Voxel &voxel, float splat_threshold,
+                          stats::Traversal *traversal = nullptr, const material::Materials *materials = nullptr)
+    {
+        return cpu_voxelizer::voxelValue(tile.scene(), tile, local, voxel, splat_threshold, traversal, materials);
+    }
+
+    /**
+     * @brief Meshes of the instances of a tile converted to its grid, for the float walk
+     */
+    inline cpu_voxelizer::LocalMeshes localMeshes(const TileBVH &tile, const cpu_voxelizer::Grid &grid)
+    {
+        return cpu_voxelizer::LocalMeshes(tile.scene(), tile.m_instances, grid);
+    }
+} // namespace binning
@@ -40,6 +40,7 @@ public:
 
 	std::vector<Triangle>   m_triangles;
 	std::vector<Node>       m_nodes;
+	std::vector<int>        m_escapes; // next node once the subtree of a node is done, 0 at the end of the walk
 
 	BVH(const Mesh& mesh, int leaf_max_size = 4, int depth_max_size = 512) : m_leaf_max_size{ leaf_max_size }, m_depth_max_size{ depth_max_size }
 	{
@@ -54,13 +55,62 @@ public:
 			m_triangles[i].vertices[2] = mesh.vertices[mesh.elements[i * 3 + 2]];
 		}
 
+		build();
+	}
+
+	BVH(const MeshView& mesh, int leaf_max_size = 4, int depth_max_size = 512) : m_leaf_max_size{ leaf_max_size }, m_depth_max_size{ depth_max_size }
+	{
+		m_indices = {};
+		m_midpoints = {};
+
+		m_triangles.resize(mesh.triangle_count);
+		for (size_t i = 0; i < m_triangles.size(); i++)
+		{
+			for (int j = 0; j < 3; j++)
+			{
+				unsigned int element = mesh.elements[i * 3 + j];
+				Vertex& vertex = m_triangles[i].vertices[j];
+
+				vertex = Vertex{};
+				vertex.position = mesh.positions[element];
+				vertex.color = mesh.colors ? mesh.colors[element] : glm::vec4(1.0f);
+				vertex.uv = mesh.uvs ? mesh.uvs[element] : glm::vec2(0.0f);
+				vertex.texture = mesh.texture;
+			}
+		}
+
+		build();
+	}
+
+	/**
+	 * @brief Escape links of a tree whose parents come before their children, for a walk without stack: it goes
+	 * down to node_left when a node is hit, and on to the escape of the node when it is missed or is a leaf.
+	 * The escape of a left child is its sibling, the one of a right child is the escape of its parent.
+	 */
+	static std::vector<int> escapeLinks(const std::vector<Node>& nodes)
+	{
+		std::vector<int> escapes(nodes.size(), 0);
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			if (nodes[i].node_left > 0)
+			{
+				escapes[nodes[i].node_left] = nodes[i].node_right;
+				escapes[nodes[i].node_right] = escapes[i];
+			}
+		}
+		return escapes;
+	}
+
+private:
+
+	void build()
+	{
 		m_nodes.reserve(m_triangles.size());
 		m_indices.push(0);
 		m_root_node = buildNode(0, m_triangles.size(), AXIS_X);
+		m_escapes = escapeLinks(m_nodes);
 	}
 
-private:
-
 	size_t buildNode(int first, int last, Axis axis)
 	{
 		// 1. Create a new node to the m_node vector
@@ -95,7 +145,7 @@ private:
 		if ((last - first) <= m_leaf_max_size || m_indices.size() - 1 >= m_depth_max_size)
 		{
 
-#ifdef SATANIA_BVH_CLUSTER_COLORED
+#if SATANIA_BVH_CLUSTER_COLORED
 
 			glm::vec4 color(1.0f);
 			color.r = (rand() % 16) / 16.0;
@@ -0,0 +1,1215 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SATANIA_OVERLAP_AVX2 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define SATANIA_TARGET_AVX2
+#else
+#define SATANIA_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define SATANIA_OVERLAP_AVX2 0
+#endif
+
+#include "material.hpp"
+#include "pack.hpp"
+#include "scene.hpp"
+#include "stats.hpp"
+
+/**
+ * CPU port of voxelizer.comp, used where no GPU is available (benchmarks, reference output).
+ * The tests and the traversal follow the shader step by step so both give the same voxels.
+ */
+namespace cpu_voxelizer
+{
+    /**
+     * @brief Arithmetic of the walk. voxelizer.comp is compiled for one of them, with FLOAT_PRECISION 1 for
+     * PRECISION_FLOAT.
+     */
+    enum Precision
+    {
+        PRECISION_DOUBLE, // world space doubles, the reference
+        PRECISION_FLOAT,  // floats relative to the tile origin, see Voxel and LocalMeshes
+        PRECISION_MAX
+    };
+
+    /**
+     * @brief Voxel box tested by a walk. The float walk takes the bounds and the vertices relative to origin,
+     * the grid minimum rounded to float (_TileOrigin in voxelizer.comp), so it needs no double.
+     */
+    struct Voxel
+    {
+        glm::dvec3 center;
+        double half_length;
+        glm::vec3 origin = glm::vec3(0.0f);
+        glm::vec3 local_center = glm::vec3(0.0f); // center - origin in float
+    };
+
+    /**
+     * @brief Voxel grid to fill, voxel (i, j, k) is centered on min + (i, j, k) * resolution like in the shader
+     */
+    struct Grid
+    {
+        glm::dvec3 min;
+        glm::ivec3 size;
+        double resolution;
+        pack::Layout layout = pack::LAYOUT_LINEAR;
+        float splat_threshold = 0.5f;
+        Precision precision = PRECISION_DOUBLE;
+        const material::Materials *materials = nullptr; // blocks from the triangle colors, 1 for every voxel if null
+
+        /**
+         * @brief Voxel (x, y, z), its float center computed like in the shader when min is a float
+         */
+        Voxel voxel(int x, int y, int z) const
+        {
+            Voxel voxel{min + glm::dvec3(x, y, z) * resolution, resolution / 2.0};
+            if (precision == PRECISION_FLOAT)
+            {
+                voxel.origin = glm::vec3(min);
+                voxel.local_center =
+                    glm::vec3(min - glm::dvec3(voxel.origin)) + glm::vec3(x, y, z) * (float)resolution;
+            }
+            return voxel;
+        }
+    };
+
+    inline bool testTriangleAxis(const glm::dvec3 &vertex_0, const glm::dvec3 &vertex_1, const glm::dvec3 &vertex_2,
+                                 const glm::dvec3 &axis, double box_half_length)
+    {
+        double half_distance = box_half_length * (std::abs(axis.x) + std::abs(axis.y) + std::abs(axis.z));
+
+        double proj_0 = glm::dot(axis, vertex_0);
+        double proj_1 = glm::dot(axis, vertex_1);
+        double proj_2 = glm::dot(axis, vertex_2);
+
+        double proj_min = std::min({proj_0, proj_1, proj_2});
+        double proj_max = std::max({proj_0, proj_1, proj_2});
+
+        return proj_max < -half_distance || proj_min > half_distance;
+    }
+
+    inline bool triangleBoxOverlap(const glm::dvec3 &box_center, double box_half_length, glm::dvec3 vertex_0,
+                                   glm::dvec3 vertex_1, glm::dvec3 vertex_2)
+    {
+        vertex_0 -= box_center;
+        vertex_1 -= box_center;
+        vertex_2 -= box_center;
+
+        if (testTriangleAxis(vertex_0, vertex_1, vertex_2, glm::dvec3(1, 0, 0), box_half_length) ||
+            testTriangleAxis(vertex_0, vertex_1, vertex_2, glm::dvec3(0, 1, 0), box_half_length) ||
+            testTriangleAxis(vertex_0, vertex_1, vertex_2, glm::dvec3(0, 0, 1), box_half_length))
+        {
+            return false;
+        }
+
+        glm::dvec3 triangle_normal = glm::normalize(glm::cross(vertex_1 - vertex_0, vertex_2 - vertex_1));
+        if (testTriangleAxis(vertex_0, vertex_1, vertex_2, triangle_normal, box_half_length))
+        {
+            return false;
+        }
+
+        const glm::dvec3 edges[3] = {glm::normalize(vertex_1 - vertex_0), glm::normalize(vertex_2 - vertex_1),
+                                     glm::normalize(vertex_0 - vertex_2)};
+        for (const auto &edge : edges)
+        {
+            if (testTriangleAxis(vertex_0, vertex_1, vertex_2, glm::dvec3(0.0, -edge.z, edge.y), box_half_length) ||
+                testTriangleAxis(vertex_0, vertex_1, vertex_2, glm::dvec3(edge.z, 0.0, -edge.x), box_half_length) ||
+                testTriangleAxis(vertex_0, vertex_1, vertex_2, glm::dvec3(-edge.y, edge.x, 0.0), box_half_length))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Bounds test, exact accept and splatting before the full test, see triangleVoxelOverlap in voxelizer.comp
+    inline bool triangleVoxelOverlap(const glm::dvec3 &box_center, double box_half_length, const glm::dvec3 &vertex_0,
+                                     const glm::dvec3 &vertex_1, const glm::dvec3 &vertex_2, float splat_threshold)
+    {
+        const glm::dvec3 triangle_min = glm::min(glm::min(vertex_0, vertex_1), vertex_2) - box_center;
+        const glm::dvec3 triangle_max = glm::max(glm::max(vertex_0, vertex_1), vertex_2) - box_center;
+
+        for (int i = 0; i < 3; i++)
+        {
+            if (triangle_max[i] < -box_half_length || triangle_min[i] > box_half_length)
+            {
+                return false;
+            }
+        }
+
+        bool inside = true;
+        for (int i = 0; i < 3; i++)
+        {
+            inside &= triangle_min[i] >= -box_half_length && triangle_max[i] <= box_half_length;
+        }
+        if (inside)
+        {
+            return true;
+        }
+
+        const glm::dvec3 triangle_size = triangle_max - triangle_min;
+        if (std::max({triangle_size.x, triangle_size.y, triangle_size.z}) <= splat_threshold * 2.0 * box_half_length)
+        {
+            return true;
+        }
+
+        return triangleBoxOverlap(box_center, box_half_length, vertex_0, vertex_1, vertex_2);
+    }
+
+    inline bool testTriangleAxis(const glm::vec3 &vertex_0, const glm::vec3 &vertex_1, const glm::vec3 &vertex_2,
+                                 const glm::vec3 &axis, float box_half_length)
+    {
+        float half_distance = box_half_length * (std::abs(axis.x) + std::abs(axis.y) + std::abs(axis.z));
+
+        float proj_0 = glm::dot(axis, vertex_0);
+        float proj_1 = glm::dot(axis, vertex_1);
+        float proj_2 = glm::dot(axis, vertex_2);
+
+        float proj_min = std::min({proj_0, proj_1, proj_2});
+        float proj_max = std::max({proj_0, proj_1, proj_2});
+
+        return proj_max < -half_distance || proj_min > half_distance;
+    }
+
+    /**
+     * @brief triangleVoxelOverlap in float, see triangleVoxelOverlapFloat in voxelizer.comp. The vertices are
+     * relative to the voxel center, taken from the tile origin then from the center (see Voxel), so a vertex
+     * off a face of the voxel only changes side within a float rounding of its tile local position.
+     *
+     * The axes are not normalized, the side of the box a triangle projects on does not depend on their
+     * length. Only +, - and * are left, correctly rounded on the CPU and on the GPU alike, so both give the
+     * same result.
+     */
+    inline bool triangleVoxelOverlapFloat(float box_half_length, const glm::vec3 &vertex_0, const glm::vec3 &vertex_1,
+                                          const glm::vec3 &vertex_2, float splat_threshold)
+    {
+        const glm::vec3 triangle_min = glm::min(glm::min(vertex_0, vertex_1), vertex_2);
+        const glm::vec3 triangle_max = glm::max(glm::max(vertex_0, vertex_1), vertex_2);
+
+        bool inside = true;
+        for (int i = 0; i < 3; i++)
+        {
+            if (triangle_max[i] < -box_half_length || triangle_min[i] > box_half_length)
+            {
+                return false;
+            }
+            inside &= triangle_min[i] >= -box_half_length && triangle_max[i] <= box_half_length;
+        }
+        if (inside)
+        {
+            return true;
+        }
+
+        const glm::vec3 triangle_size = triangle_max - triangle_min;
+        if (std::max({triangle_size.x, triangle_size.y, triangle_size.z}) <= splat_threshold * 2.0f * box_half_length)
+        {
+            return true;
+        }
+
+        // The box normals are the bounds above
+        const glm::vec3 edges[3] = {vertex_1 - vertex_0, vertex_2 - vertex_1, vertex_0 - vertex_2};
+        if (testTriangleAxis(vertex_0, vertex_1, vertex_2, glm::cross(edges[0], edges[1]), box_half_length))
+        {
+            return false;
+        }
+
+        for (const auto &edge : edges)
+        {
+            if (testTriangleAxis(vertex_0, vertex_1, vertex_2, glm::vec3(0.0f, -edge.z, edge.y), box_half_length) ||
+                testTriangleAxis(vertex_0, vertex_1, vertex_2, glm::vec3(edge.z, 0.0f, -edge.x), box_half_length) ||
+                testTriangleAxis(vertex_0, vertex_1, vertex_2, glm::vec3(-edge.y, edge.x, 0.0f), box_half_length))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Triangles of a leaf packed lane by lane, for testing them against a voxel with one SIMD test
+     */
+    struct TriangleBlock
+    {
+        static constexpr int size = 4;
+
+        alignas(32) double vertices[3][3][size]; // [vertex][axis][lane]
+
+        void set(int lane, const glm::dvec3 (&triangle)[3])
+        {
+            for (int v = 0; v < 3; v++)
+            {
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    vertices[v][axis][lane] = triangle[v][axis];
+                }
+            }
+        }
+
+        glm::dvec3 vertex(int lane, int v) const
+        {
+            return glm::dvec3(vertices[v][0][lane], vertices[v][1][lane], vertices[v][2][lane]);
+        }
+    };
+
+    /**
+     * @brief Lanes of a block whose triangle touches a voxel, bit i set for lane i < count
+     */
+    inline uint32_t triangleBlockOverlapScalar(const TriangleBlock &block, int count, const glm::dvec3 &box_center,
+                                               double box_half_length, float splat_threshold)
+    {
+        uint32_t mask = 0;
+        for (int i = 0; i < count; i++)
+        {
+            bool overlap = triangleVoxelOverlap(box_center, box_half_length, block.vertex(i, 0), block.vertex(i, 1),
+                                                block.vertex(i, 2), splat_threshold);
+            mask |= (uint32_t)overlap << i;
+        }
+        return mask;
+    }
+
+#if SATANIA_OVERLAP_AVX2
+    SATANIA_TARGET_AVX2 inline __m256d absAVX2(__m256d x)
+    {
+        return _mm256_andnot_pd(_mm256_set1_pd(-0.0), x);
+    }
+
+    // axis . vertex, summed in the order of glm::dot
+    SATANIA_TARGET_AVX2 inline __m256d projectAVX2(__m256d x, __m256d y, __m256d z, const __m256d (&vertex)[3])
+    {
+        return _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(x, vertex[0]), _mm256_mul_pd(y, vertex[1])),
+                             _mm256_mul_pd(z, vertex[2]));
+    }
+
+    // v * (1 / sqrt(dot(v, v))) like glm::normalize
+    SATANIA_TARGET_AVX2 inline void normalizeAVX2(__m256d &x, __m256d &y, __m256d &z)
+    {
+        __m256d length_2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(x, x), _mm256_mul_pd(y, y)), _mm256_mul_pd(z, z));
+        __m256d inverse = _mm256_div_pd(_mm256_set1_pd(1.0), _mm256_sqrt_pd(length_2));
+        x = _mm256_mul_pd(x, inverse);
+        y = _mm256_mul_pd(y, inverse);
+        z = _mm256_mul_pd(z, inverse);
+    }
+
+    // Lanes whose projected triangle is out of [-half_distance, half_distance], see testTriangleAxis
+    SATANIA_TARGET_AVX2 inline __m256d separatesAVX2(__m256d proj_0, __m256d proj_1, __m256d proj_2,
+                                                     __m256d half_distance)
+    {
+        __m256d proj_min = _mm256_min_pd(_mm256_min_pd(proj_0, proj_1), proj_2);
+        __m256d proj_max = _mm256_max_pd(_mm256_max_pd(proj_0, proj_1), proj_2);
+        return _mm256_or_pd(_mm256_cmp_pd(proj_max, _mm256_sub_pd(_mm256_setzero_pd(), half_distance), _CMP_LT_OQ),
+                            _mm256_cmp_pd(proj_min, half_distance, _CMP_GT_OQ));
+    }
+
+    /**
+     * @brief Same as triangleBlockOverlapScalar with the 4 lanes in AVX2 registers. Every value is rounded like
+     * in the scalar test, so both return the same mask:
+     * - the bounds are taken after subtracting the center, which gives the same values since rounding keeps
+     *   the order;
+     * - the box axes are skipped, after the bounds test they never separate;
+     * - the zero terms of the edge axes are dropped, they only change the sign of a zero.
+     * Only mul/add/sub intrinsics are used, the compiler cannot fuse them into FMAs.
+     */
+    SATANIA_TARGET_AVX2 inline uint32_t triangleBlockOverlapAVX2(const TriangleBlock &block, int count,
+                                                                 const glm::dvec3 &box_center,
+                                                                 double box_half_length, float splat_threshold)
+    {
+        const __m256d half = _mm256_set1_pd(box_half_length);
+        const __m256d minus_half = _mm256_set1_pd(-box_half_length);
+        const int lanes = (1 << count) - 1;
+
+        __m256d v[3][3]; // [vertex][axis], relative to the box center
+        for (int i = 0; i < 3; i++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                v[i][axis] = _mm256_sub_pd(_mm256_load_pd(block.vertices[i][axis]), _mm256_set1_pd(box_center[axis]));
+            }
+        }
+
+        __m256d separated = _mm256_setzero_pd();
+        __m256d inside = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+        __m256d largest_size = _mm256_setzero_pd();
+        for (int axis = 0; axis < 3; axis++)
+        {
+            __m256d low = _mm256_min_pd(_mm256_min_pd(v[0][axis], v[1][axis]), v[2][axis]);
+            __m256d high = _mm256_max_pd(_mm256_max_pd(v[0][axis], v[1][axis]), v[2][axis]);
+            separated = _mm256_or_pd(separated, _mm256_or_pd(_mm256_cmp_pd(high, minus_half, _CMP_LT_OQ),
+                                                             _mm256_cmp_pd(low, half, _CMP_GT_OQ)));
+            inside = _mm256_and_pd(inside, _mm256_and_pd(_mm256_cmp_pd(low, minus_half, _CMP_GE_OQ),
+                                                         _mm256_cmp_pd(high, half, _CMP_LE_OQ)));
+            largest_size = _mm256_max_pd(largest_size, _mm256_sub_pd(high, low));
+        }
+
+        const __m256d splat = _mm256_cmp_pd(largest_size, _mm256_set1_pd(splat_threshold * 2.0 * box_half_length),
+                                            _CMP_LE_OQ);
+        const int accepted = _mm256_movemask_pd(_mm256_andnot_pd(separated, _mm256_or_pd(inside, splat))) & lanes;
+        const int undecided = ~_mm256_movemask_pd(_mm256_or_pd(separated, _mm256_or_pd(inside, splat))) & lanes;
+        if (undecided == 0)
+        {
+            return (uint32_t)accepted;
+        }
+
+        __m256d edges[3][3]; // [edge][axis], the edge i goes from the vertex i to the next one
+        for (int i = 0; i < 3; i++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                edges[i][axis] = _mm256_sub_pd(v[(i + 1) % 3][axis], v[i][axis]);
+            }
+        }
+
+        // Normal, cross(vertex_1 - vertex_0, vertex_2 - vertex_1) with the operands of glm::cross
+        const __m256d(&a)[3] = edges[0];
+        const __m256d(&b)[3] = edges[1];
+        __m256d normal_x = _mm256_sub_pd(_mm256_mul_pd(a[1], b[2]), _mm256_mul_pd(b[1], a[2]));
+        __m256d normal_y = _mm256_sub_pd(_mm256_mul_pd(a[2], b[0]), _mm256_mul_pd(b[2], a[0]));
+        __m256d normal_z = _mm256_sub_pd(_mm256_mul_pd(a[0], b[1]), _mm256_mul_pd(b[0], a[1]));
+        normalizeAVX2(normal_x, normal_y, normal_z);
+        const __m256d normal_half = _mm256_mul_pd(
+            half, _mm256_add_pd(_mm256_add_pd(absAVX2(normal_x), absAVX2(normal_y)), absAVX2(normal_z)));
+        separated = _mm256_or_pd(separated,
+                                 separatesAVX2(projectAVX2(normal_x, normal_y, normal_z, v[0]),
+                                               projectAVX2(normal_x, normal_y, normal_z, v[1]),
+                                               projectAVX2(normal_x, normal_y, normal_z, v[2]), normal_half));
+
+        for (int i = 0; i < 3; i++)
+        {
+            __m256d x = edges[i][0];
+            __m256d y = edges[i][1];
+            __m256d z = edges[i][2];
+            normalizeAVX2(x, y, z);
+
+            // (0, -z, y), (z, 0, -x) and (-y, x, 0)
+            __m256d proj[3][3];
+            for (int j = 0; j < 3; j++)
+            {
+                proj[0][j] = _mm256_sub_pd(_mm256_mul_pd(y, v[j][2]), _mm256_mul_pd(z, v[j][1]));
+                proj[1][j] = _mm256_sub_pd(_mm256_mul_pd(z, v[j][0]), _mm256_mul_pd(x, v[j][2]));
+                proj[2][j] = _mm256_sub_pd(_mm256_mul_pd(x, v[j][1]), _mm256_mul_pd(y, v[j][0]));
+            }
+            const __m256d abs_x = absAVX2(x);
+            const __m256d abs_y = absAVX2(y);
+            const __m256d abs_z = absAVX2(z);
+            const __m256d half_distances[3] = {_mm256_mul_pd(half, _mm256_add_pd(abs_z, abs_y)),
+                                               _mm256_mul_pd(half, _mm256_add_pd(abs_z, abs_x)),
+                                               _mm256_mul_pd(half, _mm256_add_pd(abs_y, abs_x))};
+            for (int j = 0; j < 3; j++)
+            {
+                separated =
+                    _mm256_or_pd(separated, separatesAVX2(proj[j][0], proj[j][1], proj[j][2], half_distances[j]));
+            }
+        }
+
+        return (uint32_t)(accepted | (~_mm256_movemask_pd(separated) & undecided));
+    }
+#endif
+
+    /**
+     * @brief Whether the CPU runs AVX2, checked once
+     */
+    inline bool hasAVX2()
+    {
+#if SATANIA_OVERLAP_AVX2
+        static const bool supported = []() {
+#if defined(_MSC_VER) && !defined(__clang__)
+            int info[4];
+            __cpuid(info, 0);
+            if (info[0] < 7)
+            {
+                return false;
+            }
+            // AVX state saved by the OS (OSXSAVE, AVX and XCR0 bits 1-2), then the AVX2 bit
+            __cpuid(info, 1);
+            if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6)
+            {
+                return false;
+            }
+            __cpuidex(info, 7, 0);
+            return (info[1] & (1 << 5)) != 0;
+#else
+            return __builtin_cpu_supports("avx2") != 0;
+#endif
+        }();
+        return supported;
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * @brief First local triangle (x) and node (y) of every instance in a list, then their totals: the meshes of
+     * the instances numbered instance after instance, like LocalMeshes and local_meshes.comp store them
+     */
+    inline std::vector<glm::ivec2> localFirsts(const SceneBVH &bvh,
+                                               const std::vector<SceneBVH::GPUInstance> &instances)
+    {
+        // Instances only know where their mesh starts, the counts are found from the node offset
+        std::unordered_map<int, glm::ivec2> counts;
+        for (const auto &range : bvh.m_meshes)
+        {
+            if (range.triangle_count > 0)
+            {
+                counts[range.node_offset] = glm::ivec2(range.triangle_count, range.node_count);
+            }
+        }
+
+        std::vector<glm::ivec2> firsts(instances.size() + 1, glm::ivec2(0));
+        for (size_t i = 0; i < instances.size(); i++)
+        {
+            auto count = counts.find(instances[i].node_offset);
+            firsts[i + 1] = firsts[i] + (count != counts.end() ? count->second : glm::ivec2(0));
+        }
+        return firsts;
+    }
+
+    /**
+     * @brief Triangles and node bounds of the instances of a grid in float relative to its origin, transformed
+     * once for the whole grid so the float walk only compares against the voxel center. Each triangle coordinate
+     * is stored in its own array, so the consecutive triangles of a leaf load a block at a time.
+     */
+    struct LocalMeshes
+    {
+        static constexpr int block_size = 8;
+
+        std::vector<glm::ivec2> firsts;    // see localFirsts, indexed like the instances of the walk
+        std::vector<float> vertices[3][3]; // [vertex][axis][triangle], a block of padding at the end
+        std::vector<glm::vec3> node_min;   // bounds of the transformed mesh nodes, as the binary walk tests them
+        std::vector<glm::vec3> node_max;
+
+        LocalMeshes(const SceneBVH &bvh, const std::vector<SceneBVH::GPUInstance> &instances, const Grid &grid)
+            : firsts(localFirsts(bvh, instances))
+        {
+            const glm::vec3 origin = glm::vec3(grid.min);
+            for (auto &vertex : vertices)
+            {
+                for (auto &axis : vertex)
+                {
+                    axis.assign((size_t)firsts.back().x + block_size, 0.0f);
+                }
+            }
+            node_min.resize(firsts.back().y);
+            node_max.resize(firsts.back().y);
+
+            for (size_t i = 0; i < instances.size(); i++)
+            {
+                const SceneBVH::GPUInstance &instance = instances[i];
+                for (int t = 0; t < firsts[i + 1].x - firsts[i].x; t++)
+                {
+                    const BVH::Triangle &triangle = bvh.m_triangles[instance.triangle_offset + t];
+                    for (int v = 0; v < 3; v++)
+                    {
+                        // Rounded to float in world space first, like the shader
+                        glm::vec4 position = glm::vec4(triangle.vertices[v].position, 1.0f);
+                        glm::vec3 local = glm::vec3(instance.transform * position) - origin;
+                        for (int axis = 0; axis < 3; axis++)
+                        {
+                            vertices[v][axis][firsts[i].x + t] = local[axis];
+                        }
+                    }
+                }
+
+                const glm::mat3 abs_transform =
+                    glm::mat3(glm::abs(glm::vec3(instance.transform[0])), glm::abs(glm::vec3(instance.transform[1])),
+                              glm::abs(glm::vec3(instance.transform[2])));
+                for (int n = 0; n < firsts[i + 1].y - firsts[i].y; n++)
+                {
+                    const BVH::Node &node = bvh.m_nodes[instance.node_offset + n];
+                    glm::vec3 center =
+                        glm::vec3(instance.transform * glm::vec4((node.aabb.min + node.aabb.max) * 0.5f, 1.0f));
+                    glm::vec3 extent = abs_transform * ((node.aabb.max - node.aabb.min) * 0.5f);
+                    node_min[firsts[i].y + n] = (center - extent) - origin;
+                    node_max[firsts[i].y + n] = (center + extent) - origin;
+                }
+            }
+        }
+
+        glm::vec3 vertex(int triangle, int v) const
+        {
+            return glm::vec3(vertices[v][0][triangle], vertices[v][1][triangle], vertices[v][2][triangle]);
+        }
+    };
+
+    /**
+     * @brief Lanes of the local triangles first to first + count (at most a block) touching a voxel, with
+     * triangleVoxelOverlapFloat
+     */
+    inline uint32_t triangleBlockOverlapFloatScalar(const LocalMeshes &local, int first, int count,
+                                                    const glm::vec3 &local_center, float box_half_length,
+                                                    float splat_threshold)
+    {
+        uint32_t mask = 0;
+        for (int i = 0; i < count; i++)
+        {
+            bool overlap = triangleVoxelOverlapFloat(box_half_length, local.vertex(first + i, 0) - local_center,
+                                                     local.vertex(first + i, 1) - local_center,
+                                                     local.vertex(first + i, 2) - local_center, splat_threshold);
+            mask |= (uint32_t)overlap << i;
+        }
+        return mask;
+    }
+
+#if SATANIA_OVERLAP_AVX2
+    SATANIA_TARGET_AVX2 inline __m256 absFloatAVX2(__m256 x)
+    {
+        return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), x);
+    }
+
+    // Lanes whose projected triangle is out of [-half_distance, half_distance], see testTriangleAxis
+    SATANIA_TARGET_AVX2 inline __m256 separatesFloatAVX2(__m256 proj_0, __m256 proj_1, __m256 proj_2,
+                                                         __m256 half_distance)
+    {
+        __m256 proj_min = _mm256_min_ps(_mm256_min_ps(proj_0, proj_1), proj_2);
+        __m256 proj_max = _mm256_max_ps(_mm256_max_ps(proj_0, proj_1), proj_2);
+        return _mm256_or_ps(_mm256_cmp_ps(proj_max, _mm256_sub_ps(_mm256_setzero_ps(), half_distance), _CMP_LT_OQ),
+                            _mm256_cmp_ps(proj_min, half_distance, _CMP_GT_OQ));
+    }
+
+    /**
+     * @brief Same as triangleBlockOverlapFloatScalar with the 8 lanes in AVX2 registers, rounded like the
+     * scalar test as triangleBlockOverlapAVX2 is. The axes are not normalized here either.
+     */
+    SATANIA_TARGET_AVX2 inline uint32_t triangleBlockOverlapFloatAVX2(const LocalMeshes &local, int first,
+                                                                      int count, const glm::vec3 &local_center,
+                                                                      float box_half_length, float splat_threshold)
+    {
+        const __m256 half = _mm256_set1_ps(box_half_length);
+        const __m256 minus_half = _mm256_set1_ps(-box_half_length);
+        const int lanes = (1 << count) - 1;
+
+        __m256 v[3][3]; // [vertex][axis], relative to the box center
+        for (int i = 0; i < 3; i++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                v[i][axis] = _mm256_sub_ps(_mm256_loadu_ps(local.vertices[i][axis].data() + first),
+                                           _mm256_set1_ps(local_center[axis]));
+            }
+        }
+
+        __m256 separated = _mm256_setzero_ps();
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        __m256 largest_size = _mm256_setzero_ps();
+        for (int axis = 0; axis < 3; axis++)
+        {
+            __m256 low = _mm256_min_ps(_mm256_min_ps(v[0][axis], v[1][axis]), v[2][axis]);
+            __m256 high = _mm256_max_ps(_mm256_max_ps(v[0][axis], v[1][axis]), v[2][axis]);
+            separated = _mm256_or_ps(separated, _mm256_or_ps(_mm256_cmp_ps(high, minus_half, _CMP_LT_OQ),
+                                                             _mm256_cmp_ps(low, half, _CMP_GT_OQ)));
+            inside = _mm256_and_ps(inside, _mm256_and_ps(_mm256_cmp_ps(low, minus_half, _CMP_GE_OQ),
+                                                         _mm256_cmp_ps(high, half, _CMP_LE_OQ)));
+            largest_size = _mm256_max_ps(largest_size, _mm256_sub_ps(high, low));
+        }
+
+        const __m256 splat =
+            _mm256_cmp_ps(largest_size, _mm256_set1_ps(splat_threshold * 2.0f * box_half_length), _CMP_LE_OQ);
+        const int accepted = _mm256_movemask_ps(_mm256_andnot_ps(separated, _mm256_or_ps(inside, splat))) & lanes;
+        const int undecided = ~_mm256_movemask_ps(_mm256_or_ps(separated, _mm256_or_ps(inside, splat))) & lanes;
+        if (undecided == 0)
+        {
+            return (uint32_t)accepted;
+        }
+
+        __m256 edges[3][3]; // [edge][axis], the edge i goes from the vertex i to the next one
+        for (int i = 0; i < 3; i++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                edges[i][axis] = _mm256_sub_ps(v[(i + 1) % 3][axis], v[i][axis]);
+            }
+        }
+
+        // Normal, cross(vertex_1 - vertex_0, vertex_2 - vertex_1) with the operands of glm::cross
+        const __m256(&a)[3] = edges[0];
+        const __m256(&b)[3] = edges[1];
+        const __m256 normal[3] = {_mm256_sub_ps(_mm256_mul_ps(a[1], b[2]), _mm256_mul_ps(b[1], a[2])),
+                                  _mm256_sub_ps(_mm256_mul_ps(a[2], b[0]), _mm256_mul_ps(b[2], a[0])),
+                                  _mm256_sub_ps(_mm256_mul_ps(a[0], b[1]), _mm256_mul_ps(b[0], a[1]))};
+        const __m256 normal_half =
+            _mm256_mul_ps(half, _mm256_add_ps(_mm256_add_ps(absFloatAVX2(normal[0]), absFloatAVX2(normal[1])),
+                                              absFloatAVX2(normal[2])));
+        __m256 normal_proj[3];
+        for (int j = 0; j < 3; j++)
+        {
+            normal_proj[j] = _mm256_add_ps(
+                _mm256_add_ps(_mm256_mul_ps(normal[0], v[j][0]), _mm256_mul_ps(normal[1], v[j][1])),
+                _mm256_mul_ps(normal[2], v[j][2]));
+        }
+        separated = _mm256_or_ps(separated,
+                                 separatesFloatAVX2(normal_proj[0], normal_proj[1], normal_proj[2], normal_half));
+
+        for (int i = 0; i < 3; i++)
+        {
+            const __m256 x = edges[i][0];
+            const __m256 y = edges[i][1];
+            const __m256 z = edges[i][2];
+
+            // (0, -z, y), (z, 0, -x) and (-y, x, 0)
+            __m256 proj[3][3];
+            for (int j = 0; j < 3; j++)
+            {
+                proj[0][j] = _mm256_sub_ps(_mm256_mul_ps(y, v[j][2]), _mm256_mul_ps(z, v[j][1]));
+                proj[1][j] = _mm256_sub_ps(_mm256_mul_ps(z, v[j][0]), _mm256_mul_ps(x, v[j][2]));
+                proj[2][j] = _mm256_sub_ps(_mm256_mul_ps(x, v[j][1]), _mm256_mul_ps(y, v[j][0]));
+            }
+            const __m256 abs_x = absFloatAVX2(x);
+            const __m256 abs_y = absFloatAVX2(y);
+            const __m256 abs_z = absFloatAVX2(z);
+            const __m256 half_distances[3] = {_mm256_mul_ps(half, _mm256_add_ps(abs_z, abs_y)),
+                                              _mm256_mul_ps(half, _mm256_add_ps(abs_z, abs_x)),
+                                              _mm256_mul_ps(half, _mm256_add_ps(abs_y, abs_x))};
+            for (int j = 0; j < 3; j++)
+            {
+                separated =
+                    _mm256_or_ps(separated, separatesFloatAVX2(proj[j][0], proj[j][1], proj[j][2], half_distances[j]));
+            }
+        }
+
+        return (uint32_t)(accepted | (~_mm256_movemask_ps(separated) & undecided));
+    }
+#endif
+
+    /**
+     * @brief Lanes of a block of local triangles touching a voxel, with AVX2 when the CPU has it
+     */
+    inline uint32_t triangleBlockOverlapFloat(const LocalMeshes &local, int first, int count,
+                                              const glm::vec3 &local_center, float box_half_length,
+                                              float splat_threshold)
+    {
+#if SATANIA_OVERLAP_AVX2
+        if (hasAVX2())
+        {
+            return triangleBlockOverlapFloatAVX2(local, first, count, local_center, box_half_length,
+                                                 splat_threshold);
+        }
+#endif
+        return triangleBlockOverlapFloatScalar(local, first, count, local_center, box_half_length, splat_threshold);
+    }
+
+    /**
+     * @brief Lanes of a block whose triangle touches a voxel, with AVX2 when the CPU has it
+     */
+    inline uint32_t triangleBlockOverlap(const TriangleBlock &block, int count, const Voxel &voxel,
+                                         float splat_threshold)
+    {
+#if SATANIA_OVERLAP_AVX2
+        if (hasAVX2())
+        {
+            return triangleBlockOverlapAVX2(block, count, voxel.center, voxel.half_length, splat_threshold);
+        }
+#endif
+        return triangleBlockOverlapScalar(block, count, voxel.center, voxel.half_length, splat_threshold);
+    }
+
+    /**
+     * @brief Barycentric coordinates of the point of a triangle closest to p in the arithmetic of the walk, see
+     * closestBarycentric in voxelizer.comp
+     */
+    template <typename Real>
+    inline glm::vec<3, Real> closestBarycentric(const glm::vec<3, Real> &p, const glm::vec<3, Real> &a,
+                                                const glm::vec<3, Real> &b, const glm::vec<3, Real> &c)
+    {
+        // Voronoi regions of the vertices, then of the edges, then the face (Ericson, Real-Time Collision Detection)
+        const glm::vec<3, Real> ab = b - a;
+        const glm::vec<3, Real> ac = c - a;
+        const glm::vec<3, Real> ap = p - a;
+        Real d1 = glm::dot(ab, ap);
+        Real d2 = glm::dot(ac, ap);
+        if (d1 <= 0.0 && d2 <= 0.0)
+        {
+            return glm::vec<3, Real>(1.0, 0.0, 0.0);
+        }
+
+        const glm::vec<3, Real> bp = p - b;
+        Real d3 = glm::dot(ab, bp);
+        Real d4 = glm::dot(ac, bp);
+        if (d3 >= 0.0 && d4 <= d3)
+        {
+            return glm::vec<3, Real>(0.0, 1.0, 0.0);
+        }
+
+        Real vc = d1 * d4 - d3 * d2;
+        if (vc <= 0.0 && d1 >= 0.0 && d3 <= 0.0)
+        {
+            Real v = d1 / (d1 - d3);
+            return glm::vec<3, Real>(Real(1) - v, v, 0.0);
+        }
+
+        const glm::vec<3, Real> cp = p - c;
+        Real d5 = glm::dot(ab, cp);
+        Real d6 = glm::dot(ac, cp);
+        if (d6 >= 0.0 && d5 <= d6)
+        {
+            return glm::vec<3, Real>(0.0, 0.0, 1.0);
+        }
+
+        Real vb = d5 * d2 - d1 * d6;
+        if (vb <= 0.0 && d2 >= 0.0 && d6 <= 0.0)
+        {
+            Real w = d2 / (d2 - d6);
+            return glm::vec<3, Real>(Real(1) - w, 0.0, w);
+        }
+
+        Real va = d3 * d6 - d5 * d4;
+        if (va <= 0.0 && d4 - d3 >= 0.0 && d5 - d6 >= 0.0)
+        {
+            Real w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+            return glm::vec<3, Real>(0.0, Real(1) - w, w);
+        }
+
+        // A triangle without area has no face region
+        Real sum = va + vb + vc;
+        if (sum <= 0.0)
+        {
+            return glm::vec<3, Real>(1.0, 0.0, 0.0);
+        }
+        Real v = vb / sum;
+        Real w = vc / sum;
+        return glm::vec<3, Real>(Real(1) - v - w, v, w);
+    }
+
+    inline bool aabbIntersect(const glm::dvec3 &pos, double extent, const glm::dvec3 &aabb_min,
+                              const glm::dvec3 &aabb_max)
+    {
+        return aabb_min.x <= pos.x + extent && pos.x - extent <= aabb_max.x && aabb_min.y <= pos.y + extent &&
+               pos.y - extent <= aabb_max.y && aabb_min.z <= pos.z + extent && pos.z - extent <= aabb_max.z;
+    }
+
+    /**
+     * @brief aabbIntersect in float, the bounds taken relative to the center like the vertices in
+     * triangleVoxelOverlapFloat. Rounding keeps the order, so a box culled here holds no triangle the
+     * overlap test would keep.
+     */
+    inline bool aabbIntersectFloat(const glm::vec3 &pos, float extent, const glm::vec3 &aabb_min,
+                                   const glm::vec3 &aabb_max)
+    {
+        const glm::vec3 to_min = aabb_min - pos;
+        const glm::vec3 to_max = aabb_max - pos;
+        return to_min.x <= extent && to_max.x >= -extent && to_min.y <= extent && to_max.y >= -extent &&
+               to_min.z <= extent && to_max.z >= -extent;
+    }
+
+    /**
+     * @brief Bounds test of the walks, in the arithmetic of their precision
+     */
+    template <Precision precision>
+    inline bool voxelIntersect(const Voxel &voxel, const glm::vec3 &aabb_min, const glm::vec3 &aabb_max)
+    {
+        if constexpr (precision == PRECISION_FLOAT)
+        {
+            return aabbIntersectFloat(voxel.local_center, (float)voxel.half_length, aabb_min - voxel.origin,
+                                      aabb_max - voxel.origin);
+        }
+        else
+        {
+            return aabbIntersect(voxel.center, voxel.half_length, glm::dvec3(aabb_min), glm::dvec3(aabb_max));
+        }
+    }
+
+    /**
+     * @brief Touching triangle nearest to the voxel center found so far by a walk
+     */
+    struct Hit
+    {
+        const BVH::Triangle *triangle = nullptr;
+        double distance = INFINITY;
+        glm::dvec3 barycentric = glm::dvec3(0.0);
+    };
+
+    /**
+     * @brief Keep the nearest of the touching triangles, the first in memory on a tie so the order of the walk
+     * does not matter. The distance is taken in the arithmetic of the walk, like the shader variants do.
+     *
+     * @param center voxel center, the origin of the vertices of the float walk
+     */
+    template <typename Real>
+    inline void nearestHit(const BVH::Triangle &triangle, const glm::vec<3, Real> (&vertices)[3],
+                           const glm::vec<3, Real> &center, Hit &hit)
+    {
+        glm::vec<3, Real> barycentric = closestBarycentric(center, vertices[0], vertices[1], vertices[2]);
+        glm::vec<3, Real> closest =
+            vertices[0] * barycentric.x + vertices[1] * barycentric.y + vertices[2] * barycentric.z;
+        double distance = glm::dot(closest - center, closest - center);
+        if (distance < hit.distance || (distance == hit.distance && &triangle < hit.triangle))
+        {
+            hit.triangle = &triangle;
+            hit.distance = distance;
+            hit.barycentric = glm::dvec3(barycentric);
+        }
+    }
+
+    /**
+     * @brief Test the triangles of a leaf against a voxel, a TriangleBlock at a time. Without materials the
+     * first touching triangle is the value, with materials the nearest one is kept.
+     *
+     * @param first first triangle of the leaf in SceneBVH::m_triangles
+     * @return true once the walk can stop
+     */
+    inline bool testTriangles(const SceneBVH &bvh, const SceneBVH::GPUInstance &instance, int first, int count,
+                              const Voxel &voxel, float splat_threshold, stats::Traversal *traversal,
+                              const material::Materials *materials, Hit &hit)
+    {
+        for (int block_first = first; block_first < first + count; block_first += TriangleBlock::size)
+        {
+            const int block_count = std::min(TriangleBlock::size, first + count - block_first);
+            if (traversal != nullptr)
+            {
+                traversal->triangle_tests += block_count;
+            }
+
+            TriangleBlock block;
+            for (int lane = 0; lane < TriangleBlock::size; lane++)
+            {
+                // The lanes past the end of the leaf repeat its last triangle, they are masked out
+                const BVH::Triangle &triangle = bvh.m_triangles[block_first + std::min(lane, block_count - 1)];
+                glm::dvec3 vertices[3];
+                for (int v = 0; v < 3; v++)
+                {
+                    glm::vec4 position = glm::vec4(triangle.vertices[v].position, 1.0f);
+                    vertices[v] = glm::dvec3(glm::vec3(instance.transform * position));
+                }
+                block.set(lane, vertices);
+            }
+
+            for (uint32_t mask = triangleBlockOverlap(block, block_count, voxel, splat_threshold); mask != 0;
+                 mask &= mask - 1)
+            {
+                const int lane = std::countr_zero(mask);
+                const BVH::Triangle &triangle = bvh.m_triangles[block_first + lane];
+                if (materials == nullptr)
+                {
+                    hit.triangle = &triangle;
+                    return true;
+                }
+
+                const glm::dvec3 vertices[3] = {block.vertex(lane, 0), block.vertex(lane, 1), block.vertex(lane, 2)};
+                nearestHit(triangle, vertices, voxel.center, hit);
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief testTriangles on the local triangles of the float walk, a block of them at a time. The nearest
+     * touching triangle is found in float too, from the voxel center.
+     *
+     * @param instance_index instance of the walk, local.firsts is indexed with it
+     * @param leaf first triangle of the leaf relative to the mesh
+     */
+    inline bool testTrianglesFloat(const SceneBVH &bvh, const LocalMeshes &local, int instance_index,
+                                   const SceneBVH::GPUInstance &instance, int leaf, int count, const Voxel &voxel,
+                                   float splat_threshold, stats::Traversal *traversal,
+                                   const material::Materials *materials, Hit &hit)
+    {
+        const int first = local.firsts[instance_index].x + leaf;
+        for (int block_first = first; block_first < first + count; block_first += LocalMeshes::block_size)
+        {
+            const int block_count = std::min(LocalMeshes::block_size, first + count - block_first);
+            if (traversal != nullptr)
+            {
+                traversal->triangle_tests += block_count;
+            }
+
+            for (uint32_t mask = triangleBlockOverlapFloat(local, block_first, block_count, voxel.local_center,
+                                                           (float)voxel.half_length, splat_threshold);
+                 mask != 0; mask &= mask - 1)
+            {
+                const int lane = std::countr_zero(mask);
+                const BVH::Triangle &triangle =
+                    bvh.m_triangles[instance.triangle_offset + leaf + block_first - first + lane];
+                if (materials == nullptr)
+                {
+                    hit.triangle = &triangle;
+                    return true;
+                }
+
+                const glm::vec3 vertices[3] = {local.vertex(block_first + lane, 0) - voxel.local_center,
+                                               local.vertex(block_first + lane, 1) - voxel.local_center,
+                                               local.vertex(block_first + lane, 2) - voxel.local_center};
+                nearestHit(triangle, vertices, glm::vec3(0.0f), hit);
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Walk the top level down to the instances whose bounds touch a voxel, without a stack (see
+     * BVH::escapeLinks). The root is not tested, the tile bounds are.
+     *
+     * @param top SceneBVH, or a binning::TileBVH over some of its instances
+     * @param walk_instance called with the index of every instance touched, returns true to stop the walk
+     */
+    template <Precision precision, typename TopLevel, typename WalkInstance>
+    inline void walkInstances(const TopLevel &top, const Voxel &voxel, stats::Traversal *traversal,
+                              WalkInstance &&walk_instance)
+    {
+        int top_index = 0;
+        do
+        {
+            const BVH::Node &top_node = top.m_top_nodes[top_index];
+            if (top_index > 0 && !voxelIntersect<precision>(voxel, top_node.aabb.min, top_node.aabb.max))
+            {
+                top_index = top.m_top_escapes[top_index];
+                continue;
+            }
+            if (traversal != nullptr)
+            {
+                traversal->nodes_visited++;
+            }
+
+            for (int instance_index = top_node.leaf; instance_index < top_node.leaf + top_node.leaf_elem;
+                 instance_index++)
+            {
+                const SceneBVH::GPUInstance &instance = top.m_instances[instance_index];
+                if (voxelIntersect<precision>(voxel, instance.bound_min, instance.bound_max) &&
+                    walk_instance(instance_index))
+                {
+                    return;
+                }
+            }
+
+            top_index = top_node.node_left > 0 ? top_node.node_left : top.m_top_escapes[top_index];
+        } while (top_index > 0);
+    }
+
+    /**
+     * @brief Walk both levels down to the leaves whose bounds touch a voxel. The double walk transforms the
+     * mesh nodes as it reaches them, the float walk reads them from the LocalMeshes of the grid.
+     *
+     * @param local converted meshes of the instances of top, null for PRECISION_DOUBLE
+     * @param test_leaf called with the instance index, the instance, the first triangle of the leaf relative
+     * to the mesh and the triangle count, returns true to stop the walk
+     */
+    template <Precision precision, typename TopLevel, typename TestLeaf>
+    inline void walkLeaves(const SceneBVH &bvh, const TopLevel &top, const LocalMeshes *local, const Voxel &voxel,
+                           stats::Traversal *traversal, TestLeaf &&test_leaf)
+    {
+        walkInstances<precision>(top, voxel, traversal, [&](int instance_index) {
+            const SceneBVH::GPUInstance &instance = top.m_instances[instance_index];
+            const glm::mat3 abs_transform =
+                glm::mat3(glm::abs(glm::vec3(instance.transform[0])), glm::abs(glm::vec3(instance.transform[1])),
+                          glm::abs(glm::vec3(instance.transform[2])));
+            auto node_touches = [&](const BVH::Node &node, int index) {
+                if constexpr (precision == PRECISION_FLOAT)
+                {
+                    const int local_index = local->firsts[instance_index].y + index;
+                    return aabbIntersectFloat(voxel.local_center, (float)voxel.half_length,
+                                              local->node_min[local_index], local->node_max[local_index]);
+                }
+                else
+                {
+                    glm::vec3 center =
+                        glm::vec3(instance.transform * glm::vec4((node.aabb.min + node.aabb.max) * 0.5f, 1.0f));
+                    glm::vec3 extent = abs_transform * ((node.aabb.max - node.aabb.min) * 0.5f);
+                    return voxelIntersect<precision>(voxel, center - extent, center + extent);
+                }
+            };
+
+            // The mesh BVH is walked like the top level, down to node_left on a hit and on to the escape link
+            int index = 0; // relative to the mesh
+            do
+            {
+                const BVH::Node &node = bvh.m_nodes[instance.node_offset + index];
+                if (index > 0 && !node_touches(node, index))
+                {
+                    index = bvh.m_escapes[instance.node_offset + index];
+                    continue;
+                }
+                if (traversal != nullptr)
+                {
+                    traversal->nodes_visited++;
+                }
+
+                if (node.leaf_elem > 0 && test_leaf(instance_index, instance, node.leaf, node.leaf_elem))
+                {
+                    return true;
+                }
+
+                index = node.node_left > 0 ? node.node_left : bvh.m_escapes[instance.node_offset + index];
+            } while (index > 0);
+            return false;
+        });
+    }
+
+    /**
+     * @brief Value of the voxel a walk ended on: 1 or the block of the nearest triangle color, 0 without hit
+     */
+    inline int hitValue(const Hit &hit, stats::Traversal *traversal, const material::Materials *materials)
+    {
+        if (hit.triangle == nullptr)
+        {
+            return 0;
+        }
+        if (traversal != nullptr)
+        {
+            traversal->filled_voxels++;
+        }
+        if (materials == nullptr)
+        {
+            return 1;
+        }
+
+        glm::vec4 color =
+            material::triangleColor(hit.triangle->vertices, glm::vec3(hit.barycentric), materials->textures);
+        return materials->lut.block(color);
+    }
+
+    /**
+     * @brief Value of one voxel: 1 if a triangle of the scene touches it, 0 otherwise. With materials, the
+     * block of the color of the touching triangle nearest to the voxel center.
+     *
+     * @param bvh mesh BVHs the instances of top point into
+     * @param top SceneBVH, or a binning::TileBVH over some of its instances
+     * @param traversal if not null, the nodes and triangles tested are added to it
+     */
+    template <typename TopLevel>
+    inline int voxelValue(const SceneBVH &bvh, const TopLevel &top, const Voxel &voxel, float splat_threshold,
+                          stats::Traversal *traversal = nullptr, const material::Materials *materials = nullptr)
+    {
+        if (traversal != nullptr)
+        {
+            traversal->voxels++;
+        }
+
+        if (top.empty())
+        {
+            return 0;
+        }
+
+        Hit hit;
+        auto test_leaf = [&](int, const SceneBVH::GPUInstance &instance, int leaf, int count) {
+            return testTriangles(bvh, instance, instance.triangle_offset + leaf, count, voxel, splat_threshold,
+                                 traversal, materials, hit);
+        };
+        walkLeaves<PRECISION_DOUBLE>(bvh, top, nullptr, voxel, traversal, test_leaf);
+        return hitValue(hit, traversal, materials);
+    }
+
+    /**
+     * @brief voxelValue with the float walk, on the meshes of top converted to the grid in local
+     */
+    template <typename TopLevel>
+    inline int voxelValue(const SceneBVH &bvh, const TopLevel &top, const LocalMeshes &local, const Voxel &voxel,
+                          float splat_threshold, stats::Traversal *traversal = nullptr,
+                          const material::Materials *materials = nullptr)
+    {
+        if (traversal != nullptr)
+        {
+            traversal->voxels++;
+        }
+
+        if (top.empty())
+        {
+            return 0;
+        }
+
+        Hit hit;
+        auto test_leaf = [&](int instance_index, const SceneBVH::GPUInstance &instance, int leaf, int count) {
+            return testTrianglesFloat(bvh, local, instance_index, instance, leaf, count, voxel, splat_threshold,
+                                      traversal, materials, hit);
+        };
+        walkLeaves<PRECISION_FLOAT>(bvh, top, &local, voxel, traversal, test_leaf);
+        return hitValue(hit, traversal, materials);
+    }
+
+    inline int voxelValue(const SceneBVH &bvh, const Voxel &voxel, float splat_threshold,
+                          stats::Traversal *traversal = nullptr, const material::Materials *materials = nullptr)
+    {
+        return voxelValue(bvh, bvh, voxel, splat_threshold, traversal, materials);
+    }
+
+    inline int voxelValue(const SceneBVH &bvh, const LocalMeshes &local, const Voxel &voxel,
+                          float splat_threshold, stats::Traversal *traversal = nullptr,
+                          const material::Materials *materials = nullptr)
+    {
+        return voxelValue(bvh, bvh, local, voxel, splat_threshold, traversal, materials);
+    }
+
+    /**
+     * @brief Meshes of the instances of a SceneBVH converted to a grid, for the float walk
+     */
+    inline LocalMeshes localMeshes(const SceneBVH &bvh, const Grid &grid)
+    {
+        return LocalMeshes(bvh, bvh.m_instances, grid);
+    }
+
+    /**
+     * @brief Fill a grid like one dispatch of voxelizer.comp. With PRECISION_FLOAT the meshes are converted
+     * to the grid once, then every voxel takes the float walk.
+     *
+     * @param bvh SceneBVH, a wide_bvh::WideBVH of it or a binning::TileBVH
+     * @param voxels resized and overwritten, indexed with pack::voxelIndex
+     * @param num_thread number of threads, each one takes a range of z slices
+     */
+    template <typename BVHType>
+    inline void voxelize(const BVHType &bvh, const Grid &grid, std::vector<int> &voxels,
+                         int num_thread = std::thread::hardware_concurrency())
+    {
+        voxels.assign((size_t)grid.size.x * grid.size.y * grid.size.z, 0);
+
+        std::optional<LocalMeshes> local;
+        if (grid.precision == PRECISION_FLOAT)
+        {
+            local.emplace(localMeshes(bvh, grid));
+        }
+
+        auto voxelize_slices = [&](int first, int last) {
+#if SATANIA_STATS
+            stats::Traversal traversal;
+            stats::Traversal *counters = &traversal;
+#else
+            stats::Traversal *counters = nullptr;
+#endif
+            for (int z = first; z < last; z++)
+            {
+                for (int y = 0; y < grid.size.y; y++)
+                {
+                    for (int x = 0; x < grid.size.x; x++)
+                    {
+                        const Voxel voxel = grid.voxel(x, y, z);
+                        voxels[pack::voxelIndex(glm::ivec3(x, y, z), grid.size, grid.layout)] =
+                            local ? voxelValue(bvh, *local, voxel, grid.splat_threshold, counters, grid.materials)
+                                  : voxelValue(bvh, voxel, grid.splat_threshold, counters, grid.materials);
+                    }
+                }
+            }
+#if SATANIA_STATS
+            stats::Stats::get().addTraversal(traversal);
+#endif
+        };
+
+        num_thread = std::clamp(num_thread, 1, std::max(grid.size.z, 1));
+        if (num_thread == 1)
+        {
+            voxelize_slices(0, grid.size.z);
+            return;
+        }
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < num_thread; t++)
+        {
+            threads.push_back(
+                std::thread(voxelize_slices, grid.size.z * t / num_thread, grid.size.z * (t + 1) / num_thread));
+        }
+
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+    }
+} // namespace cpu_voxelizer
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <glad/glad.h>
+
+#include "profiler.hpp"
+
+namespace profiler
+{
+    /**
+     * @brief GPU zones measured with timestamp queries, put on their own track of the trace
+     *
+     * Results are read back in collect() once available, so measuring never stalls the pipeline.
+     */
+    class GPUProfiler
+    {
+    public:
+        GPUProfiler() : m_track{Profiler::get().addTrack("GPU")}, m_clock_offset{0}
+        {
+            // GPU timestamps and the profiler clock only differ by an offset
+            GLint64 gpu_time = 0;
+            glGetInteger64v(GL_TIMESTAMP, &gpu_time);
+            m_clock_offset = gpu_time - Profiler::get().now();
+        }
+
+        GPUProfiler(const GPUProfiler &) = delete;
+        GPUProfiler &operator=(const GPUProfiler &) = delete;
+
+        ~GPUProfiler()
+        {
+            for (auto &zone : m_pending)
+            {
+                glDeleteQueries(2, zone.queries);
+            }
+        }
+
+        void begin(const char *name, std::string label = {})
+        {
+            Pending zone{name, std::move(label), {0, 0}};
+            glGenQueries(2, zone.queries);
+            glQueryCounter(zone.queries[0], GL_TIMESTAMP);
+            m_pending.push_back(std::move(zone));
+        }
+
+        void end()
+        {
+            glQueryCounter(m_pending.back().queries[1], GL_TIMESTAMP);
+        }
+
+        /**
+         * @brief Move the finished zones to the trace
+         *
+         * @param wait block until every pending query is available
+         */
+        void collect(bool wait = false)
+        {
+            size_t done = 0;
+            for (; done < m_pending.size(); done++)
+            {
+                Pending &zone = m_pending[done];
+
+                GLint available = GL_FALSE;
+                glGetQueryObjectiv(zone.queries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+                if (!available && !wait)
+                {
+                    break;
+                }
+
+                GLuint64 start = 0, end = 0;
+                glGetQueryObjectui64v(zone.queries[0], GL_QUERY_RESULT, &start);
+                glGetQueryObjectui64v(zone.queries[1], GL_QUERY_RESULT, &end);
+                glDeleteQueries(2, zone.queries);
+
+                m_track.events.push_back(
+                    Event{zone.name, std::move(zone.label), (int64_t)start - m_clock_offset, (int64_t)(end - start)});
+            }
+            m_pending.erase(m_pending.begin(), m_pending.begin() + done);
+        }
+
+    private:
+        struct Pending
+        {
+            const char *name;
+            std::string label;
+            GLuint queries[2];
+        };
+
+        Track &m_track;
+        int64_t m_clock_offset;
+        std::vector<Pending> m_pending;
+    };
+} // namespace profiler
+
+#if SATANIA_PROFILING
+// The GPUProfiler itself only exists when profiling, see main.cpp
+#define SATANIA_PROFILE_GPU_BEGIN(gpu_profiler, ...) (gpu_profiler).begin(__VA_ARGS__)
+#define SATANIA_PROFILE_GPU_END(gpu_profiler) (gpu_profiler).end()
+#define SATANIA_PROFILE_GPU_COLLECT(gpu_profiler, ...) (gpu_profiler).collect(__VA_ARGS__)
+#else
+#define SATANIA_PROFILE_GPU_BEGIN(gpu_profiler, ...) (void)0
+#define SATANIA_PROFILE_GPU_END(gpu_profiler) (void)0
+#define SATANIA_PROFILE_GPU_COLLECT(gpu_profiler, ...) (void)0
+#endif
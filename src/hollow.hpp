@@ -0,0 +1,465 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "pack.hpp"
+
+/**
+ * Hollow shell of a voxelized tile: the filled voxels more than a given number of blocks away from the
+ * outside are emptied, they can never be seen and only make the regions bigger.
+ *
+ * The tile is turned into one bit per voxel, 64 voxels along x in a word. The outside is the empty space
+ * connected to the faces of the tile, flood filled by sweeping the rows along every axis until nothing
+ * changes. The filled voxels are then peeled from the outside one layer at a time, a layer being the 6
+ * neighbours of the previous one. Filled voxels around a cavity that cannot be reached from the outside
+ * count as deep.
+ *
+ * A tile does not know its neighbours: the space past its faces counts as outside. Solid shapes crossing
+ * tiles keep a wall on each side of the tile face, nothing visible is ever emptied.
+ */
+namespace hollow
+{
+    /**
+     * @brief One bit per voxel, row (y, z) of size.x voxels in row_words words
+     */
+    struct BitGrid
+    {
+        glm::ivec3 size;
+        int row_words;
+        std::vector<uint64_t> words;
+
+        explicit BitGrid(glm::ivec3 size)
+            : size{size}, row_words{(size.x + 63) / 64},
+              words((size_t)((size.x + 63) / 64) * size.y * size.z, 0)
+        {
+        }
+
+        uint64_t *row(int y, int z)
+        {
+            return words.data() + ((size_t)y + (size_t)z * size.y) * row_words;
+        }
+
+        const uint64_t *row(int y, int z) const
+        {
+            return words.data() + ((size_t)y + (size_t)z * size.y) * row_words;
+        }
+
+        // Bits of the voxels of word w, the last word of a row is partial
+        uint64_t wordMask(int w) const
+        {
+            int bits = std::min(size.x - w * 64, 64);
+            return bits == 64 ? ~0ull : (1ull << bits) - 1;
+        }
+    };
+
+    /**
+     * @brief Threads kept for a whole keepShell pass. The outside is swept until nothing changes and the
+     * shell is peeled a layer at a time, starting threads for each step would cost more than most steps.
+     */
+    class Workers
+    {
+    public:
+        explicit Workers(int num_thread) : m_num_thread{std::max(num_thread, 1)}
+        {
+            for (int t = 1; t < m_num_thread; t++)
+            {
+                m_threads.push_back(std::thread([this, t]() { work(t); }));
+            }
+        }
+
+        ~Workers()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_start.notify_all();
+            for (auto &thread : m_threads)
+            {
+                thread.join();
+            }
+        }
+
+        Workers(const Workers &) = delete;
+        Workers &operator=(const Workers &) = delete;
+
+        /**
+         * @brief Run function(first, last) over [0, count) split in one range per thread, the calling thread
+         * takes the first one
+         */
+        template <typename Function>
+        void parallelRanges(int count, Function &&function)
+        {
+            const int num_thread = std::clamp(m_num_thread, 1, std::max(count, 1));
+            const std::function<void(int)> job = [&](int t) {
+                if (t < num_thread)
+                {
+                    function(count * t / num_thread, count * (t + 1) / num_thread);
+                }
+            };
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_job = &job;
+                m_pending = m_num_thread - 1;
+                m_generation++;
+            }
+            m_start.notify_all();
+
+            job(0);
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_done.wait(lock, [&]() { return m_pending == 0; });
+            m_job = nullptr;
+        }
+
+    private:
+        void work(int t)
+        {
+            uint64_t generation = 0;
+            while (true)
+            {
+                const std::function<void(int)> *job;
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_start.wait(lock, [&]() { return m_stop || m_generation != generation; });
+                    if (m_stop)
+                    {
+                        return;
+                    }
+                    generation = m_generation;
+                    job = m_job;
+                }
+
+                (*job)(t);
+
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (--m_pending == 0)
+                {
+                    m_done.notify_one();
+                }
+            }
+        }
+
+        int m_num_thread;
+        std::vector<std::thread> m_threads;
+        std::mutex m_mutex;
+        std::condition_variable m_start;
+        std::condition_variable m_done;
+        const std::function<void(int)> *m_job = nullptr;
+        int m_pending = 0;
+        uint64_t m_generation = 0;
+        bool m_stop = false;
+    };
+
+    /**
+     * @brief Call function(voxel, index, run) on every run of voxels along x that is contiguous in a layout,
+     * for the slices [first, last) on z, in the order of the layout in memory
+     */
+    template <typename Function>
+    inline void forEachRun(glm::ivec3 size, pack::Layout layout, int first, int last, Function &&function)
+    {
+        if (layout == pack::LAYOUT_LINEAR)
+        {
+            for (int z = first; z < last; z++)
+            {
+                for (int y = 0; y < size.y; y++)
+                {
+                    function(glm::ivec3(0, y, z), pack::voxelIndex(glm::ivec3(0, y, z), size, layout), size.x);
+                }
+            }
+            return;
+        }
+
+        // Section by section, rows of 16 voxels in the brick layout and single voxels in the morton one
+        const int run = layout == pack::LAYOUT_BRICK ? 16 : 1;
+        for (int section_z = first / 16; section_z * 16 < last; section_z++)
+        {
+            for (int section_x = 0; section_x < size.x / 16; section_x++)
+            {
+                for (int y = 0; y < size.y; y++)
+                {
+                    for (int z = std::max(section_z * 16, first); z < std::min(section_z * 16 + 16, last); z++)
+                    {
+                        for (int x = section_x * 16; x < section_x * 16 + 16; x += run)
+                        {
+                            function(glm::ivec3(x, y, z), pack::voxelIndex(glm::ivec3(x, y, z), size, layout), run);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Spread the bits of seeds through the set bits of passable toward the high bits (occluded fill,
+     * the span doubles at every step)
+     */
+    inline uint64_t fillUp(uint64_t seeds, uint64_t passable)
+    {
+        seeds &= passable;
+        for (int shift = 1; shift < 64; shift *= 2)
+        {
+            seeds |= passable & (seeds << shift);
+            passable &= passable << shift;
+        }
+        return seeds;
+    }
+
+    inline uint64_t fillDown(uint64_t seeds, uint64_t passable)
+    {
+        seeds &= passable;
+        for (int shift = 1; shift < 64; shift *= 2)
+        {
+            seeds |= passable & (seeds >> shift);
+            passable &= passable >> shift;
+        }
+        return seeds;
+    }
+
+    /**
+     * @brief Empty voxels connected to the faces of the grid through empty voxels
+     */
+    inline BitGrid outside(const BitGrid &filled, Workers &workers)
+    {
+        const glm::ivec3 size = filled.size;
+        const int row_words = filled.row_words;
+        BitGrid empty(size);
+        BitGrid reached(size);
+
+        // Every empty voxel of the faces
+        workers.parallelRanges(size.z, [&](int first, int last) {
+            for (int z = first; z < last; z++)
+            {
+                for (int y = 0; y < size.y; y++)
+                {
+                    const bool face = y == 0 || y == size.y - 1 || z == 0 || z == size.z - 1;
+                    for (int w = 0; w < row_words; w++)
+                    {
+                        uint64_t mask = filled.wordMask(w);
+                        empty.row(y, z)[w] = ~filled.row(y, z)[w] & mask;
+
+                        uint64_t ends = 0;
+                        if (w == 0)
+                        {
+                            ends |= 1;
+                        }
+                        if (w == row_words - 1)
+                        {
+                            ends |= 1ull << ((size.x - 1) & 63);
+                        }
+                        reached.row(y, z)[w] = empty.row(y, z)[w] & (face ? mask : ends);
+                    }
+                }
+            }
+        });
+
+        // Sweeps along x, y and z both ways, until one round reaches nothing new. A path turning k times
+        // takes about k rounds, most shapes are done in a few.
+        auto sweep_rows = [&](int first, int last, bool &any) {
+            for (int z = first; z < last; z++)
+            {
+                for (int y = 0; y < size.y; y++)
+                {
+                    uint64_t *row = reached.row(y, z);
+                    const uint64_t *passable = empty.row(y, z);
+                    uint64_t carry = 0;
+                    for (int w = 0; w < row_words; w++)
+                    {
+                        uint64_t word = fillUp(row[w] | (carry & passable[w] & 1), passable[w]);
+                        any |= word != row[w];
+                        row[w] = word;
+                        carry = word >> 63;
+                    }
+                    carry = 0;
+                    for (int w = row_words - 1; w >= 0; w--)
+                    {
+                        uint64_t word = fillDown(row[w] | ((carry << 63) & passable[w]), passable[w]);
+                        any |= word != row[w];
+                        row[w] = word;
+                        carry = word & 1;
+                    }
+                }
+            }
+        };
+        // Rows (y, z) from their neighbour (y - step, z - step) on the swept axis
+        auto sweep_columns = [&](int y, int z, int y_step, int z_step, bool &any) {
+            uint64_t *row = reached.row(y, z);
+            const uint64_t *previous = reached.row(y - y_step, z - z_step);
+            const uint64_t *passable = empty.row(y, z);
+            for (int w = 0; w < row_words; w++)
+            {
+                uint64_t word = row[w] | (previous[w] & passable[w]);
+                any |= word != row[w];
+                row[w] = word;
+            }
+        };
+
+        std::atomic<bool> changed = true;
+        while (changed)
+        {
+            changed = false;
+
+            workers.parallelRanges(size.z, [&](int first, int last) {
+                bool any = false;
+                sweep_rows(first, last, any);
+                for (int z = first; z < last; z++)
+                {
+                    for (int y = 1; y < size.y; y++)
+                    {
+                        sweep_columns(y, z, 1, 0, any);
+                    }
+                    for (int y = size.y - 2; y >= 0; y--)
+                    {
+                        sweep_columns(y, z, -1, 0, any);
+                    }
+                }
+                if (any)
+                {
+                    changed = true;
+                }
+            });
+
+            workers.parallelRanges(size.y, [&](int first, int last) {
+                bool any = false;
+                for (int y = first; y < last; y++)
+                {
+                    for (int z = 1; z < size.z; z++)
+                    {
+                        sweep_columns(y, z, 0, 1, any);
+                    }
+                    for (int z = size.z - 2; z >= 0; z--)
+                    {
+                        sweep_columns(y, z, 0, -1, any);
+                    }
+                }
+                if (any)
+                {
+                    changed = true;
+                }
+            });
+        }
+
+        return reached;
+    }
+
+    /**
+     * @brief Filled voxels next to a voxel of from, on one of its 6 faces
+     *
+     * @param past_faces whether the voxels past the faces of the grid count as set in from
+     */
+    inline void nextLayer(const BitGrid &from, const BitGrid &filled, const BitGrid &visited, bool past_faces,
+                          BitGrid &layer, Workers &workers)
+    {
+        const glm::ivec3 size = from.size;
+        const int row_words = from.row_words;
+        const uint64_t past = past_faces ? ~0ull : 0;
+
+        workers.parallelRanges(size.z, [&](int first, int last) {
+            for (int z = first; z < last; z++)
+            {
+                for (int y = 0; y < size.y; y++)
+                {
+                    const uint64_t *row = from.row(y, z);
+                    const uint64_t *below = y > 0 ? from.row(y - 1, z) : nullptr;
+                    const uint64_t *above = y + 1 < size.y ? from.row(y + 1, z) : nullptr;
+                    const uint64_t *behind = z > 0 ? from.row(y, z - 1) : nullptr;
+                    const uint64_t *front = z + 1 < size.z ? from.row(y, z + 1) : nullptr;
+                    for (int w = 0; w < row_words; w++)
+                    {
+                        // x - 1 and x + 1, across the words of the row and past its ends
+                        uint64_t neighbours = (row[w] << 1) | (w > 0 ? row[w - 1] >> 63 : past & 1);
+                        neighbours |= (row[w] >> 1) | (w + 1 < row_words ? row[w + 1] << 63 : 0);
+                        if (w == row_words - 1)
+                        {
+                            neighbours |= (past & 1) << ((size.x - 1) & 63);
+                        }
+                        neighbours |= below != nullptr ? below[w] : past;
+                        neighbours |= above != nullptr ? above[w] : past;
+                        neighbours |= behind != nullptr ? behind[w] : past;
+                        neighbours |= front != nullptr ? front[w] : past;
+
+                        layer.row(y, z)[w] = neighbours & filled.row(y, z)[w] & ~visited.row(y, z)[w];
+                    }
+                }
+            }
+        });
+    }
+
+    /**
+     * @brief Empty the filled voxels of a tile more than thickness blocks away from the outside
+     *
+     * @param voxels tile indexed with pack::voxelIndex, changed in place
+     * @param thickness layers of filled voxels kept under the outside, at least 1
+     * @return voxels emptied
+     */
+    inline size_t keepShell(int *voxels, glm::ivec3 size, pack::Layout layout, int thickness,
+                            int num_thread = std::thread::hardware_concurrency())
+    {
+        Workers workers(num_thread);
+        BitGrid filled(size);
+        workers.parallelRanges(size.z, [&](int first, int last) {
+            forEachRun(size, layout, first, last, [&](glm::ivec3 voxel, size_t index, int run) {
+                uint64_t *row = filled.row(voxel.y, voxel.z);
+                for (int i = 0; i < run; i++)
+                {
+                    int x = voxel.x + i;
+                    row[x >> 6] |= (uint64_t)(voxels[index + i] != 0) << (x & 63);
+                }
+            });
+        });
+
+        // The outside is visited, each layer is the filled voxels next to the previous one
+        BitGrid visited = outside(filled, workers);
+        BitGrid from = visited;
+        BitGrid layer(size);
+        for (int i = 0; i < std::max(thickness, 1); i++)
+        {
+            nextLayer(from, filled, visited, i == 0, layer, workers);
+            for (size_t w = 0; w < visited.words.size(); w++)
+            {
+                visited.words[w] |= layer.words[w];
+            }
+            std::swap(from, layer);
+        }
+
+        std::atomic<size_t> emptied = 0;
+        workers.parallelRanges(size.z, [&](int first, int last) {
+            size_t count = 0;
+            forEachRun(size, layout, first, last, [&](glm::ivec3 voxel, size_t index, int run) {
+                const uint64_t *deep = filled.row(voxel.y, voxel.z);
+                const uint64_t *kept = visited.row(voxel.y, voxel.z);
+                // Word by word, the voxels of a run with nothing to empty are not read
+                for (int i = 0; i < run;)
+                {
+                    int x = voxel.x + i;
+                    int span = std::min(run - i, 64 - (x & 63));
+                    uint64_t bits = (deep[x >> 6] & ~kept[x >> 6]) >> (x & 63);
+                    if (span < 64)
+                    {
+                        bits &= (1ull << span) - 1;
+                    }
+                    for (; bits != 0; bits &= bits - 1)
+                    {
+                        voxels[index + i + std::countr_zero(bits)] = 0;
+                        count++;
+                    }
+                    i += span;
+                }
+            });
+            emptied += count;
+        });
+
+        return emptied;
+    }
+} // namespace hollow
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "hollow.hpp"
+#include "mca.hpp"
+#include "pack.hpp"
+#include "planner.hpp"
+#include "profiler.hpp"
+
+/**
+ * Levels of detail built from the finest voxelization: level k holds one voxel for every 2^k x 2^k x 2^k
+ * voxels of the finest grid, reduced 2x2x2 at a time from level k - 1. Each level is written to its own
+ * region folder, as if the mesh had been voxelized at 2^k times the resolution.
+ *
+ * Tiles are reduced as soon as they are voxelized, the reduced tiles are packed into the region of their
+ * level. A region of level k covers 2^k x 2^k regions of the finest level, the tiles are ordered so they
+ * come one after the other (see planner::orderRegionsMorton) and only one region per level is packed at
+ * a time.
+ *
+ * Levels are reduced from the solid tile: a hollowed tile would turn the thin shell of level 0 into holes.
+ * With a shell thickness, each level is hollowed on its own once reduced, its solid voxels are kept for the
+ * next one.
+ */
+namespace lod
+{
+    constexpr int max_levels = 4; // the smallest tiles are one section wide
+
+    enum Rule
+    {
+        RULE_ANY,      // filled if any of the 8 voxels is
+        RULE_MAJORITY, // filled if at least half of the 8 voxels are
+        RULE_MAX
+    };
+
+    /**
+     * @brief Reduce a grid by 2 on every axis, a filled voxel takes the most frequent block of its 8
+     * voxels, the smallest one on a tie
+     *
+     * @param size size of the grid, even on every axis
+     * @param reduced linear grid of size / 2, resized and overwritten
+     */
+    inline void reduce(const int *voxels, glm::ivec3 size, pack::Layout layout, Rule rule, std::vector<int> &reduced,
+                       int num_thread = std::thread::hardware_concurrency())
+    {
+        const glm::ivec3 reduced_size = size / 2;
+        reduced.resize((size_t)reduced_size.x * reduced_size.y * reduced_size.z);
+        const int min_filled = rule == RULE_MAJORITY ? 4 : 1;
+
+        auto reduce_slices = [&](int first, int last) {
+            SATANIA_PROFILE_ZONE("reduce lod");
+            int blocks[8];
+            for (int z = first; z < last; z++)
+            {
+                for (int y = 0; y < reduced_size.y; y++)
+                {
+                    for (int x = 0; x < reduced_size.x; x++)
+                    {
+                        int filled = 0;
+                        for (int i = 0; i < 8; i++)
+                        {
+                            glm::ivec3 voxel = glm::ivec3(x, y, z) * 2 + glm::ivec3(i & 1, (i >> 1) & 1, i >> 2);
+                            int block = voxels[pack::voxelIndex(voxel, size, layout)];
+                            if (block != 0)
+                            {
+                                blocks[filled++] = block;
+                            }
+                        }
+
+                        int value = 0;
+                        if (filled >= min_filled)
+                        {
+                            std::sort(blocks, blocks + filled);
+                            int best_count = 0;
+                            for (int i = 0; i < filled;)
+                            {
+                                int count = 1;
+                                while (i + count < filled && blocks[i + count] == blocks[i])
+                                {
+                                    count++;
+                                }
+                                if (count > best_count)
+                                {
+                                    best_count = count;
+                                    value = blocks[i];
+                                }
+                                i += count;
+                            }
+                        }
+
+                        reduced[x + (size_t)y * reduced_size.x + (size_t)z * reduced_size.x * reduced_size.y] = value;
+                    }
+                }
+            }
+        };
+
+        num_thread = std::clamp(num_thread, 1, std::max(reduced_size.z, 1));
+        std::vector<std::thread> threads;
+        for (int t = 1; t < num_thread; t++)
+        {
+            threads.push_back(std::thread(reduce_slices, reduced_size.z * t / num_thread,
+                                          reduced_size.z * (t + 1) / num_thread));
+        }
+        reduce_slices(0, reduced_size.z / num_thread);
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    /**
+     * @brief Sections of a chunk of level k for a grid of height voxels at level 0
+     */
+    inline int sectionCount(int height, int level)
+    {
+        return std::max(((height >> level) + planner::section_size - 1) / planner::section_size, 1);
+    }
+
+    class Levels
+    {
+    public:
+        /**
+         * @param folder output of level 0, level k is written to folder_lodk
+         * @param level_count levels below level 0, at most max_levels
+         * @param shell_thickness blocks kept under the outside of every level, 0 to keep them solid
+         */
+        Levels(const std::string &folder, int level_count, glm::ivec3 tile_size, int bits, Rule rule,
+               int shell_thickness = 0)
+            : m_tile_size{tile_size}, m_bits{bits}, m_rule{rule}, m_shell_thickness{shell_thickness}
+        {
+            for (int level = 1; level <= std::min(level_count, max_levels); level++)
+            {
+                Level l;
+                l.folder = folder + "_lod" + std::to_string(level);
+                m_levels.push_back(std::move(l));
+
+                std::error_code error;
+                std::filesystem::create_directories(m_levels.back().folder, error);
+            }
+        }
+
+        int count() const
+        {
+            return (int)m_levels.size();
+        }
+
+        const std::string &folder(int level) const
+        {
+            return m_levels[level - 1].folder;
+        }
+
+        /**
+         * @brief Reduce a voxelized tile into every level, a region of a level is written once the last of
+         * its tiles is added
+         *
+         * @param voxels voxelizer output of the tile, before it is hollowed
+         * @param next tile voxelized after this one, null if it is the last one
+         */
+        void addTile(const int *voxels, pack::Layout layout, const planner::Tile &tile, const planner::Tile *next,
+                     const std::vector<std::string> &palette, mca::ChunkCache *cache, int num_thread)
+        {
+            const int *level_voxels = voxels;
+            glm::ivec3 size = m_tile_size;
+            for (int level = 1; level <= count(); level++)
+            {
+                Level &l = m_levels[level - 1];
+                reduce(level_voxels, size, level == 1 ? layout : pack::LAYOUT_LINEAR, m_rule, l.voxels, num_thread);
+                level_voxels = l.voxels.data();
+                size /= 2;
+
+                glm::ivec2 region = tile.region >> level;
+                if (l.data.empty())
+                {
+                    l.data.assign(mca::entries * (size_t)sectionCount(m_tile_size.y, level) *
+                                      mca::longsPerSection(m_bits),
+                                  0);
+                }
+
+                const int *packed_voxels = level_voxels;
+                if (m_shell_thickness > 0)
+                {
+                    SATANIA_PROFILE_ZONE("hollow lod");
+                    l.shell = l.voxels;
+                    hollow::keepShell(l.shell.data(), size, pack::LAYOUT_LINEAR, m_shell_thickness, num_thread);
+                    packed_voxels = l.shell.data();
+                }
+
+                glm::ivec2 offset = glm::ivec2(tile.voxel_offset.x, tile.voxel_offset.z) / (1 << level) -
+                                    region * planner::region_size;
+                pack::packBlocks(packed_voxels, size, offset, sectionCount(m_tile_size.y, level), m_bits, l.data,
+                                 num_thread);
+
+                if (next == nullptr || next->region >> level != region)
+                {
+                    std::string filename = l.folder + "/r." + std::to_string(region.x) + "." +
+                                           std::to_string(region.y) + ".mca";
+                    SATANIA_PROFILE_ZONE("write lod region", filename);
+                    mca::writeMCA(filename, region.x, region.y, palette, l.data, cache);
+                    l.data.clear();
+                }
+            }
+        }
+
+    private:
+        struct Level
+        {
+            std::string folder;
+            std::vector<int> voxels;    // reduced tile
+            std::vector<int> shell;     // hollowed copy of voxels, with a shell thickness
+            std::vector<uint64_t> data; // packed region, empty between two regions
+        };
+
+        glm::ivec3 m_tile_size;
+        int m_bits;
+        Rule m_rule;
+        int m_shell_thickness;
+        std::vector<Level> m_levels;
+    };
+} // namespace lod
@@ -4,6 +4,8 @@
 #include <filesystem>
 #include <format>
 #include <fstream>
+#include <future>
+#include <memory>
 #include <stdarg.h>
 #include <thread>
 #include <vector>
@@ -14,26 +16,44 @@
 #endif
 
 #include <GLFW/glfw3.h>
-#include <assimp/Importer.hpp>
-#include <assimp/postprocess.h>
-#include <assimp/scene.h>
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 
 #define DISPLAY_MESH 1
+#define FAST_OBJ_LOADER 1
+#define MESH_PREPROCESSING 1
+#define MESH_CACHE 1
 #define MULTI_DISPLAY_MESH 0
 #define WRITE_SCHEM 0
 #define WRITE_MCA 1
-#define MULTIPLE_CHUNK 0
-#define ADAPTIVE_CHUNK 0
+#define MERGE_MCA 0
+#define TILE_BVH 1
 #define DEBUG_INFO_OPENGL 0
 #define SATANIA_MULTITHREADING 1
+#define SATANIA_PROFILING 1
+#define SATANIA_STATS 0
 
+#include "binning.hpp"
 #include "bvh.hpp"
 #include "camera.hpp"
+#include "cpu_voxelizer.hpp"
+#include "gpu_profiler.hpp"
+#include "hollow.hpp"
+#include "lod.hpp"
+#include "manifest.hpp"
+#include "material.hpp"
 #include "mca.hpp"
 #include "mesh.hpp"
 #include "nbt.hpp"
+#include "obj.hpp"
+#include "pack.hpp"
+#include "planner.hpp"
+#include "preprocess.hpp"
+#include "profiler.hpp"
+#include "satmesh.hpp"
+#include "scene.hpp"
+#include "shard.hpp"
+#include "stats.hpp"
 #include "timer.hpp"
 
 #pragma endregion
@@ -60,7 +80,7 @@ struct Chunk {
 
 #pragma region FUNCTION PROTOTYPE
 
-GLuint compileShader(const std::string &shader_path, GLenum shader_type);
+GLuint compileShader(const std::string &shader_path, GLenum shader_type, const std::string &defines = "");
 GLuint linkShader(std::initializer_list<GLuint> shaders);
 void message_callback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, GLchar const *message,
                       void const *user_param);
@@ -76,14 +96,15 @@ glm::mat4 aabbModel(glm::dvec3 aabb_min, glm::dvec3 aabb_max) {
 
 #pragma endregion
 
-void createSchematic(const std::string &filename, const int *voxels, glm::ivec3 size) {
+void createSchematic(const std::string &filename, const int *voxels, glm::ivec3 size, pack::Layout layout) {
     std::vector<uint8_t> blocks(size.x * size.y * size.z, 0);
     std::vector<uint8_t> data(size.x * size.y * size.z, 0);
 
     for (size_t v_i = 0; v_i < size.x * size.y * size.z; v_i++) {
-        int v_x = v_i % size.x;
-        int v_y = (v_i / size.x) % size.y;
-        int v_z = v_i / (size.x * size.y);
+        glm::ivec3 v_pos = pack::voxelPosition(v_i, size, layout);
+        int v_x = v_pos.x;
+        int v_y = v_pos.y;
+        int v_z = v_pos.z;
 
         // order from x y z -> y x z
         int b_i = v_x + v_z * size.x + v_y * size.x * size.z;
@@ -117,6 +138,18 @@ struct Parameters {
     int max_x;
     int max_y;
     int max_z;
+    pack::Layout voxel_layout;
+    float splat_threshold;
+    int memory_budget; // MB
+    std::string shard_dir; // queue of a sharded conversion, empty to convert in this process only
+    int shard_workers;     // local workers the coordinator launches, 0 for a worker
+    int shard_stale_after; // seconds without heartbeat before the shard of a worker is queued again
+    std::string worker_id;
+    std::string palette_filename; // blocks picked from the mesh colors, empty to voxelize in stone
+    int lod_levels;               // coarser levels written next to the regions, each one half the resolution
+    lod::Rule lod_rule;
+    cpu_voxelizer::Precision precision; // arithmetic of the overlap test in the shader
+    int shell_thickness;                // blocks kept under the outside of solid shapes, 0 to keep them whole
 } static params;
 
 int main(int argc, char **argv) {
@@ -129,24 +162,77 @@ int main(int argc, char **argv) {
     params.max_x = 512;
     params.max_y = max_height;
     params.max_z = 512;
+    params.voxel_layout = pack::LAYOUT_BRICK;
+    params.splat_threshold = 0.5f;
+    params.memory_budget = 2048;
+    params.shard_workers = 0;
+    params.shard_stale_after = 120;
+    params.lod_levels = 0;
+    params.lod_rule = lod::RULE_ANY;
+    params.precision = cpu_voxelizer::PRECISION_DOUBLE;
+    params.shell_thickness = 0;
+
+    // The first arguments are positional, the options after them are named: --name value
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        const std::string option = argv[i];
+        if (!option.starts_with("--")) {
+            positional.push_back(option);
+            continue;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Option %s has no value\n", option.c_str());
+            return 1;
+        }
+
+        const char *value = argv[++i];
+        if (option == "--layout") {
+            params.voxel_layout = (pack::Layout)std::clamp(atoi(value), 0, pack::LAYOUT_MAX - 1);
+        } else if (option == "--splat-threshold") {
+            params.splat_threshold = (float)atof(value);
+        } else if (option == "--memory-budget") {
+            params.memory_budget = atoi(value);
+        } else if (option == "--shard-dir") {
+            params.shard_dir = value;
+        } else if (option == "--shard-workers") {
+            params.shard_workers = atoi(value);
+        } else if (option == "--worker-id") {
+            params.worker_id = value;
+        } else if (option == "--palette") {
+            params.palette_filename = value;
+        } else if (option == "--lod-levels") {
+            params.lod_levels = std::clamp(atoi(value), 0, lod::max_levels);
+        } else if (option == "--lod-rule") {
+            params.lod_rule = (lod::Rule)std::clamp(atoi(value), 0, lod::RULE_MAX - 1);
+        } else if (option == "--precision") {
+            params.precision = (cpu_voxelizer::Precision)std::clamp(atoi(value), 0, cpu_voxelizer::PRECISION_MAX - 1);
+        } else if (option == "--shell-thickness") {
+            params.shell_thickness = std::max(atoi(value), 0);
+        } else if (option == "--shard-stale-after") {
+            params.shard_stale_after = std::max(atoi(value), 1);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", option.c_str());
+            return 1;
+        }
+    }
 
-    if (argc > 1) {
-        params.mesh_filename = argv[1];
+    if (positional.size() > 0) {
+        params.mesh_filename = positional[0];
     }
-    if (argc > 2) {
-        params.voxel_filename = argv[2];
+    if (positional.size() > 1) {
+        params.voxel_filename = positional[1];
     }
-    if (argc > 3) {
-        params.voxel_resolution = (float)atof(argv[3]);
+    if (positional.size() > 2) {
+        params.voxel_resolution = (float)atof(positional[2].c_str());
     }
-    if (argc > 5) {
-        params.triangleBVH = atoi(argv[4]);
-        params.nodeDepthBVH = atoi(argv[5]);
+    if (positional.size() > 4) {
+        params.triangleBVH = atoi(positional[3].c_str());
+        params.nodeDepthBVH = atoi(positional[4].c_str());
     }
-    if (argc > 8) {
-        params.max_x = atoi(argv[6]);
-        params.max_y = atoi(argv[7]);
-        params.max_z = atoi(argv[8]);
+    if (positional.size() > 7) {
+        params.max_x = atoi(positional[5].c_str());
+        params.max_y = atoi(positional[6].c_str());
+        params.max_z = atoi(positional[7].c_str());
     }
 
     printf("OPTIONS\n");
@@ -156,13 +242,31 @@ int main(int argc, char **argv) {
     printf("\ttriangleBVH: %i\n", params.triangleBVH);
     printf("\tnodeDepthBVH: %i\n", params.nodeDepthBVH);
     printf("\tmaxChunkSize: (%i, %i, %i)\n", params.max_x, params.max_y, params.max_z);
-
-    glm::ivec3 chunks_size_chunks(params.max_x, params.max_y, params.max_z); // Size of a chunk in voxel
+    printf("\tvoxelLayout: %i\n", params.voxel_layout);
+    printf("\tsplatThreshold: %f\n", params.splat_threshold);
+    printf("\tprecision: %s\n", params.precision == cpu_voxelizer::PRECISION_FLOAT ? "float" : "double");
+    printf("\tmemoryBudget: %i MB\n", params.memory_budget);
+    if (!params.shard_dir.empty()) {
+        printf("\tshardQueue: \"%s\" (%s)\n", params.shard_dir.c_str(),
+               params.shard_workers > 0 ? std::format("coordinator of {} workers", params.shard_workers).c_str()
+                                        : "worker");
+        printf("\tshardStaleAfter: %i s\n", params.shard_stale_after);
+    }
+    if (!params.palette_filename.empty()) {
+        printf("\tpalette: \"%s\"\n", params.palette_filename.c_str());
+    }
+    if (params.lod_levels > 0) {
+        printf("\tlodLevels: %i (%s)\n", params.lod_levels, params.lod_rule == lod::RULE_MAJORITY ? "majority" : "any");
+    }
+    if (params.shell_thickness > 0) {
+        printf("\tshellThickness: %i\n", params.shell_thickness);
+    }
 
     std::string voxelname =
         params.voxel_filename.substr(params.voxel_filename.find_last_of("/") + 1, params.voxel_filename.size());
 
     Timer timer;
+    SATANIA_PROFILE_THREAD("main");
 
 #pragma region WINDOW
 
@@ -170,6 +274,8 @@ int main(int argc, char **argv) {
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    // Nobody watches the coordinator and the workers of a sharded conversion
+    glfwWindowHint(GLFW_VISIBLE, params.shard_dir.empty() ? GLFW_TRUE : GLFW_FALSE);
     GLFWwindow *window = glfwCreateWindow(800, 600, "Compute Shader", NULL, NULL);
     glfwMakeContextCurrent(window);
     gladLoadGL();
@@ -187,9 +293,15 @@ int main(int argc, char **argv) {
 #pragma region SHADERS
 
     timer.start();
-    GLuint voxel_shader_compute = compileShader("data/shaders/voxelizer.comp", GL_COMPUTE_SHADER);
+    // The float walk is a variant of its own, the meshes of every tile are converted for it by local_meshes.comp
+    const bool float_precision = params.precision == cpu_voxelizer::PRECISION_FLOAT;
+    GLuint voxel_shader_compute = compileShader("data/shaders/voxelizer.comp", GL_COMPUTE_SHADER,
+                                                float_precision ? "#define FLOAT_PRECISION 1\n" : "");
     GLuint voxel_program = linkShader({voxel_shader_compute});
 
+    GLuint local_meshes_shader_compute = compileShader("data/shaders/local_meshes.comp", GL_COMPUTE_SHADER);
+    GLuint local_meshes_program = linkShader({local_meshes_shader_compute});
+
     GLuint chunk_shader_vert = compileShader("data/shaders/chunk.vert", GL_VERTEX_SHADER);
     GLuint chunk_shader_geom = compileShader("data/shaders/chunk.geom", GL_GEOMETRY_SHADER);
     GLuint chunk_shader_frag = compileShader("data/shaders/chunk.frag", GL_FRAGMENT_SHADER);
@@ -212,6 +324,15 @@ int main(int argc, char **argv) {
     GLint voxel_program_Uniform_ElementsCount = glGetUniformLocation(voxel_program, "_ElementsCount");
     GLint voxel_program_Uniform_TriangleCount = glGetUniformLocation(voxel_program, "_TriangleCount");
     GLint voxel_program_Uniform_ChunkSize = glGetUniformLocation(voxel_program, "_ChunkSize");
+    GLint voxel_program_Uniform_Layout = glGetUniformLocation(voxel_program, "_Layout");
+    GLint voxel_program_Uniform_SplatThreshold = glGetUniformLocation(voxel_program, "_SplatThreshold");
+    GLint voxel_program_Uniform_Stats = glGetUniformLocation(voxel_program, "_Stats");
+    GLint voxel_program_Uniform_Materials = glGetUniformLocation(voxel_program, "_Materials");
+    GLint voxel_program_Uniform_TileOrigin = glGetUniformLocation(voxel_program, "_TileOrigin");
+    GLint voxel_program_Uniform_TileResolution = glGetUniformLocation(voxel_program, "_TileResolution");
+
+    GLint local_meshes_program_Uniform_TileOrigin = glGetUniformLocation(local_meshes_program, "_TileOrigin");
+    GLint local_meshes_program_Uniform_InstanceCount = glGetUniformLocation(local_meshes_program, "_InstanceCount");
 
     GLint chunk_program_Uniform_Radius = glGetUniformLocation(chunk_program, "_Radius");
     GLint chunk_program_Uniform_View = glGetUniformLocation(chunk_program, "_View");
@@ -232,59 +353,124 @@ int main(int argc, char **argv) {
 #pragma region LOADING MESH
 
     timer.start();
-    static Assimp::Importer importer;
-    const aiScene *scene = importer.ReadFile(params.mesh_filename, aiProcess_DropNormals | aiProcess_Triangulate);
+    SATANIA_PROFILE_BEGIN(loading_zone, "mesh loading", params.mesh_filename);
+    Scene scene;
+    bool scene_loaded = false;
 
-    Mesh mesh;
-    mesh.vertices.resize(scene->mMeshes[0]->mNumVertices);
-    mesh.elements.resize(scene->mMeshes[0]->mNumFaces * 3);
+    // Meshes are either owned by scene or memory mapped from a .satmesh file
+    satmesh::SceneFile scene_file;
+    bool scene_mapped = false;
 
-    srand(time(0));
-    for (unsigned int i = 0; i < scene->mMeshes[0]->mNumVertices; i++) {
-        mesh.vertices[i].position.x = scene->mMeshes[0]->mVertices[i].x;
-        mesh.vertices[i].position.y = scene->mMeshes[0]->mVertices[i].y;
-        mesh.vertices[i].position.z = scene->mMeshes[0]->mVertices[i].z;
-    }
+    const preprocess::Options preprocess_options;
 
-    for (unsigned int i = 0; i < scene->mMeshes[0]->mNumFaces; i++) {
-        mesh.elements[i * 3 + 0] = scene->mMeshes[0]->mFaces[i].mIndices[0];
-        mesh.elements[i * 3 + 1] = scene->mMeshes[0]->mFaces[i].mIndices[1];
-        mesh.elements[i * 3 + 2] = scene->mMeshes[0]->mFaces[i].mIndices[2];
+#if MESH_CACHE
+#if MESH_PREPROCESSING
+    const uint64_t mesh_options = preprocess::optionsHash(preprocess_options);
+#else
+    const uint64_t mesh_options = 0;
+#endif
+    const satmesh::SourceInfo mesh_source = satmesh::sourceInfo(params.mesh_filename, mesh_options);
+    // The cache is next to the source, or in the output folder when the source folder is read-only
+    const std::string mesh_cache_paths[] = {satmesh::cachePath(params.mesh_filename),
+                                            satmesh::fallbackCachePath(params.mesh_filename, params.voxel_filename)};
+    if (std::filesystem::path(params.mesh_filename).extension() == ".satmesh") {
+        if (!scene_file.open(params.mesh_filename)) {
+            fprintf(stderr, "Cannot load mesh \"%s\"\n", params.mesh_filename.c_str());
+            return 1;
+        }
+        scene_mapped = true;
+    } else {
+        for (const std::string &cache_path : mesh_cache_paths) {
+            scene_mapped = scene_mapped || scene_file.open(cache_path, &mesh_source);
+        }
+    }
+#endif
 
-        glm::vec4 color(1.0f);
-        color.r = (rand() % 32) / 32.0;
-        color.b = (rand() % 32) / 32.0;
-        color.g = (rand() % 32) / 32.0;
+    if (!scene_mapped) {
+#if FAST_OBJ_LOADER
+        if (std::filesystem::path(params.mesh_filename).extension() == ".obj") {
+            Mesh mesh;
+            if (obj::loadOBJ(params.mesh_filename, mesh)) {
+                scene.addMesh(std::move(mesh));
+                scene_loaded = true;
+            }
+        }
+#endif
 
-        mesh.vertices[mesh.elements[i * 3 + 0]].color = color;
-        mesh.vertices[mesh.elements[i * 3 + 1]].color = color;
-        mesh.vertices[mesh.elements[i * 3 + 2]].color = color;
-    }
+        if (!scene_loaded && !scene::loadScene(params.mesh_filename, scene)) {
+            return 1;
+        }
 
-    GLuint mesh_vao;
-    GLuint mesh_vbo;
-    GLuint mesh_ebo;
+#if MESH_PREPROCESSING
+        Timer preprocess_timer;
+        preprocess_timer.start();
+        SATANIA_PROFILE_BEGIN(preprocess_zone, "mesh preprocessing");
+
+        preprocess::Stats preprocess_stats;
+        for (auto &mesh : scene.meshes) {
+            preprocess::Stats stats = preprocess::preprocessMesh(mesh, preprocess_options);
+            preprocess_stats.input_vertices += stats.input_vertices;
+            preprocess_stats.input_triangles += stats.input_triangles;
+            preprocess_stats.welded_vertices += stats.welded_vertices;
+            preprocess_stats.unused_vertices += stats.unused_vertices;
+            preprocess_stats.degenerate_triangles += stats.degenerate_triangles;
+            preprocess_stats.duplicate_triangles += stats.duplicate_triangles;
+            preprocess_stats.output_vertices += stats.output_vertices;
+            preprocess_stats.output_triangles += stats.output_triangles;
+        }
 
-    glCreateVertexArrays(1, &mesh_vao);
-    glCreateBuffers(1, &mesh_vbo);
-    glCreateBuffers(1, &mesh_ebo);
+        SATANIA_PROFILE_END(preprocess_zone);
+        preprocess_timer.stop();
+        printf("[TIMER] Mesh preprocessing: %.2f ms\n",
+               preprocess_timer.elapsed<std::chrono::nanoseconds>().count() / 1'000'000.0);
+        printf("Vertices: %zu -> %zu (%zu welded, %zu unused)\n", preprocess_stats.input_vertices,
+               preprocess_stats.output_vertices, preprocess_stats.welded_vertices, preprocess_stats.unused_vertices);
+        printf("Triangles: %zu -> %zu (%zu degenerate, %zu duplicate)\n", preprocess_stats.input_triangles,
+               preprocess_stats.output_triangles, preprocess_stats.degenerate_triangles,
+               preprocess_stats.duplicate_triangles);
+#endif
 
-    glBindVertexArray(mesh_vao);
+#if MESH_CACHE
+        // Later runs map the preprocessed meshes instead of parsing the source again
+        for (const std::string &cache_path : mesh_cache_paths) {
+            std::error_code error;
+            std::filesystem::create_directories(std::filesystem::path(cache_path).parent_path(), error);
+            if (satmesh::writeScene(cache_path, scene, mesh_source)) {
+                printf("Mesh cache written to \"%s\"\n", cache_path.c_str());
+                break;
+            }
+        }
+#endif
+    }
 
-    glBindBuffer(GL_ARRAY_BUFFER, mesh_vbo);
-    glBufferData(GL_ARRAY_BUFFER, mesh.vertices.size() * sizeof(mesh.vertices[0]), mesh.vertices.data(),
-                 GL_STATIC_DRAW);
+    const std::vector<Instance> &instances = scene_mapped ? scene_file.instances() : scene.instances;
+    const size_t mesh_count = scene_mapped ? scene_file.meshes().size() : scene.meshes.size();
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh_ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh.elements.size() * sizeof(mesh.elements[0]), mesh.elements.data(),
-                 GL_STATIC_DRAW);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)offsetof(Vertex, position));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)offsetof(Vertex, color));
+    size_t instanced_triangle_count = 0;
+    for (const auto &instance : instances) {
+        instanced_triangle_count += scene_mapped ? triangleCount(scene_file.meshes()[instance.mesh])
+                                                 : triangleCount(scene.meshes[instance.mesh]);
+    }
 
+    SATANIA_PROFILE_END(loading_zone);
     timer.stop();
-    printf("[TIMER] Mesh loading: %.2f ms\n", timer.elapsed<std::chrono::nanoseconds>().count() / 1'000'000.0);
+    printf("[TIMER] Mesh loading%s: %.2f ms\n", scene_mapped ? " (mapped)" : "",
+           timer.elapsed<std::chrono::nanoseconds>().count() / 1'000'000.0);
+    printf("Meshes: %zu, instances: %zu, instanced triangles: %zu\n", mesh_count, instances.size(),
+           instanced_triangle_count);
+
+    // With a palette every voxel takes the block nearest to the color of the mesh, stone otherwise
+    const std::vector<material::Texture> &textures = scene_mapped ? scene_file.textures() : scene.textures;
+    material::Materials materials;
+    materials.textures = &textures;
+    if (!params.palette_filename.empty()) {
+        if (!material::loadPalette(params.palette_filename, materials.palette)) {
+            return 1;
+        }
+        materials.lut = material::ColorLUT(materials.palette);
+        printf("Palette: %zu blocks, textures: %zu\n", materials.palette.size(), textures.size());
+    }
+    const bool use_materials = !materials.palette.empty();
 
 #pragma endregion
 
@@ -298,29 +484,126 @@ int main(int argc, char **argv) {
     std::vector<glm::vec4> aabb_mesh_colors_chunks;
 
     timer.start(); // times the building of the BVH
+    SATANIA_PROFILE_BEGIN(bvh_zone, "BVH building");
 
-    BVH mesh_bvh(mesh, params.triangleBVH, params.nodeDepthBVH);
+    SceneBVH scene_bvh = scene_mapped
+                             ? SceneBVH(scene_file.meshes(), instances, params.triangleBVH, params.nodeDepthBVH)
+                             : SceneBVH(scene, params.triangleBVH, params.nodeDepthBVH);
 
+    SATANIA_PROFILE_END(bvh_zone);
     timer.stop();
     printf("[TIMER] BVH building: %.2f ms\n", timer.elapsed<std::chrono::nanoseconds>().count() / 1'000'000.0);
 
-    printf("Node count: %zi\n", mesh_bvh.m_nodes.size());
+    printf("Node count: %zi, top level node count: %zi\n", scene_bvh.m_nodes.size(), scene_bvh.m_top_nodes.size());
+
+    if (scene_bvh.empty()) {
+        fprintf(stderr, "\"%s\" has no triangle to voxelize\n", params.mesh_filename.c_str());
+        return 1;
+    }
+    const AABB scene_aabb = scene_bvh.aabb();
+
+    // The window shows every triangle in a random color, unless the voxels take the colors of the mesh
+    std::vector<BVH::Triangle> display_triangles = scene_bvh.m_triangles;
+    if (!use_materials) {
+        srand(time(0));
+        for (auto &triangle : display_triangles) {
+            glm::vec4 color(1.0f);
+            color.r = (rand() % 32) / 32.0;
+            color.b = (rand() % 32) / 32.0;
+            color.g = (rand() % 32) / 32.0;
+
+            triangle.vertices[0].color = color;
+            triangle.vertices[1].color = color;
+            triangle.vertices[2].color = color;
+        }
+    }
 
     GLuint bvh_nodes;
     GLuint bvh_triangles;
+    GLuint bvh_instances;
+    GLuint bvh_top_nodes;
+    GLuint bvh_escapes;
+    GLuint bvh_top_escapes;
 
     glCreateBuffers(1, &bvh_nodes);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, bvh_nodes);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, mesh_bvh.m_nodes.size() * sizeof(BVH::Node), mesh_bvh.m_nodes.data(),
+    glBufferData(GL_SHADER_STORAGE_BUFFER, scene_bvh.m_nodes.size() * sizeof(BVH::Node), scene_bvh.m_nodes.data(),
                  GL_STATIC_DRAW);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, bvh_nodes);
 
     glCreateBuffers(1, &bvh_triangles);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, bvh_triangles);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, mesh_bvh.m_triangles.size() * sizeof(BVH::Triangle),
-                 mesh_bvh.m_triangles.data(), GL_STATIC_DRAW);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, scene_bvh.m_triangles.size() * sizeof(BVH::Triangle),
+                 scene_bvh.m_triangles.data(), GL_STATIC_DRAW);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, bvh_triangles);
 
+    glCreateBuffers(1, &bvh_instances);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, bvh_instances);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, scene_bvh.m_instances.size() * sizeof(SceneBVH::GPUInstance),
+                 scene_bvh.m_instances.data(), GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, bvh_instances);
+
+    glCreateBuffers(1, &bvh_top_nodes);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, bvh_top_nodes);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, scene_bvh.m_top_nodes.size() * sizeof(BVH::Node),
+                 scene_bvh.m_top_nodes.data(), GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, bvh_top_nodes);
+
+    // Escape links of both levels, the voxelizer walks them without a stack
+    glCreateBuffers(1, &bvh_escapes);
+    glNamedBufferData(bvh_escapes, scene_bvh.m_escapes.size() * sizeof(int), scene_bvh.m_escapes.data(),
+                      GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, bvh_escapes);
+
+    glCreateBuffers(1, &bvh_top_escapes);
+    glNamedBufferData(bvh_top_escapes, scene_bvh.m_top_escapes.size() * sizeof(int), scene_bvh.m_top_escapes.data(),
+                      GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, bvh_top_escapes);
+
+    // Meshes of the tile instances converted by local_meshes.comp for the float walk, sized for every tile
+    GLuint local_firsts;
+    GLuint local_triangles;
+    GLuint local_nodes;
+    glCreateBuffers(1, &local_firsts);
+    glCreateBuffers(1, &local_triangles);
+    glCreateBuffers(1, &local_nodes);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, local_firsts);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, local_triangles);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, local_nodes);
+
+    // Color lookup table and tiled texels of the materials, none of the buffers is bound empty
+    std::vector<glm::ivec4> texture_infos;
+    std::vector<uint32_t> texels;
+    for (const auto &texture : textures) {
+        texture_infos.push_back(glm::ivec4((int)texels.size(), texture.width(), texture.height(), texture.tilesX()));
+        texels.insert(texels.end(), texture.texels().begin(), texture.texels().end());
+    }
+    std::vector<int32_t> color_lut = use_materials ? materials.lut.data() : std::vector<int32_t>(1, 0);
+    if (texels.empty()) {
+        texels.push_back(0);
+    }
+    if (texture_infos.empty()) {
+        texture_infos.push_back(glm::ivec4(0));
+    }
+
+    GLuint material_color_lut;
+    GLuint material_texels;
+    GLuint material_textures;
+
+    glCreateBuffers(1, &material_color_lut);
+    glNamedBufferData(material_color_lut, color_lut.size() * sizeof(int32_t), color_lut.data(), GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, material_color_lut);
+
+    glCreateBuffers(1, &material_texels);
+    glNamedBufferData(material_texels, texels.size() * sizeof(uint32_t), texels.data(), GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, material_texels);
+
+    glCreateBuffers(1, &material_textures);
+    glNamedBufferData(material_textures, texture_infos.size() * sizeof(glm::ivec4), texture_infos.data(),
+                      GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, material_textures);
+
+    // Every unique mesh is uploaded once and drawn for each of its instances
     GLuint mesh_bvh_vao;
     GLuint mesh_bvh_vbo;
 
@@ -330,41 +613,50 @@ int main(int argc, char **argv) {
     glBindVertexArray(mesh_bvh_vao);
 
     glBindBuffer(GL_ARRAY_BUFFER, mesh_bvh_vbo);
-    glBufferData(GL_ARRAY_BUFFER, mesh_bvh.m_triangles.size() * sizeof(BVH::Triangle), mesh_bvh.m_triangles.data(),
+    glBufferData(GL_ARRAY_BUFFER, display_triangles.size() * sizeof(BVH::Triangle), display_triangles.data(),
                  GL_STATIC_DRAW);
+    display_triangles = {};
 
     glEnableVertexAttribArray(0);
     glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)offsetof(Vertex, position));
     glEnableVertexAttribArray(1);
     glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)offsetof(Vertex, color));
 
-    for (const auto &node : mesh_bvh.m_nodes) {
-        // this is a node
-        if (node.leaf_elem == 0) {
-            aabb_mesh_models.push_back(aabbModel(node.aabb.min, node.aabb.max));
-            aabb_mesh_colors.push_back(glm::vec4(0.0f, 0.0, 1.0, 1.0));
-        }
-        // this is a leaf
-        else if (node.leaf_elem != 0) {
-            aabb_mesh_models.push_back(aabbModel(node.aabb.min, node.aabb.max));
-            aabb_mesh_colors.push_back(glm::vec4(0.0f, 1.0, 0.0, 1.0));
+    for (const auto &node : scene_bvh.m_top_nodes) {
+        aabb_mesh_models.push_back(aabbModel(node.aabb.min, node.aabb.max));
+        aabb_mesh_colors.push_back(glm::vec4(1.0f, 1.0, 0.0, 1.0));
+    }
+
+    // Mesh BVH nodes are drawn in the space of every instance
+    for (const auto &instance : instances) {
+        const auto &range = scene_bvh.m_meshes[instance.mesh];
+        for (int i = range.node_offset; i < range.node_offset + range.node_count; i++) {
+            const auto &node = scene_bvh.m_nodes[i];
+
+            aabb_mesh_models.push_back(instance.transform * aabbModel(node.aabb.min, node.aabb.max));
+            // blue for a node, green for a leaf
+            aabb_mesh_colors.push_back(node.leaf_elem == 0 ? glm::vec4(0.0f, 0.0, 1.0, 1.0)
+                                                           : glm::vec4(0.0f, 1.0, 0.0, 1.0));
         }
     }
 
 #pragma endregion
 
 #pragma region CHUNKS
-    int chunk_index = 0;
+    int chunk_index = 0;    // Next tile to write out
+    int dispatch_index = 0; // Next tile to voxelize
 
-    auto a = glm::ivec3((mesh_bvh.m_nodes[0].aabb.max - mesh_bvh.m_nodes[0].aabb.min) / params.voxel_resolution);
+    auto a = glm::ivec3((scene_aabb.max - scene_aabb.min) / params.voxel_resolution);
     auto b = glm::ceilMultiple(a + 1, glm::ivec3(16));
 
 #if WRITE_MCA
-    glm::ivec3 chunks_voxels_size = chunks_size_chunks; // Size of a chunk in voxel
-    chunks_voxels_size.y = b.y;
-    chunks_size_chunks.y = b.y;
+    if (b.y > max_height && !params.shard_dir.empty()) {
+        // Workers cannot be asked, every process of a sharded conversion floors the same way
+        printf("Mesh bounding box is above the %i build height, flooring it\n", max_height);
+        b.y = max_height;
+    }
 
-    if (chunks_voxels_size.y > max_height) {
+    if (b.y > max_height) {
         printf("Mesh bounding box is above the big maximum %i build height !!!\n", max_height);
 
         char ans = 'N';
@@ -378,40 +670,262 @@ int main(int argc, char **argv) {
             }
 
             if ((ans == 'F') || (ans == 'f')) {
-                chunks_voxels_size.y = max_height;
-                chunks_size_chunks.y = max_height;
+                b.y = max_height;
 
                 printf("Fllored it\n");
             }
 
         } while ((ans != 'Y') && (ans != 'y') && (ans != 'F') && (ans != 'f'));
     }
-#else
-#if ADAPTIVE_CHUNK
+#endif
 
-    glm::ivec3 chunks_voxels_size = glm::min(b, chunks_size_chunks); // Size of a chunk in voxel
+    // The BVH buffers and the mesh drawn in the window stay on the GPU for the whole run
+    planner::Budget budget;
+    budget.memory_bytes = (size_t)params.memory_budget << 20;
+    budget.fixed_bytes = scene_bvh.m_nodes.size() * sizeof(BVH::Node) +
+                         scene_bvh.m_triangles.size() * sizeof(BVH::Triangle) * 2 +
+                         scene_bvh.m_instances.size() * sizeof(SceneBVH::GPUInstance) +
+                         scene_bvh.m_top_nodes.size() * sizeof(BVH::Node) +
+                         (scene_bvh.m_escapes.size() + scene_bvh.m_top_escapes.size()) * sizeof(int) +
+                         color_lut.size() * sizeof(int32_t) + texels.size() * sizeof(uint32_t) +
+                         texture_infos.size() * sizeof(glm::ivec4);
+    budget.max_tile_size = glm::ivec2(params.max_x, params.max_z);
+    budget.lod_levels = params.lod_levels;
+    budget.hollow = params.shell_thickness > 0;
+#if !SATANIA_MULTITHREADING
+    budget.num_thread = 1;
+#endif
 
-#else
-#if MULTIPLE_CHUNK
-    glm::ivec3 chunks_voxels_size = chunks_size_chunks; // Size of a chunk in voxel
-#else
-    glm::ivec3 chunks_voxels_size = b; // Size of a chunk in voxel
+    const std::vector<std::string> palette = use_materials
+                                                 ? material::blockIds(materials.palette)
+                                                 : std::vector<std::string>{"minecraft:air", "minecraft:stone"};
+    const int bits = mca::bitsPerBlock(palette.size());
+
+    planner::Plan plan = planner::planTiles(scene_bvh, b, scene_aabb.min, params.voxel_resolution, bits, budget);
+
+#if TILE_BVH
+    // Every dispatch walks a BVH of the triangles of its tile only, tiles without any are dropped
+    timer.start();
+    SATANIA_PROFILE_BEGIN(binning_zone, "triangle binning");
+    binning::TileTriangles tile_triangles =
+        binning::binTriangles(scene_bvh, plan, scene_aabb.min, params.voxel_resolution, plan.num_thread);
+    size_t empty_tiles = binning::removeEmptyTiles(plan, tile_triangles);
+    SATANIA_PROFILE_END(binning_zone);
+    timer.stop();
+
+    size_t binned_triangles = 0;
+    for (const auto &triangles : tile_triangles) {
+        binned_triangles += triangles.size();
+    }
+    printf("[TIMER] Triangle binning: %.2f ms\n", timer.elapsed<std::chrono::nanoseconds>().count() / 1'000'000.0);
+    printf("Binned triangles: %zu, empty tiles dropped: %zu\n", binned_triangles, empty_tiles);
 #endif
+
+    if (plan.tiles.empty()) {
+        fprintf(stderr, "No tile of the voxel grid touches the mesh\n");
+        return 1;
+    }
+
+    // Every process of a sharded conversion writes its own commands, stats and manifest
+    const bool shard_worker = !params.shard_dir.empty() && params.shard_workers == 0;
+    const std::string worker_id = params.worker_id.empty() ? shard::workerId() : params.worker_id;
+    const std::string output_suffix = shard_worker ? "_" + worker_id : "";
+
+#if WRITE_MCA
+    // Regions a previous run wrote with the same parameters and left untouched since are not converted again.
+    // The layout, BVH and tile settings are left out of the hash as they do not change the regions, and so is
+    // the mesh file once its tiles are hashed: an edited mesh only gets its changed tiles voxelized again.
+    std::string manifest_parameters =
+        std::format("{}|{}|{}|{}|{}|{}|{}", params.mesh_filename, params.voxel_resolution, params.splat_threshold,
+                    b.y, scene_aabb.min.x, scene_aabb.min.y, scene_aabb.min.z);
+    // The float test can differ from the double one on a voxel face, the hash of a double run is kept as is
+    if (params.precision != cpu_voxelizer::PRECISION_DOUBLE) {
+        manifest_parameters += std::format("|precision {}", (int)params.precision);
+    }
+    if (params.shell_thickness > 0) {
+        manifest_parameters += std::format("|shell {}", params.shell_thickness);
+    }
+#if !TILE_BVH
+    const satmesh::SourceInfo manifest_source = satmesh::sourceInfo(params.mesh_filename);
+    manifest_parameters += std::format("|{}|{}", manifest_source.size, manifest_source.time);
+#endif
+    for (const std::string &block : palette) {
+        manifest_parameters += "|" + block;
+    }
+    for (const material::Block &block : materials.palette) {
+        manifest_parameters += std::format("|{} {} {}", block.color.r, block.color.g, block.color.b);
+    }
+    for (const material::Texture &texture : textures) {
+        const std::vector<uint32_t> &texture_texels = texture.texels();
+        uLong crc = crc32(0L, (const Bytef *)texture_texels.data(), (uInt)(texture_texels.size() * sizeof(uint32_t)));
+        manifest_parameters += std::format("|{}x{} {}", texture.width(), texture.height(), crc);
+    }
+    manifest::Manifest region_manifest(params.voxel_filename + "/manifest" + output_suffix + ".txt",
+                                       manifest::hashParameters(manifest_parameters), !shard_worker);
+    // Levels of detail reduce every tile of their regions, a run writing them converts every region
+    if (params.lod_levels == 0) {
+        region_manifest.load(params.voxel_filename);
+    }
+
+    auto region_file = [&](glm::ivec2 region) {
+        return params.voxel_filename + "/r." + std::to_string(region.x) + "." + std::to_string(region.y) + ".mca";
+    };
+
+    std::vector<uint64_t> tile_hashes;
+#if TILE_BVH
+    for (const auto &triangles : tile_triangles) {
+        tile_hashes.push_back(binning::tileHash(scene_bvh, triangles, plan.tile_size, use_materials));
+    }
+#endif
+
+    // Merged regions hold more than the mesh, they are always merged whole
+    std::vector<size_t> kept_tiles;
+    std::vector<manifest::RegionUpdate> region_updates = manifest::planUpdates(
+        region_manifest, plan.tiles, tile_hashes, plan.tile_size, !MERGE_MCA, region_file, kept_tiles);
+
+    size_t planned_tiles = plan.tiles.size();
+    for (size_t i = 0; i < kept_tiles.size(); i++) {
+        if (kept_tiles[i] != i) {
+            plan.tiles[i] = plan.tiles[kept_tiles[i]];
+#if TILE_BVH
+            tile_triangles[i] = std::move(tile_triangles[kept_tiles[i]]);
+#endif
+        }
+    }
+    plan.tiles.resize(kept_tiles.size());
+#if TILE_BVH
+    tile_triangles.resize(kept_tiles.size());
 #endif
+    planner::markRegions(plan.tiles);
+    printf("Manifest: %zu of %zu tiles to voxelize in %zu regions\n", plan.tiles.size(), planned_tiles,
+           region_updates.size());
+
+    // Regions only losing tiles get them written over with air, the workers leave them to the coordinator
+    for (const manifest::RegionUpdate &update : region_updates) {
+        bool voxelized = std::any_of(plan.tiles.begin(), plan.tiles.end(),
+                                     [&](const planner::Tile &tile) { return tile.region == update.region; });
+        if (voxelized || shard_worker) {
+            continue;
+        }
+
+        const size_t region_longs = mca::entries * (size_t)(plan.tile_size.y / 16) * mca::longsPerSection(bits);
+        std::vector<uint64_t> empty_region(region_longs, 0);
+        std::string empty_file = region_file(update.region);
+        if (mca::mergeMCA(empty_file, update.region.x, update.region.y, palette, empty_region, nullptr,
+                          &update.replaced_chunks)) {
+            region_manifest.add(update.region, empty_file, update.tiles);
+            printf("Cleared the tiles the mesh left in %s\n", empty_file.c_str());
+        }
+    }
+
+    if (plan.tiles.empty()) {
+        printf("Every region of \"%s\" is already converted\n", params.voxel_filename.c_str());
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return 0;
+    }
 #endif
 
-    glm::ivec3 chunks_count = 1 + (glm::ivec3)(glm::vec3(mesh_bvh.m_nodes[0].aabb.max - mesh_bvh.m_nodes[0].aabb.min) /
-                                               params.voxel_resolution) /
-                                      chunks_voxels_size;
+    int tile_count = (int)plan.tiles.size();
+    glm::ivec3 chunks_voxels_size = plan.tile_size; // Size of a chunk in voxel
+
+    if (!pack::layoutSupported(chunks_voxels_size, params.voxel_layout)) {
+        printf("Chunk size is not a multiple of 16, falling back to the linear voxel layout\n");
+        params.voxel_layout = pack::LAYOUT_LINEAR;
+    }
 
     printf("BOUNDING BOX MINIMUM SIZE: (%i, %i, %i)\n", b.x, b.y, b.z);
     printf("CHUNK SIZE: (%i, %i, %i)\n", chunks_voxels_size.x, chunks_voxels_size.y, chunks_voxels_size.z);
-    printf("TOTAL SIZE: (%i, %i, %i)\n", chunks_voxels_size.x * chunks_count.x, chunks_voxels_size.y * chunks_count.y,
-           chunks_voxels_size.z * chunks_count.z);
+    printf("TOTAL SIZE: (%i, %i, %i)\n", plan.grid_size.x, plan.grid_size.y, plan.grid_size.z);
+    printf("PLAN: %i tiles, %i voxel buffers, %i threads, %.1f MB of %i MB\n", tile_count, plan.voxel_buffers,
+           plan.num_thread, plan.memory_bytes / (1024.0 * 1024.0), params.memory_budget);
+
+    // Sharded conversion: the coordinator only hands out regions, the workers voxelize and write them
+    if (!params.shard_dir.empty() && params.shard_workers > 0) {
+        shard::Queue queue(params.shard_dir);
+        if (!queue.create(shard::splitRegions(plan.tiles, params.shard_workers * 4, params.lod_levels))) {
+            return 1;
+        }
+        printf("Shard queue \"%s\": %i shards\n", params.shard_dir.c_str(), queue.counts().todo);
+
+        std::string worker_command = std::format(
+            "\"{}\" \"{}\" \"{}\" {} {} {} {} {} {} --layout {} --splat-threshold {} --memory-budget {} "
+            "--shard-dir \"{}\" --worker-id \"{{worker}}\" --palette \"{}\" --lod-levels {} --lod-rule {} "
+            "--precision {} --shell-thickness {} --shard-stale-after {}",
+            argv[0], params.mesh_filename, params.voxel_filename, params.voxel_resolution, params.triangleBVH,
+            params.nodeDepthBVH, params.max_x, params.max_y, params.max_z, (int)params.voxel_layout,
+            params.splat_threshold, params.memory_budget, params.shard_dir, params.palette_filename,
+            params.lod_levels, (int)params.lod_rule, (int)params.precision, params.shell_thickness,
+            params.shard_stale_after);
+
+        shard::CoordinatorOptions options;
+        options.workers = params.shard_workers;
+        options.stale_after = std::chrono::seconds(params.shard_stale_after);
+        int failed = shard::runCoordinator(queue, worker_command, options);
+        printf("Sharded conversion %s, %i shards failed\n", failed == 0 ? "done" : "incomplete", failed);
+
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return failed == 0 ? 0 : 1;
+    }
+
+    // A worker keeps the whole plan and runs the tiles of one shard at a time
+    shard::Queue shard_queue(params.shard_dir);
+    shard::Shard current_shard;
+    // Keeps the claimed shard alive while a tile, a region or its levels of detail take long
+    std::unique_ptr<shard::Heartbeat> heartbeat;
+    if (shard_worker) {
+        heartbeat = std::make_unique<shard::Heartbeat>(
+            shard_queue, worker_id, shard::heartbeatInterval(std::chrono::seconds(params.shard_stale_after)));
+    }
+    std::vector<planner::Tile> all_tiles;
+#if TILE_BVH
+    binning::TileTriangles all_tile_triangles;
+#endif
+
+    // Restrict the plan to the tiles of the next shard, false once no shard is waiting
+    auto claim_shard = [&]() {
+        while (shard_queue.claim(worker_id, current_shard)) {
+            std::vector<size_t> selected = shard::selectTiles(all_tiles, current_shard);
+            plan.tiles.clear();
+#if TILE_BVH
+            tile_triangles.clear();
+#endif
+            for (size_t i : selected) {
+                plan.tiles.push_back(all_tiles[i]);
+#if TILE_BVH
+                tile_triangles.push_back(std::move(all_tile_triangles[i]));
+#endif
+            }
 
-    glm::vec3 chunk_aabb_min;
-    glm::vec3 chunk_aabb_max;
-    GLsync chunk_sync; // Used to check if the compute shader as finished working
+            if (plan.tiles.empty()) {
+                shard_queue.complete(current_shard, worker_id);
+                continue;
+            }
+
+            tile_count = (int)plan.tiles.size();
+            chunk_index = 0;
+            dispatch_index = 0;
+            printf("Worker %s took shard %i: %zu regions, %i tiles\n", worker_id.c_str(), current_shard.index,
+                   current_shard.regions.size(), tile_count);
+            heartbeat->follow(current_shard);
+            return true;
+        }
+        return false;
+    };
+
+    if (shard_worker) {
+        all_tiles = std::move(plan.tiles);
+#if TILE_BVH
+        all_tile_triangles = std::move(tile_triangles);
+#endif
+        if (!claim_shard()) {
+            printf("No shard is waiting in \"%s\"\n", params.shard_dir.c_str());
+            glfwDestroyWindow(window);
+            glfwTerminate();
+            return 0;
+        }
+    }
 
     // Chunk Arrays
     std::vector<std::vector<Voxel>> chunks_voxels;
@@ -438,21 +952,32 @@ int main(int argc, char **argv) {
                  GL_STATIC_DRAW);
     glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
 
-    // Persistant mapped buffer
-    GLuint voxels_ssbo;
+    // Persistant mapped buffers, tile i is voxelized in buffer i % voxel_buffers
+    const size_t voxels_ssbo_size =
+        (size_t)chunks_voxels_size.x * chunks_voxels_size.y * chunks_voxels_size.z * sizeof(int);
     GLbitfield voxels_ssbo_flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
-    glCreateBuffers(1, &voxels_ssbo);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, voxels_ssbo);
-    glBufferStorage(GL_SHADER_STORAGE_BUFFER,
-                    chunks_voxels_size.x * chunks_voxels_size.y * chunks_voxels_size.z * sizeof(int), 0,
-                    voxels_ssbo_flags);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, voxels_ssbo);
-    int *voxel_ssbo_data = (int *)glMapBufferRange(
-        GL_SHADER_STORAGE_BUFFER, 0, chunks_voxels_size.x * chunks_voxels_size.y * chunks_voxels_size.z * sizeof(int),
-        voxels_ssbo_flags);
-
-    bool voxel_compute_finished = false;
-    bool voxel_compute_started = false;
+    std::vector<GLuint> voxels_ssbos(plan.voxel_buffers);
+    std::vector<int *> voxels_ssbo_data(plan.voxel_buffers);
+    std::vector<GLsync> chunk_syncs(plan.voxel_buffers); // Used to check if the compute shader as finished working
+    std::vector<Timer> chunk_timers(plan.voxel_buffers);
+    glCreateBuffers(plan.voxel_buffers, voxels_ssbos.data());
+    for (int i = 0; i < plan.voxel_buffers; i++) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, voxels_ssbos[i]);
+        glBufferStorage(GL_SHADER_STORAGE_BUFFER, voxels_ssbo_size, 0, voxels_ssbo_flags);
+        voxels_ssbo_data[i] =
+            (int *)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, voxels_ssbo_size, voxels_ssbo_flags);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+#if SATANIA_STATS
+    // Low and high words of the traversal counters of voxelizer.comp, read back once all the tiles are done
+    constexpr int stats_counter_count = 4;
+    GLuint stats_counters;
+    glCreateBuffers(1, &stats_counters);
+    glNamedBufferStorage(stats_counters, stats_counter_count * 2 * sizeof(GLuint), nullptr, GL_DYNAMIC_STORAGE_BIT);
+    glClearNamedBufferData(stats_counters, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+    glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, 0, stats_counters);
+#endif
 
     bool voxel_compute_paused = false;
 
@@ -474,7 +999,7 @@ int main(int argc, char **argv) {
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
     glEnable(GL_DEPTH_TEST);
 
-    std::string voxel_path = params.voxel_filename + "_commands.txt";
+    std::string voxel_path = params.voxel_filename + output_suffix + "_commands.txt";
 
     FILE *commandFile = fopen(voxel_path.c_str(), "w");
 
@@ -486,9 +1011,33 @@ int main(int argc, char **argv) {
         std::filesystem::create_directory(mca_folder);
     }
 
+    // Shared by all the regions, empty and repeated chunks are only compressed once per run
+    mca::ChunkCache chunk_cache(plan.cache_bytes);
+
+    // Tiles of a region are packed in place, the region is written with its last tile
+    std::vector<uint64_t> region_data;
+
+    // Every tile is reduced into the coarser levels, written to voxel_filename_lod1, _lod2...
+    lod::Levels lod_levels(params.voxel_filename, params.lod_levels, chunks_voxels_size, bits, params.lod_rule,
+                           params.shell_thickness);
+
+#endif
+
+#if TILE_BVH
+    // The top level of a tile only takes its instances, the next one is built on a worker while a tile is voxelized
+    std::future<binning::TileBVH> next_tile_bvh;
+    auto build_tile_bvh = [&](int index) {
+        return std::async(std::launch::async, [&scene_bvh, &tile_triangles, index]() {
+            SATANIA_PROFILE_ZONE("tile BVH", "chunk " + std::to_string(index));
+            return binning::TileBVH(scene_bvh, tile_triangles[index]);
+        });
+    };
 #endif
 
     Timer total_voxelization_timer;
+#if SATANIA_PROFILING
+    profiler::GPUProfiler gpu_profiler;
+#endif
     // Update loop
     while (!glfwWindowShouldClose(window)) {
         // EVENTS PROCESSING
@@ -513,65 +1062,110 @@ int main(int argc, char **argv) {
 
 #pragma region DATA PROCESSING
 
-        if (!voxel_compute_started && !voxel_compute_paused) {
-            if (chunk_index == 0) {
+        // Keep every voxel buffer busy, the GPU voxelizes the next tiles while the oldest one is written
+        while (!voxel_compute_paused && dispatch_index < tile_count &&
+               dispatch_index - chunk_index < plan.voxel_buffers) {
+            if (dispatch_index == 0) {
                 total_voxelization_timer.start();
             }
-            // Check if the next chunks need to be computed
-            if (chunk_index < chunks_count.x * chunks_count.y * chunks_count.z) {
-                timer.start();
-
-                // Get the chunk to be voxelized location
-                glm::ivec3 next_chunk_pos;
-                next_chunk_pos.x = chunk_index % chunks_count.x;
-                next_chunk_pos.y = (chunk_index / chunks_count.x) % chunks_count.y;
-                next_chunk_pos.z = chunk_index / (chunks_count.x * chunks_count.y);
-
-                // Get the working area of the voxelizer
-                chunk_aabb_min = mesh_bvh.m_nodes[0].aabb.min +
-                                 glm::vec3(chunks_voxels_size) * params.voxel_resolution * glm::vec3(next_chunk_pos);
-                chunk_aabb_max = mesh_bvh.m_nodes[0].aabb.max + glm::vec3(chunks_voxels_size) *
-                                                                    params.voxel_resolution *
-                                                                    glm::vec3(next_chunk_pos + 1);
-
-                // Set all the uniforms for the compute program for the chunk to voxelize
-                glUseProgram(voxel_program);
-                glUniform1i(voxel_program_Uniform_ElementsCount, (GLint)(mesh_bvh.m_triangles.size()));
-                glUniform1i(voxel_program_Uniform_TriangleCount, (GLint)(mesh_bvh.m_triangles.size()));
-                glUniform3i(voxel_program_Uniform_ChunkSize, chunks_voxels_size.x, chunks_voxels_size.y,
-                            chunks_voxels_size.z);
-                glUniform1d(voxel_program_Uniform_Resolution, params.voxel_resolution);
-                glUniform3d(voxel_program_Uniform_AABB_min, chunk_aabb_min.x, chunk_aabb_min.y, chunk_aabb_min.z);
-                glUniform3d(voxel_program_Uniform_AABB_max, chunk_aabb_max.x, chunk_aabb_max.y, chunk_aabb_max.z);
-
-                // Call compute shader to voxelize the chunk
-                glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, compute_indirect_command);
-                glDispatchComputeIndirect(0);
-                glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+            const planner::Tile &tile = plan.tiles[dispatch_index];
+            const int buffer = dispatch_index % plan.voxel_buffers;
+            chunk_timers[buffer].start();
+
+            // Get the working area of the voxelizer
+            glm::vec3 chunk_aabb_min = scene_aabb.min + glm::vec3(tile.voxel_offset) * params.voxel_resolution;
+            glm::vec3 chunk_aabb_max = chunk_aabb_min + glm::vec3(chunks_voxels_size) * params.voxel_resolution;
+
+#if TILE_BVH
+            // Only the top level is orphaned, the tiles still in flight keep reading their own. The mesh BVHs
+            // stay the ones of the scene.
+            SATANIA_PROFILE_BEGIN(tile_bvh_zone, "tile BVH upload", "chunk " + std::to_string(dispatch_index));
+            if (!next_tile_bvh.valid()) {
+                next_tile_bvh = build_tile_bvh(dispatch_index);
+            }
+            const binning::TileBVH tile_bvh = next_tile_bvh.get();
+            if (dispatch_index + 1 < tile_count) {
+                next_tile_bvh = build_tile_bvh(dispatch_index + 1);
+            }
+            glNamedBufferData(bvh_instances, tile_bvh.m_instances.size() * sizeof(SceneBVH::GPUInstance),
+                              tile_bvh.m_instances.data(), GL_STREAM_DRAW);
+            glNamedBufferData(bvh_top_nodes, tile_bvh.m_top_nodes.size() * sizeof(BVH::Node),
+                              tile_bvh.m_top_nodes.data(), GL_STREAM_DRAW);
+            glNamedBufferData(bvh_top_escapes, tile_bvh.m_top_escapes.size() * sizeof(int),
+                              tile_bvh.m_top_escapes.data(), GL_STREAM_DRAW);
+            SATANIA_PROFILE_END(tile_bvh_zone);
+#endif
 
-                chunk_sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            if (float_precision) {
+#if TILE_BVH
+                const std::vector<SceneBVH::GPUInstance> &tile_instances = tile_bvh.m_instances;
+#else
+                const std::vector<SceneBVH::GPUInstance> &tile_instances = scene_bvh.m_instances;
+#endif
+                // Orphaned like the top level, one invocation a triangle then one a node of the tile instances
+                SATANIA_PROFILE_BEGIN(local_zone, "local meshes", "chunk " + std::to_string(dispatch_index));
+                const std::vector<glm::ivec2> firsts = cpu_voxelizer::localFirsts(scene_bvh, tile_instances);
+                const glm::ivec2 totals = firsts.back();
+                glNamedBufferData(local_firsts, firsts.size() * sizeof(glm::ivec2), firsts.data(), GL_STREAM_DRAW);
+                glNamedBufferData(local_triangles, std::max(totals.x * 9, 1) * sizeof(float), nullptr,
+                                  GL_STREAM_DRAW);
+                glNamedBufferData(local_nodes, std::max(totals.y * 6, 1) * sizeof(float), nullptr, GL_STREAM_DRAW);
+
+                glUseProgram(local_meshes_program);
+                glUniform3f(local_meshes_program_Uniform_TileOrigin, chunk_aabb_min.x, chunk_aabb_min.y,
+                            chunk_aabb_min.z);
+                glUniform1i(local_meshes_program_Uniform_InstanceCount, (GLint)tile_instances.size());
+                glDispatchCompute((totals.x + totals.y + 63) / 64, 1, 1);
+                glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+                SATANIA_PROFILE_END(local_zone);
+            }
 
-                glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
-                glUseProgram(0);
+            // Set all the uniforms for the compute program for the chunk to voxelize
+            glUseProgram(voxel_program);
+            glUniform1i(voxel_program_Uniform_ElementsCount, (GLint)(scene_bvh.m_triangles.size()));
+            glUniform1i(voxel_program_Uniform_TriangleCount, (GLint)(scene_bvh.m_triangles.size()));
+            glUniform3i(voxel_program_Uniform_ChunkSize, chunks_voxels_size.x, chunks_voxels_size.y,
+                        chunks_voxels_size.z);
+            glUniform1d(voxel_program_Uniform_Resolution, params.voxel_resolution);
+            glUniform3d(voxel_program_Uniform_AABB_min, chunk_aabb_min.x, chunk_aabb_min.y, chunk_aabb_min.z);
+            glUniform3d(voxel_program_Uniform_AABB_max, chunk_aabb_max.x, chunk_aabb_max.y, chunk_aabb_max.z);
+            glUniform1i(voxel_program_Uniform_Layout, params.voxel_layout);
+            glUniform1f(voxel_program_Uniform_SplatThreshold, params.splat_threshold);
+            glUniform1i(voxel_program_Uniform_Stats, SATANIA_STATS);
+            glUniform1i(voxel_program_Uniform_Materials, use_materials);
+            glUniform3f(voxel_program_Uniform_TileOrigin, chunk_aabb_min.x, chunk_aabb_min.y, chunk_aabb_min.z);
+            glUniform1f(voxel_program_Uniform_TileResolution, params.voxel_resolution);
+
+            // Call compute shader to voxelize the chunk
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, voxels_ssbos[buffer]);
+            glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, compute_indirect_command);
+            SATANIA_PROFILE_GPU_BEGIN(gpu_profiler, "voxelize", "chunk " + std::to_string(dispatch_index));
+            glDispatchComputeIndirect(0);
+            SATANIA_PROFILE_GPU_END(gpu_profiler);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+            chunk_syncs[buffer] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+            glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+            glUseProgram(0);
 
-                voxel_compute_finished = false;
-                voxel_compute_started = true;
-            }
+            dispatch_index++;
         }
 
-        // Only called is currently computing
-        if (!voxel_compute_finished && voxel_compute_started) {
-            // Check if the chunk as finished processing and writting the voxel data
-            GLenum compute_finished = glClientWaitSync(chunk_sync, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        // Check if the oldest tile in flight as finished processing and writting the voxel data
+        int finished_buffer = -1;
+        if (chunk_index < dispatch_index) {
+            const int buffer = chunk_index % plan.voxel_buffers;
+            GLenum compute_finished = glClientWaitSync(chunk_syncs[buffer], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
             if ((compute_finished == GL_ALREADY_SIGNALED) || (compute_finished == GL_CONDITION_SATISFIED)) {
-                voxel_compute_finished = true;
-                timer.stop();
-                printf("[TIMER] chunk %i/%i took: %.2f ms\n", chunk_index + 1,
-                       chunks_count.x * chunks_count.y * chunks_count.z,
-                       timer.elapsed<std::chrono::nanoseconds>().count() / 1'000'000.0);
-                glDeleteSync(chunk_sync);
-
-                if (chunk_index + 1 == chunks_count.x * chunks_count.y * chunks_count.z) {
+                finished_buffer = buffer;
+                chunk_timers[buffer].stop();
+                printf("[TIMER] chunk %i/%i took: %.2f ms\n", chunk_index + 1, tile_count,
+                       chunk_timers[buffer].elapsed<std::chrono::nanoseconds>().count() / 1'000'000.0);
+                glDeleteSync(chunk_syncs[buffer]);
+                SATANIA_PROFILE_GPU_COLLECT(gpu_profiler);
+
+                if (chunk_index + 1 == tile_count) {
                     total_voxelization_timer.stop();
                     printf("[TIMER] Voxelization took: %.2f ms\n",
                            total_voxelization_timer.elapsed<std::chrono::nanoseconds>().count() / 1'000'000.0);
@@ -580,7 +1174,35 @@ int main(int argc, char **argv) {
         }
 
         // Only called if a chunk as finished working and a chunk is wating to be copied from the GPU
-        if (voxel_compute_finished && voxel_compute_started) {
+        if (finished_buffer >= 0) {
+            const planner::Tile &tile = plan.tiles[chunk_index];
+            int *voxel_ssbo_data = voxels_ssbo_data[finished_buffer];
+            glm::vec3 chunk_aabb_min = scene_aabb.min + glm::vec3(tile.voxel_offset) * params.voxel_resolution;
+
+#if WRITE_MCA
+            // The levels are reduced from the solid tile and hollowed on their own, before it is emptied below
+            if (lod_levels.count() > 0) {
+                SATANIA_PROFILE_BEGIN(lod_zone, "levels of detail", "chunk " + std::to_string(chunk_index));
+                const planner::Tile *next_tile = chunk_index + 1 < tile_count ? &plan.tiles[chunk_index + 1] : nullptr;
+                lod_levels.addTile(voxel_ssbo_data, params.voxel_layout, tile, next_tile, palette, &chunk_cache,
+                                   plan.num_thread);
+                SATANIA_PROFILE_END(lod_zone);
+            }
+#endif
+
+            // The next dispatch in this buffer overwrites every voxel, the interior can be emptied in place
+            if (params.shell_thickness > 0) {
+                Timer hollow_timer;
+                hollow_timer.start();
+                SATANIA_PROFILE_BEGIN(hollow_zone, "hollow shell", "chunk " + std::to_string(chunk_index));
+                size_t emptied = hollow::keepShell(voxel_ssbo_data, chunks_voxels_size, params.voxel_layout,
+                                                   params.shell_thickness, plan.num_thread);
+                SATANIA_PROFILE_END(hollow_zone);
+                hollow_timer.stop();
+                printf("[TIMER] Hollow shell took: %.2f ms, %zu voxels emptied\n",
+                       hollow_timer.elapsed<std::chrono::nanoseconds>().count() / 1'000'000.0, emptied);
+            }
+
 #if !MULTI_DISPLAY_MESH
 
             if (chunks_vaos.size() > 0) {
@@ -601,13 +1223,14 @@ int main(int argc, char **argv) {
                 if (voxel_ssbo_data[voxel_index]) {
                     Vertex vertex;
 
-                    glm::ivec3 chunk_voxel_position{};
-                    chunk_voxel_position.x = voxel_index % chunks_voxels_size.x;
-                    chunk_voxel_position.y = (voxel_index / chunks_voxels_size.x) % chunks_voxels_size.y;
-                    chunk_voxel_position.z = voxel_index / (chunks_voxels_size.x * chunks_voxels_size.y);
+                    glm::ivec3 chunk_voxel_position =
+                        pack::voxelPosition(voxel_index, chunks_voxels_size, params.voxel_layout);
 
                     vertex.color =
-                        glm::vec4(glm::vec3(chunk_voxel_position) / glm::vec3(chunks_count * chunks_voxels_size), 1.0f);
+                        use_materials
+                            ? glm::vec4(materials.palette[voxel_ssbo_data[voxel_index]].color, 1.0f)
+                            : glm::vec4(glm::vec3(tile.voxel_offset + chunk_voxel_position) / glm::vec3(plan.grid_size),
+                                        1.0f);
                     vertex.position = chunk_aabb_min + glm::vec3(chunk_voxel_position) * params.voxel_resolution;
 
                     chunk_vertices.push_back(vertex);
@@ -642,14 +1265,10 @@ int main(int argc, char **argv) {
 
 #endif // MESH_DRAW
 
-            glm::ivec3 chunk_index_pos{};
-            chunk_index_pos.x = chunk_index % chunks_count.x;
-            chunk_index_pos.y = (chunk_index / chunks_count.x) % chunks_count.y;
-            chunk_index_pos.z = chunk_index / (chunks_count.x * chunks_count.y);
+            glm::ivec3 chunk_index_pos = tile.voxel_offset / chunks_voxels_size;
 
-            glm::vec3 aabb_min = chunk_aabb_min + glm::vec3(chunk_index_pos) * params.voxel_resolution;
-            glm::vec3 aabb_max =
-                chunk_aabb_min + glm::vec3(chunk_index_pos + chunks_voxels_size) * params.voxel_resolution;
+            glm::vec3 aabb_min = chunk_aabb_min;
+            glm::vec3 aabb_max = chunk_aabb_min + glm::vec3(chunks_voxels_size) * params.voxel_resolution;
 
             aabb_mesh_models_chunks.push_back(aabbModel(aabb_min, aabb_max));
             aabb_mesh_colors_chunks.push_back(glm::vec4(1.0f, 0.0f, 0.0f, 1.0f));
@@ -663,13 +1282,13 @@ int main(int argc, char **argv) {
             createSchematic(params.voxel_filename + "_" + std::to_string(chunk_index_pos.x) + "_" +
                                 std::to_string(chunk_index_pos.y) + "_" + std::to_string(chunk_index_pos.z) +
                                 ".schematic",
-                            voxel_ssbo_data, chunks_voxels_size);
+                            voxel_ssbo_data, chunks_voxels_size, params.voxel_layout);
 
             if (chunk_index > 0) {
                 auto local_chunk_index_pos = chunk_index_pos - last_chunk_index_pos;
                 std::string tp_command = std::format(
-                    "/tp @p ~{} ~{} ~{}\n", local_chunk_index_pos.x * chunks_size_chunks.x,
-                    local_chunk_index_pos.y * chunks_size_chunks.y, local_chunk_index_pos.z * chunks_size_chunks.z);
+                    "/tp @p ~{} ~{} ~{}\n", local_chunk_index_pos.x * chunks_voxels_size.x,
+                    local_chunk_index_pos.y * chunks_voxels_size.y, local_chunk_index_pos.z * chunks_voxels_size.z);
 
                 fwrite(tp_command.c_str(), tp_command.size(), 1, commandFile);
             }
@@ -689,91 +1308,116 @@ int main(int argc, char **argv) {
 
 #if WRITE_MCA
 
-            std::string mca_file_name = mca_folder + "/r." + std::to_string(chunk_index_pos.x) + "." +
-                                        std::to_string(chunk_index_pos.z) + ".mca";
+            std::string mca_file_name =
+                mca_folder + "/r." + std::to_string(tile.region.x) + "." + std::to_string(tile.region.y) + ".mca";
+
+            const std::string region_label =
+                "r." + std::to_string(tile.region.x) + "." + std::to_string(tile.region.y) + ".mca";
 
             // prepare buffer data
-            std::vector<uint64_t> voxel_data((chunks_voxels_size.x / 16) * chunks_voxels_size.x * chunks_voxels_size.y,
-                                             0);
+            if (tile.first_in_region) {
+                region_data.assign(mca::entries * (size_t)(chunks_voxels_size.y / 16) * mca::longsPerSection(bits), 0);
+            }
 
             Timer timerb;
             timerb.start();
+            SATANIA_PROFILE_BEGIN(pack_zone, "pack", region_label);
+            pack::packTile(voxel_ssbo_data, chunks_voxels_size, tile.chunk_offset, bits, region_data, plan.num_thread,
+                           params.voxel_layout);
+            SATANIA_PROFILE_END(pack_zone);
+            timerb.stop();
+            printf("[TIMER] Voxel data sorting took: %.2f ms\n",
+                   timerb.elapsed<std::chrono::nanoseconds>().count() / 1'000'000.0);
 
-#if SATANIA_MULTITHREADING
-            int num_thread = std::thread::hardware_concurrency();
-            int count = voxel_data.size() / num_thread;
-            std::vector<std::thread> threads;
-
-            for (int i = 0; i < 8; i++) {
-                voxel_ssbo_data[i] = 1;
+            if (tile.last_in_region) {
+                timerb.start();
+                SATANIA_PROFILE_BEGIN(write_zone, "write region", region_label);
+                auto update = std::find_if(region_updates.begin(), region_updates.end(),
+                                           [&](const manifest::RegionUpdate &u) { return u.region == tile.region; });
+#if MERGE_MCA
+                // Only re-encode the chunks the mesh touches, the rest of an existing region is kept as is
+                bool written =
+                    mca::mergeMCA(mca_file_name, tile.region.x, tile.region.y, palette, region_data, &chunk_cache);
+#else
+                bool written;
+                if (!update->replaced_chunks.empty()) {
+                    // Only the changed tiles were voxelized, the chunks of the others are kept as is
+                    written = mca::mergeMCA(mca_file_name, tile.region.x, tile.region.y, palette, region_data,
+                                            &chunk_cache, &update->replaced_chunks);
+                } else {
+                    written =
+                        mca::writeMCA(mca_file_name, tile.region.x, tile.region.y, palette, region_data, &chunk_cache);
+                }
+#endif
+                // A region that failed to write stays out of the manifest, the next run voxelizes it again
+                if (written) {
+                    region_manifest.add(tile.region, mca_file_name, update->tiles);
+                } else {
+                    fprintf(stderr, "%s was not written, it is left out of the manifest\n", region_label.c_str());
+                }
+                SATANIA_PROFILE_END(write_zone);
+                timerb.stop();
+                printf("[TIMER] MCA writing of %s: %.2f ms\n", region_label.c_str(),
+                       timerb.elapsed<std::chrono::nanoseconds>().count() / 1'000'000.0);
+                printf("Chunk cache hit rate: %.1f%% (%zu hits, %zu misses)\n", chunk_cache.hitRate() * 100.0,
+                       chunk_cache.hits(), chunk_cache.misses());
             }
 
-            voxel_data[0] = 1;
-
-            auto thread_function = [&voxel_data](int start, int count, const int *data) {
-                for (int i = 0; i < voxel_data.size(); i++) {
-                    for (int j = 0; j < 16; j++) {
-                        uint64_t mask = static_cast<uint64_t>(1) << (j * 4);
-                        int index = i * 16;
+#endif
 
-                        voxel_data[i] |= (static_cast<uint64_t>(data[index + j]) << (j * 4)) & mask;
-                    }
-                }
-            };
+            chunk_index++;
 
-            for (size_t t = 0; t < num_thread; t++) {
-                int start = t * count;
-                threads.push_back(std::thread(thread_function, start, count, voxel_ssbo_data));
-            }
-            // Wait for all the tread to be finished
-            for (auto &thread : threads) {
-                thread.join();
+            // A worker moves on to the next shard, its run ends once none is waiting
+            bool run_finished = chunk_index >= tile_count;
+            if (run_finished && shard_worker) {
+                heartbeat->follow(shard::Shard());
+                shard_queue.complete(current_shard, worker_id);
+                printf("Shard %i done\n", current_shard.index);
+                run_finished = !claim_shard();
             }
-#else
-            uint64_t blocks{0};
-            for (int i = 0; i < voxel_data.size(); i++) {
-                for (int j = 0; j < 16; j++) {
-                    uint64_t mask = static_cast<uint64_t>(1) << (j * 4);
-                    int index = i * 16;
 
-                    voxel_data[i] |= (static_cast<uint64_t>(voxel_ssbo_data[index + j]) << (j * 4)) & mask;
+            if (run_finished) {
+                fclose(commandFile);
+                printf("Minecraft World edit commands saved to \"%s\"\n", voxel_path.c_str());
+                for (GLuint voxels_ssbo : voxels_ssbos) {
+                    glUnmapNamedBuffer(voxels_ssbo);
                 }
 
-                // if (voxel_data[i] != 0) {
-                // 	printf("gegeg\n");
-                // }
-
-                blocks += voxel_data[i];
-            }
+#if SATANIA_STATS
+                GLuint counters[stats_counter_count * 2];
+                glGetNamedBufferSubData(stats_counters, 0, sizeof(counters), counters);
+
+                auto counter = [&](int i) { return ((uint64_t)counters[i * 2 + 1] << 32) | counters[i * 2]; };
+                stats::Stats::get().addTraversal(stats::Traversal{counter(0), counter(1), counter(2), counter(3)});
+
+                std::string stats_path = params.voxel_filename + output_suffix + "_stats.json";
+                if (stats::Stats::get().writeReport(
+                        stats_path, {{"voxel_resolution", params.voxel_resolution},
+                                     {"triangleBVH", params.triangleBVH},
+                                     {"nodeDepthBVH", params.nodeDepthBVH},
+                                     {"splat_threshold", params.splat_threshold},
+                                     {"voxel_layout", params.voxel_layout},
+                                     {"tile_size", (double)chunks_voxels_size.x},
+                                     {"tiles", (double)tile_count},
+                                     {"tile_bvh", TILE_BVH},
+                                     {"bvh_nodes", (double)scene_bvh.m_nodes.size()},
+                                     {"bvh_triangles", (double)scene_bvh.m_triangles.size()},
+                                     {"bvh_instances", (double)scene_bvh.m_instances.size()}})) {
+                    printf("Stats report saved to \"%s\"\n", stats_path.c_str());
+                }
 #endif
-            timerb.stop();
-            printf("[TIMER] Voxel data sorting took: %.2f ms\n",
-                   timerb.elapsed<std::chrono::nanoseconds>().count() / 1'000'000.0);
-            // printf("WRITTEN: %llu blocks", blocks);
-
-            timerb.start();
-            mca::writeMCA(mca_file_name, chunk_index_pos.x, chunk_index_pos.z, {"minecraft:air", "minecraft:stone"},
-                          voxel_data);
-            timerb.stop();
-            printf(
-                "[TIMER] MCA writing of %s: %.2f ms\n",
-                std::string("r." + std::to_string(chunk_index_pos.x) + "." + std::to_string(chunk_index_pos.z) + ".mca")
-                    .c_str(),
-                timerb.elapsed<std::chrono::nanoseconds>().count() / 1'000'000.0);
-
-            // convert the data to mca data
-
-            // create a region based on the chunk data and chunk location (of satania 512x256+x512)
 
+#if SATANIA_PROFILING
+                gpu_profiler.collect(true);
+                std::string trace_path = params.voxel_filename + output_suffix + "_trace.json";
+                if (profiler::Profiler::get().writeChromeTrace(trace_path)) {
+                    printf("Profiling trace saved to \"%s\"\n", trace_path.c_str());
+                }
 #endif
 
-            chunk_index++;
-            voxel_compute_started = false;
-
-            if (chunk_index >= chunks_count.x * chunks_count.y * chunks_count.z) {
-                fclose(commandFile);
-                printf("Minecraft World edit commands saved to \"%s\"\n", voxel_path.c_str());
-                glUnmapBuffer(voxels_ssbo);
+                if (shard_worker) {
+                    glfwSetWindowShouldClose(window, GLFW_TRUE);
+                }
             }
         }
 
@@ -802,7 +1446,11 @@ int main(int argc, char **argv) {
             glUniformMatrix4fv(diffuse_program_Uniform_Proj, 1, GL_FALSE, &camera._projection[0][0]);
             glUniform4f(diffuse_program_Uniform_Color, 1.0f, 1.0f, 1.0f, 1.0f);
             glBindVertexArray(mesh_bvh_vao);
-            glDrawArrays(GL_TRIANGLES, 0, mesh_bvh.m_triangles.size() * 3);
+            for (const auto &instance : instances) {
+                const auto &range = scene_bvh.m_meshes[instance.mesh];
+                glUniformMatrix4fv(diffuse_program_Uniform_Model, 1, GL_FALSE, &instance.transform[0][0]);
+                glDrawArrays(GL_TRIANGLES, range.triangle_offset * 3, range.triangle_count * 3);
+            }
         } else if (glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_PRESS) { // Draw the mesh bounding box
             glUseProgram(aabb_program);
             glUniformMatrix4fv(aabb_program_Uniform_View, 1, GL_FALSE, &camera._view[0][0]);
@@ -847,9 +1495,26 @@ int main(int argc, char **argv) {
         glDeleteVertexArrays(1, &chunks_vaos[i]);
     }
 
-    glDeleteBuffers(1, &mesh_ebo);
-    glDeleteBuffers(1, &mesh_vbo);
+    glDeleteBuffers(1, &mesh_bvh_vbo);
+    glDeleteVertexArrays(1, &mesh_bvh_vao);
+    glDeleteBuffers(1, &bvh_nodes);
+    glDeleteBuffers(1, &bvh_triangles);
+    glDeleteBuffers(1, &bvh_instances);
+    glDeleteBuffers(1, &bvh_top_nodes);
+    glDeleteBuffers(1, &bvh_escapes);
+    glDeleteBuffers(1, &bvh_top_escapes);
+    glDeleteBuffers(1, &local_firsts);
+    glDeleteBuffers(1, &local_triangles);
+    glDeleteBuffers(1, &local_nodes);
+    glDeleteBuffers(1, &material_color_lut);
+    glDeleteBuffers(1, &material_texels);
+    glDeleteBuffers(1, &material_textures);
+    glDeleteBuffers(plan.voxel_buffers, voxels_ssbos.data());
+#if SATANIA_STATS
+    glDeleteBuffers(1, &stats_counters);
+#endif
     glDeleteProgram(voxel_program);
+    glDeleteProgram(local_meshes_program);
     glDeleteProgram(chunk_program);
 
     glfwDestroyWindow(window);
@@ -862,13 +1527,17 @@ int main(int argc, char **argv) {
 
 #pragma region FUNCTION DEFINITION
 
-GLuint compileShader(const std::string &shader_path, GLenum shader_type) {
+GLuint compileShader(const std::string &shader_path, GLenum shader_type, const std::string &defines) {
     std::ifstream shader_file(shader_path);
     std::string shader_code;
     std::string line;
 
+    // The defines select a variant of the shader, they have to follow #version
     while (std::getline(shader_file, line)) {
         shader_code.append(line + "\n");
+        if (line.starts_with("#version")) {
+            shader_code.append(defines);
+        }
     }
 
     const char *shader_source = shader_code.c_str();
@@ -0,0 +1,423 @@
+#pragma once
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "planner.hpp"
+#include "zlib.h"
+
+/**
+ * Record of the region files a conversion finished, so a restarted run skips them.
+ *
+ * Every region written adds its coordinates, file size and CRC-32 to the manifest, which is rewritten
+ * next to its destination and renamed after each region: a crash leaves either the previous or the new
+ * manifest, never a partial one. A region only counts as done if its file still has the recorded size
+ * and checksum, and only for a run with the same parameters hash.
+ *
+ * The hashes of the triangles of the tiles of a region are recorded too. Once the mesh is edited, a run
+ * compares them with its own tiles and only voxelizes again the tiles whose triangles changed. Each tile
+ * keeps its extent: the planner picks the tile size from the memory budget, a tile a run no longer has is
+ * cleared over the area it covered when it was written.
+ *
+ * A run rewrites the manifest it read with the regions it wrote, so the regions it skipped stay recorded.
+ * Every process of a sharded conversion keeps its own manifest of the regions it wrote in the output
+ * folder, a run reads them all.
+ */
+namespace manifest
+{
+    constexpr const char *header = "satania-manifest 3";
+
+    struct TileHash
+    {
+        glm::ivec2 offset; // voxel offset of the tile on x and z
+        glm::ivec2 size;   // voxels of the tile on x and z
+        uint64_t hash;     // see binning::tileHash
+    };
+
+    struct Entry
+    {
+        glm::ivec2 region;
+        uint64_t size;
+        uint32_t crc;
+        std::vector<TileHash> tiles;
+    };
+
+    /**
+     * @brief FNV-1a of the description of everything that changes the content of the regions
+     */
+    inline uint64_t hashParameters(const std::string &description)
+    {
+        uint64_t h = 14695981039346656037ull;
+        for (unsigned char c : description)
+        {
+            h = (h ^ c) * 1099511628211ull;
+        }
+        return h;
+    }
+
+    /**
+     * @brief CRC-32 and size of a file
+     *
+     * @return false if the file cannot be read
+     */
+    inline bool fileChecksum(const std::string &filename, uint64_t &size, uint32_t &crc)
+    {
+        FILE *file = fopen(filename.c_str(), "rb");
+        if (file == nullptr)
+        {
+            return false;
+        }
+
+        std::vector<unsigned char> buffer(1 << 20);
+        size = 0;
+        crc = (uint32_t)crc32(0L, Z_NULL, 0);
+        size_t read;
+        while ((read = fread(buffer.data(), 1, buffer.size(), file)) > 0)
+        {
+            crc = (uint32_t)crc32(crc, buffer.data(), (uInt)read);
+            size += read;
+        }
+
+        bool success = ferror(file) == 0;
+        fclose(file);
+        return success;
+    }
+
+    class Manifest
+    {
+    public:
+        /**
+         * @param filename manifest written by this process
+         * @param parameters_hash see hashParameters
+         * @param keep_read also write the entries read by load() and not written again, false for the
+         * workers of a sharded conversion which only record their own regions
+         */
+        Manifest(std::string filename, uint64_t parameters_hash, bool keep_read = true)
+            : m_filename{std::move(filename)}, m_parameters_hash{parameters_hash}, m_keep_read{keep_read}
+        {
+        }
+
+        /**
+         * @brief Read the entries of every manifest of a folder written with the same parameters
+         *
+         * @return number of entries read
+         */
+        size_t load(const std::filesystem::path &folder)
+        {
+            std::error_code error;
+            for (const auto &file : std::filesystem::directory_iterator(folder, error))
+            {
+                std::string name = file.path().filename().string();
+                if (name.starts_with("manifest") && file.path().extension() == ".txt")
+                {
+                    read(file.path().string());
+                }
+            }
+            return m_entries.size();
+        }
+
+        /**
+         * @brief Entry of a region written by a previous run whose file is unchanged since, nullptr otherwise
+         */
+        const Entry *find(glm::ivec2 region, const std::string &region_file) const
+        {
+            auto recorded = [&](const Entry &e) { return e.region == region; };
+            if (std::none_of(m_entries.begin(), m_entries.end(), recorded))
+            {
+                return nullptr;
+            }
+
+            // Several manifests can record the region, the one matching the file is the last to write it
+            uint64_t size;
+            uint32_t crc;
+            if (!fileChecksum(region_file, size, crc))
+            {
+                return nullptr;
+            }
+            auto entry = std::find_if(m_entries.begin(), m_entries.end(), [&](const Entry &e) {
+                return recorded(e) && e.size == size && e.crc == crc;
+            });
+            return entry != m_entries.end() ? &*entry : nullptr;
+        }
+
+        /**
+         * @brief Regions of every manifest read or written
+         */
+        std::vector<glm::ivec2> regions() const
+        {
+            std::vector<glm::ivec2> result;
+            for (const Entry &entry : m_entries)
+            {
+                result.push_back(entry.region);
+            }
+            return result;
+        }
+
+        /**
+         * @brief Record a region file once written, then replace the manifest of this process
+         *
+         * @param tiles hashes of every tile of the region, changed or not
+         */
+        bool add(glm::ivec2 region, const std::string &region_file, std::vector<TileHash> tiles = {})
+        {
+            Entry entry{region, 0, 0, std::move(tiles)};
+            if (!fileChecksum(region_file, entry.size, entry.crc))
+            {
+                fprintf(stderr, "Cannot read \"%s\" back for the manifest\n", region_file.c_str());
+                return false;
+            }
+
+            m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(),
+                                           [&](const Entry &e) { return e.region == region; }),
+                            m_entries.end());
+            m_entries.push_back(entry);
+            m_written.erase(std::remove_if(m_written.begin(), m_written.end(),
+                                           [&](const Entry &e) { return e.region == region; }),
+                            m_written.end());
+            m_written.push_back(entry);
+            return write();
+        }
+
+    private:
+        void read(const std::string &filename)
+        {
+            FILE *file = fopen(filename.c_str(), "r");
+            if (file == nullptr)
+            {
+                return;
+            }
+
+            char line[256];
+            unsigned long long hash = 0;
+            bool valid = fgets(line, sizeof(line), file) != nullptr && std::string(line).starts_with(header) &&
+                         fscanf(file, " parameters %llx", &hash) == 1 && hash == m_parameters_hash;
+
+            Entry entry;
+            unsigned long long size;
+            unsigned int crc;
+            int tile_count;
+            while (valid && fscanf(file, " region %d %d %llu %x %d", &entry.region.x, &entry.region.y, &size, &crc,
+                                   &tile_count) == 5)
+            {
+                entry.size = size;
+                entry.crc = crc;
+                entry.tiles.resize(std::max(tile_count, 0));
+                for (TileHash &tile : entry.tiles)
+                {
+                    unsigned long long tile_hash;
+                    valid = valid && fscanf(file, " tile %d %d %d %d %llx", &tile.offset.x, &tile.offset.y,
+                                            &tile.size.x, &tile.size.y, &tile_hash) == 5;
+                    tile.hash = tile_hash;
+                }
+
+                // A truncated entry is dropped, its region is converted again
+                if (valid)
+                {
+                    m_entries.push_back(entry);
+                }
+            }
+            fclose(file);
+        }
+
+        // The manifests of other workers are left to them
+        bool write() const
+        {
+            std::string temp_filename = m_filename + ".tmp";
+            FILE *file = fopen(temp_filename.c_str(), "w");
+            if (file == nullptr)
+            {
+                fprintf(stderr, "Cannot write \"%s\"\n", temp_filename.c_str());
+                return false;
+            }
+
+            fprintf(file, "%s\nparameters %016" PRIx64 "\n", header, m_parameters_hash);
+            for (const Entry &entry : m_keep_read ? m_entries : m_written)
+            {
+                fprintf(file, "region %d %d %" PRIu64 " %08" PRIx32 " %zu\n", entry.region.x, entry.region.y,
+                        entry.size, entry.crc, entry.tiles.size());
+                for (const TileHash &tile : entry.tiles)
+                {
+                    fprintf(file, "tile %d %d %d %d %016" PRIx64 "\n", tile.offset.x, tile.offset.y, tile.size.x,
+                            tile.size.y, tile.hash);
+                }
+            }
+
+            bool success = fflush(file) == 0 && ferror(file) == 0;
+            fclose(file);
+
+            std::error_code error;
+            if (success)
+            {
+                std::filesystem::rename(temp_filename, m_filename, error);
+            }
+            if (!success || error)
+            {
+                fprintf(stderr, "Cannot write \"%s\"\n", m_filename.c_str());
+                std::filesystem::remove(temp_filename, error);
+                return false;
+            }
+            return true;
+        }
+
+        std::string m_filename;
+        uint64_t m_parameters_hash;
+        bool m_keep_read;
+        std::vector<Entry> m_entries; // read back and written
+        std::vector<Entry> m_written; // by this process
+    };
+
+    /**
+     * @brief What a run writes in a region
+     */
+    struct RegionUpdate
+    {
+        glm::ivec2 region;
+        std::vector<TileHash> tiles;       // every tile of the region, recorded once it is written
+        std::vector<bool> replaced_chunks; // written over the existing file, empty to write the whole region
+    };
+
+    /**
+     * @brief Compare the tiles of a plan with the regions a previous run wrote
+     *
+     * Regions whose file and tiles are unchanged are left out. Without partial updates, the other
+     * regions are voxelized and written whole. With them, only the tiles whose hash changed are kept
+     * in the plan and the chunks of the changed and removed tiles are written over the existing file,
+     * regions of the manifest no tile is left in get their removed tiles written over with air.
+     *
+     * @param tile_hashes hash of every tile of the plan, empty if the tiles are not hashed: a region
+     * then counts as unchanged as soon as its file is
+     * @param kept_tiles indices of the tiles of the plan to voxelize
+     * @return one update per region to write, in plan order, then the regions of the manifest left out
+     * of the plan. The tiles of an update may all be unchanged, only removed ones are written then.
+     */
+    inline std::vector<RegionUpdate> planUpdates(const Manifest &manifest, const std::vector<planner::Tile> &tiles,
+                                                 const std::vector<uint64_t> &tile_hashes, glm::ivec3 tile_size,
+                                                 bool partial,
+                                                 const std::function<std::string(glm::ivec2)> &region_file,
+                                                 std::vector<size_t> &kept_tiles)
+    {
+        // Chunks of a tile over the extent it was written with, clamped to its region
+        auto mark_tile = [&](std::vector<bool> &chunks, glm::ivec2 region, const TileHash &tile) {
+            glm::ivec2 local = tile.offset - region * planner::region_size;
+            glm::ivec2 first = glm::max(local / planner::section_size, 0);
+            glm::ivec2 last = glm::min((local + tile.size + planner::section_size - 1) / planner::section_size, 32);
+            for (int z = first.y; z < last.y; z++)
+            {
+                for (int x = first.x; x < last.x; x++)
+                {
+                    chunks[z * 32 + x] = true;
+                }
+            }
+        };
+
+        std::vector<RegionUpdate> updates;
+        std::vector<glm::ivec2> planned;
+        kept_tiles.clear();
+        for (size_t first = 0, last = 0; first < tiles.size(); first = last)
+        {
+            const glm::ivec2 region = tiles[first].region;
+            planned.push_back(region);
+
+            RegionUpdate update{region, {}, {}};
+            for (last = first; last < tiles.size() && tiles[last].region == region; last++)
+            {
+                if (!tile_hashes.empty())
+                {
+                    glm::ivec2 offset(tiles[last].voxel_offset.x, tiles[last].voxel_offset.z);
+                    update.tiles.push_back({offset, glm::ivec2(tile_size.x, tile_size.z), tile_hashes[last]});
+                }
+            }
+
+            const Entry *entry = manifest.find(region, region_file(region));
+            std::vector<size_t> changed;
+            std::vector<bool> chunks(mca::entries, false);
+            for (size_t i = first; i < last; i++)
+            {
+                bool unchanged = entry != nullptr;
+                if (unchanged && !update.tiles.empty())
+                {
+                    const TileHash &tile = update.tiles[i - first];
+                    unchanged = std::any_of(entry->tiles.begin(), entry->tiles.end(), [&](const TileHash &t) {
+                        return t.offset == tile.offset && t.size == tile.size && t.hash == tile.hash;
+                    });
+                }
+                if (!unchanged)
+                {
+                    changed.push_back(i);
+                    if (!update.tiles.empty())
+                    {
+                        mark_tile(chunks, region, update.tiles[i - first]);
+                    }
+                }
+            }
+
+            // Tiles the mesh no longer touches, or a run with another tile size no longer has, still hold the
+            // voxels of the previous run over their recorded extent
+            bool removed = false;
+            for (size_t t = 0; entry != nullptr && t < entry->tiles.size(); t++)
+            {
+                const TileHash &tile = entry->tiles[t];
+                if (std::none_of(update.tiles.begin(), update.tiles.end(),
+                                 [&](const TileHash &u) { return u.offset == tile.offset && u.size == tile.size; }))
+                {
+                    mark_tile(chunks, region, tile);
+                    removed = true;
+                }
+            }
+
+            if (changed.empty() && !removed)
+            {
+                continue;
+            }
+
+            if (partial && entry != nullptr)
+            {
+                kept_tiles.insert(kept_tiles.end(), changed.begin(), changed.end());
+                update.replaced_chunks = std::move(chunks);
+            }
+            else
+            {
+                for (size_t i = first; i < last; i++)
+                {
+                    kept_tiles.push_back(i);
+                }
+            }
+            updates.push_back(std::move(update));
+        }
+
+        if (partial && !tile_hashes.empty())
+        {
+            for (glm::ivec2 region : manifest.regions())
+            {
+                if (std::find(planned.begin(), planned.end(), region) != planned.end())
+                {
+                    continue;
+                }
+                planned.push_back(region);
+
+                const Entry *entry = manifest.find(region, region_file(region));
+                if (entry == nullptr || entry->tiles.empty())
+                {
+                    continue;
+                }
+
+                RegionUpdate update{region, {}, std::vector<bool>(mca::entries, false)};
+                for (const TileHash &tile : entry->tiles)
+                {
+                    mark_tile(update.replaced_chunks, region, tile);
+                }
+                updates.push_back(std::move(update));
+            }
+        }
+        return updates;
+    }
+} // namespace manifest
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+ * @brief Read-only memory mapping of a whole file, unmapped when destroyed
+ */
+class MappedFile
+{
+public:
+    MappedFile() : m_data{nullptr}, m_size{0}
+    {
+    }
+
+    explicit MappedFile(const std::string &filename) : MappedFile()
+    {
+        open(filename);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        close();
+    }
+
+    bool open(const std::string &filename)
+    {
+        close();
+
+#ifdef _WIN32
+        HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+
+        LARGE_INTEGER file_size{};
+        GetFileSizeEx(file, &file_size);
+        m_size = (size_t)file_size.QuadPart;
+
+        if (m_size > 0)
+        {
+            HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (mapping != NULL)
+            {
+                m_data = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+#else
+        int file = ::open(filename.c_str(), O_RDONLY);
+        if (file < 0)
+        {
+            return false;
+        }
+
+        struct stat file_stat{};
+        fstat(file, &file_stat);
+        m_size = (size_t)file_stat.st_size;
+
+        if (m_size > 0)
+        {
+            void *data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, file, 0);
+            if (data != MAP_FAILED)
+            {
+                madvise(data, m_size, MADV_WILLNEED);
+                m_data = (const uint8_t *)data;
+            }
+        }
+        ::close(file);
+#endif
+
+        if (m_data == nullptr)
+        {
+            m_size = 0;
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (m_data != nullptr)
+        {
+#ifdef _WIN32
+            UnmapViewOfFile(m_data);
+#else
+            munmap((void *)m_data, m_size);
+#endif
+        }
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    const uint8_t *data() const
+    {
+        return m_data;
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    const uint8_t *m_data;
+    size_t m_size;
+};
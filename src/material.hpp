@@ -0,0 +1,285 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "mesh.hpp"
+
+/**
+ * Material voxelization: every voxel takes the color of the nearest triangle it touches, vertex color
+ * times the texture sampled at the barycentric uv, and the color is mapped to a block of a palette.
+ *
+ * The palette is searched once per cell of a 32^3 RGB lookup table, so a voxel costs one table read
+ * whatever the size of the palette. Textures are stored in 8x8 texel tiles: the texels a voxel and its
+ * neighbours read are close on the texture, a tile keeps them in one or two cache lines.
+ */
+namespace material
+{
+    struct Block
+    {
+        std::string id;
+        glm::vec3 color; // from 0 to 1
+    };
+
+    /**
+     * @brief Read a palette, one "block_id r g b" line per block with the color from 0 to 255, '#'
+     * starts a comment. minecraft:air is always block 0 and never picked for a color.
+     *
+     * @return false if the file cannot be read or has no block
+     */
+    inline bool loadPalette(const std::string &filename, std::vector<Block> &palette)
+    {
+        std::ifstream file(filename);
+        if (!file)
+        {
+            fprintf(stderr, "Cannot read the palette \"%s\"\n", filename.c_str());
+            return false;
+        }
+
+        palette.assign(1, Block{"minecraft:air", glm::vec3(0.0f)});
+        std::string line;
+        int line_number = 0;
+        while (std::getline(file, line))
+        {
+            line_number++;
+            line = line.substr(0, line.find('#'));
+
+            std::istringstream stream(line);
+            Block block;
+            glm::ivec3 color;
+            if (!(stream >> block.id))
+            {
+                continue;
+            }
+            if (!(stream >> color.x >> color.y >> color.z))
+            {
+                fprintf(stderr, "\"%s\" line %i: expected \"block_id r g b\"\n", filename.c_str(), line_number);
+                return false;
+            }
+            if (block.id == "minecraft:air")
+            {
+                continue;
+            }
+
+            block.color = glm::vec3(glm::clamp(color, 0, 255)) / 255.0f;
+            palette.push_back(block);
+        }
+
+        if (palette.size() == 1)
+        {
+            fprintf(stderr, "The palette \"%s\" has no block\n", filename.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    inline std::vector<std::string> blockIds(const std::vector<Block> &palette)
+    {
+        std::vector<std::string> ids;
+        for (const Block &block : palette)
+        {
+            ids.push_back(block.id);
+        }
+        return ids;
+    }
+
+    /**
+     * @brief Squared distance of two colors, weighted by the "redmean" approximation of the perceived difference
+     */
+    inline float colorDistance(const glm::vec3 &a, const glm::vec3 &b)
+    {
+        float red_mean = (a.x + b.x) * 0.5f;
+        glm::vec3 d = a - b;
+        return (2.0f + red_mean) * d.x * d.x + 4.0f * d.y * d.y + (3.0f - red_mean) * d.z * d.z;
+    }
+
+    /**
+     * @brief Block of every cell of a quantized RGB cube, the nearest block of the palette to the cell center
+     */
+    class ColorLUT
+    {
+    public:
+        static constexpr int bits = 5;
+        static constexpr int size = 1 << bits; // cells per channel
+
+        ColorLUT() = default;
+
+        explicit ColorLUT(const std::vector<Block> &palette) : m_blocks(size * size * size, 0)
+        {
+            for (int i = 0; i < size * size * size; i++)
+            {
+                glm::ivec3 cell(i >> (2 * bits), (i >> bits) & (size - 1), i & (size - 1));
+                glm::vec3 center = (glm::vec3(cell) + 0.5f) / (float)size;
+
+                float best_distance = INFINITY;
+                for (size_t b = 1; b < palette.size(); b++)
+                {
+                    float distance = colorDistance(center, palette[b].color);
+                    if (distance < best_distance)
+                    {
+                        best_distance = distance;
+                        m_blocks[i] = (int32_t)b;
+                    }
+                }
+            }
+        }
+
+        static int index(const glm::vec3 &color)
+        {
+            glm::ivec3 cell = glm::clamp(glm::ivec3(color * (float)size), 0, size - 1);
+            return (cell.x << (2 * bits)) | (cell.y << bits) | cell.z;
+        }
+
+        /**
+         * @brief Block of a color, air if it is mostly transparent
+         */
+        int block(const glm::vec4 &color) const
+        {
+            return color.a < 0.5f || m_blocks.empty() ? 0 : m_blocks[index(glm::vec3(color))];
+        }
+
+        const std::vector<int32_t> &data() const
+        {
+            return m_blocks;
+        }
+
+    private:
+        std::vector<int32_t> m_blocks;
+    };
+
+    /**
+     * @brief RGBA8 texture stored in tiles of tile_size x tile_size texels, tiles row by row
+     */
+    class Texture
+    {
+    public:
+        static constexpr int tile_size = 8;
+
+        Texture() = default;
+
+        /**
+         * @param rgba width * height texels packed as r | g << 8 | b << 16 | a << 24, top row first
+         */
+        Texture(int width, int height, const uint32_t *rgba)
+            : m_width{width}, m_height{height}, m_tiles_x{(width + tile_size - 1) / tile_size}
+        {
+            int tiles_y = (height + tile_size - 1) / tile_size;
+            m_texels.assign((size_t)m_tiles_x * tiles_y * tile_size * tile_size, 0);
+            for (int y = 0; y < height; y++)
+            {
+                for (int x = 0; x < width; x++)
+                {
+                    m_texels[texelIndex(x, y)] = rgba[(size_t)y * width + x];
+                }
+            }
+        }
+
+        /**
+         * @brief Texture already tiled, as read back from texels()
+         */
+        static Texture fromTiles(int width, int height, std::vector<uint32_t> texels)
+        {
+            Texture texture;
+            texture.m_width = width;
+            texture.m_height = height;
+            texture.m_tiles_x = (width + tile_size - 1) / tile_size;
+            texture.m_texels = std::move(texels);
+            return texture;
+        }
+
+        static size_t tiledSize(int width, int height)
+        {
+            return (size_t)((width + tile_size - 1) / tile_size) * ((height + tile_size - 1) / tile_size) * tile_size *
+                   tile_size;
+        }
+
+        size_t texelIndex(int x, int y) const
+        {
+            size_t tile = (size_t)(y / tile_size) * m_tiles_x + x / tile_size;
+            return tile * tile_size * tile_size + (y % tile_size) * tile_size + x % tile_size;
+        }
+
+        /**
+         * @brief Nearest texel of a uv, repeated out of [0, 1], v going up like in OpenGL. Must match
+         * sampleTexture in voxelizer.comp.
+         */
+        glm::vec4 sample(const glm::vec2 &uv) const
+        {
+            if (m_texels.empty())
+            {
+                return glm::vec4(1.0f);
+            }
+
+            glm::vec2 wrapped = uv - glm::floor(uv);
+            int x = std::min((int)(wrapped.x * m_width), m_width - 1);
+            int y = std::min((int)((1.0f - wrapped.y) * m_height), m_height - 1);
+
+            uint32_t texel = m_texels[texelIndex(x, y)];
+            return glm::vec4(texel & 0xFF, (texel >> 8) & 0xFF, (texel >> 16) & 0xFF, texel >> 24) / 255.0f;
+        }
+
+        int width() const
+        {
+            return m_width;
+        }
+
+        int height() const
+        {
+            return m_height;
+        }
+
+        int tilesX() const
+        {
+            return m_tiles_x;
+        }
+
+        const std::vector<uint32_t> &texels() const
+        {
+            return m_texels;
+        }
+
+    private:
+        int m_width = 0;
+        int m_height = 0;
+        int m_tiles_x = 0;
+        std::vector<uint32_t> m_texels;
+    };
+
+    /**
+     * @brief Everything the voxelizer needs to give a voxel a block
+     */
+    struct Materials
+    {
+        std::vector<Block> palette;
+        ColorLUT lut;
+        const std::vector<Texture> *textures = nullptr; // indexed by Vertex::texture - 1
+    };
+
+    /**
+     * @brief Color of a point of a triangle from its barycentric coordinates, see triangleColor in voxelizer.comp
+     */
+    inline glm::vec4 triangleColor(const Vertex vertices[3], const glm::vec3 &barycentric,
+                                   const std::vector<Texture> *textures)
+    {
+        glm::vec4 color = vertices[0].color * barycentric.x + vertices[1].color * barycentric.y +
+                          vertices[2].color * barycentric.z;
+
+        int texture = vertices[0].texture - 1;
+        if (textures != nullptr && texture >= 0 && texture < (int)textures->size())
+        {
+            glm::vec2 uv =
+                vertices[0].uv * barycentric.x + vertices[1].uv * barycentric.y + vertices[2].uv * barycentric.z;
+            color *= (*textures)[texture].sample(uv);
+        }
+        return color;
+    }
+} // namespace material
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -6,8 +8,16 @@
 #include <assert.h>
 #include <thread>
 #include <random>
+#include <array>
+#include <bit>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 #include "nbt.hpp"
+#include "profiler.hpp"
+#include "stats.hpp"
 #include "zlib.h"
 #include "timer.hpp"
 
@@ -15,23 +25,135 @@ namespace mca
 {
 	constexpr size_t entries = 1024;
 
-	void writeMCA(const std::string& filename, int x, int y, const std::vector<std::string>& palette, const std::vector<uint64_t>& data);
-	void writeChunkData(std::vector<uint8_t>& buf, int mca_x, int mca_y, int index, const std::vector<std::string>& palette, const std::vector<uint64_t>& data);
-	void writeChunk(nbt::bytes& chunk, int mca_x, int mca_y, int x, int z, const std::vector<std::string>& palette, const std::vector<uint64_t>& data);
-	void compressMemory(void* in_data, size_t in_data_size, std::vector<uint8_t>& out_data);
+	// Content addressed store of compressed chunks. Two chunks with the same voxels only differ by
+	// their xPos/zPos, so everything after those tags (the body) is deflated once and shared. The
+	// position is spliced in front of the cached body as a stored deflate block.
+	class ChunkCache
+	{
+	public:
+		struct Entry
+		{
+			std::vector<uint64_t>       voxels;
+			std::vector<std::string>    palette;
+			std::vector<uint8_t>        sky_light; // the light depends on the neighbours, it is part of the key
+			bool                        light_complete;
+			std::vector<uint8_t>        body_compressed;
+			uint32_t                    body_adler;
+			size_t                      body_size;
+		};
+
+		ChunkCache(size_t max_size = 256 * 1024 * 1024) : m_max_size{ max_size }, m_size{ 0 }, m_hits{ 0 }, m_misses{ 0 }
+		{
+		}
+
+		std::shared_ptr<const Entry> find(uint64_t hash, const std::vector<uint64_t>& voxels, const std::vector<std::string>& palette, const std::vector<uint8_t>& sky_light, bool light_complete)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			auto range = m_entries.equal_range(hash);
+			for (auto it = range.first; it != range.second; it++)
+			{
+				if (it->second->voxels == voxels && it->second->palette == palette && it->second->sky_light == sky_light && it->second->light_complete == light_complete)
+				{
+					m_hits++;
+					return it->second;
+				}
+			}
+
+			m_misses++;
+			return nullptr;
+		}
+
+		// Entries are only kept while the cache is under its size budget
+		void insert(uint64_t hash, std::shared_ptr<const Entry> entry)
+		{
+			size_t entry_size = entry->voxels.size() * sizeof(uint64_t) + entry->sky_light.size() + entry->body_compressed.size();
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_size + entry_size <= m_max_size)
+			{
+				m_entries.emplace(hash, std::move(entry));
+				m_size += entry_size;
+			}
+		}
+
+		size_t hits() const { return m_hits; }
+		size_t misses() const { return m_misses; }
+
+		double hitRate() const
+		{
+			size_t lookups = m_hits + m_misses;
+			return lookups ? (double)m_hits / lookups : 0.0;
+		}
+
+		static uint64_t hash(const std::vector<uint64_t>& voxels, const std::vector<std::string>& palette)
+		{
+			uint64_t h = 14695981039346656037ull;
+			for (uint64_t voxel : voxels) {
+				h = (h ^ voxel) * 1099511628211ull;
+				h ^= h >> 29;
+			}
+			for (const auto& block_id : palette) {
+				h = (h ^ std::hash<std::string>{}(block_id)) * 1099511628211ull;
+			}
+			return h;
+		}
+
+	private:
+		std::mutex                                                      m_mutex;
+		std::unordered_multimap<uint64_t, std::shared_ptr<const Entry>> m_entries;
+		size_t                                                          m_max_size;
+		size_t                                                          m_size;
+		std::atomic<size_t>                                             m_hits;
+		std::atomic<size_t>                                             m_misses;
+	};
+
+	// Returns false if the region file could not be written completely
+	bool writeMCA(const std::string& filename, int x, int y, const std::vector<std::string>& palette, const std::vector<uint64_t>& data, ChunkCache* cache = nullptr);
+	void writeChunkData(std::vector<uint8_t>& entry, int mca_x, int mca_y, int index, const std::vector<std::string>& palette, const std::vector<uint64_t>& data, ChunkCache* cache = nullptr);
+	void layoutRegion(const std::string& filename, const std::vector<std::vector<uint8_t>>& chunks, const std::vector<uint32_t>& timestamps, std::vector<uint8_t>& buffer);
+	// Sky light of a chunk as stored in its sections, 2 blocks per byte. Sections over the top of the chunk are fully lit
+	// and left out. complete is false when light from chunks the data does not hold could still reach the chunk.
+	struct ChunkLight
+	{
+		std::vector<uint8_t> sky_light;
+		bool                 complete = true;
+	};
+
+	// known_chunks: chunks of data that hold their whole content, all of them if null. Light crosses the borders
+	// of the known chunks only.
+	void writeChunk(nbt::bytes& chunk, int mca_x, int mca_y, int x, int z, const std::vector<std::string>& palette, const std::vector<uint64_t>& data, const std::vector<bool>* known_chunks = nullptr);
+	void writeChunkPosition(nbt::bytes& chunk, int mca_x, int mca_y, int x, int z);
+	void writeChunkBody(nbt::bytes& chunk, int x, int z, const std::vector<std::string>& palette, const std::vector<uint64_t>& data, const ChunkLight& light);
+	void compressChunk(int mca_x, int mca_y, int x, int z, const std::vector<std::string>& palette, const std::vector<uint64_t>& data, ChunkCache& cache, std::vector<uint8_t>& out_data, const std::vector<bool>* known_chunks = nullptr);
+	void computeHeights(const uint64_t* chunk_data, int section_count, int bits, std::array<int, 256>& heights);
+	void computeSkyLight(int x, int z, const std::vector<std::string>& palette, const std::vector<uint64_t>& data, const std::vector<bool>* known_chunks, ChunkLight& light);
+	void compressMemory(void* in_data, size_t in_data_size, std::vector<uint8_t>& out_data, int window_bits = 15);
+	bool decompressMemory(const void* in_data, size_t in_data_size, std::vector<uint8_t>& out_data);
 
+	// replaced_chunks: chunks encoded again from data instead of merged, the others are copied through
+	bool mergeMCA(const std::string& filename, int x, int y, const std::vector<std::string>& palette, const std::vector<uint64_t>& data, ChunkCache* cache = nullptr, const std::vector<bool>* replaced_chunks = nullptr);
+	bool mergeChunk(nbt::Tag& chunk, int x, int z, const std::vector<std::string>& palette, const std::vector<uint64_t>& data);
+	bool chunkTouched(int x, int z, const std::vector<std::string>& palette, const std::vector<uint64_t>& data);
 
-	void writeMCA(const std::string& filename, int x, int y, const std::vector<std::string>& palette, const std::vector<uint64_t>& data)
+	// Region data layout: chunks in region order (x + z * 32), then their sections from the bottom, each
+	// section holding its blocks packed in Minecraft's y-z-x order
+	int bitsPerBlock(size_t palette_size);
+	int longsPerSection(int bits);
+	int sectionCount(const std::vector<std::string>& palette, const std::vector<uint64_t>& data);
+	const uint64_t* chunkData(int x, int z, const std::vector<std::string>& palette, const std::vector<uint64_t>& data);
+	uint32_t blockAt(const uint64_t* section_data, int bits, int block);
+	int occupiedBlocks(const uint64_t* section_data, int bits);
+
+
+	bool writeMCA(const std::string& filename, int x, int y, const std::vector<std::string>& palette, const std::vector<uint64_t>& data, ChunkCache* cache)
 	{
 		// Defines constants
 		constexpr size_t max_entries_count = 1024; // 32 x 32  chunks
-		constexpr size_t max_entries_size = max_entries_count * 4096;
-		constexpr size_t max_locations_size = max_entries_count * 4;
-		constexpr size_t max_timestamps_size = max_entries_count * 4;
-		constexpr size_t max_buffer_size = max_locations_size + max_timestamps_size + max_entries_size;
 
-		// Pre-allocate buffer to be written to file
-		std::vector<uint8_t> buffer(max_buffer_size, 0);
+		// Every chunk as stored on disk, laid out once they are all encoded since their size is only known then
+		std::vector<std::vector<uint8_t>> chunks(max_entries_count);
+		std::vector<uint32_t> timestamps(max_entries_count, _byteswap_ulong((uint32_t)time(NULL)));
 
 #if SATANIA_MULTITHREADING
 		
@@ -39,16 +161,20 @@ namespace mca
 		int count = max_entries_count / num_thread;
 		std::vector<std::thread> threads;
 
-		auto thread_function = [&](std::vector<uint8_t>& buffer, int start, int count, const std::vector<std::string>& palette, const std::vector<uint64_t>& data) {
+		auto thread_function = [&](int start, int count) {
+			SATANIA_PROFILE_THREAD("mca encoder");
+			SATANIA_PROFILE_ZONE("encode chunks");
 			for (int i = start; i < start + count; i++) {
-				writeChunkData(buffer, x, y, i, palette, data);
+				writeChunkData(chunks[i], x, y, i, palette, data, cache);
 			}
 		};
 
 		for (size_t t = 0; t < num_thread; t++)
 		{
 			int start = t * count;
-			threads.push_back(std::thread(thread_function, std::ref(buffer), start, count, palette, data));
+			// the last thread also takes the chunks left over by the division
+			int thread_count = (t + 1 == num_thread) ? max_entries_count - start : count;
+			threads.push_back(std::thread(thread_function, start, thread_count));
 		}
 
 		// Wait for all the tread to be finished
@@ -58,79 +184,144 @@ namespace mca
 #else
 
 		for (int i = 0; i < max_entries_count; i++) {
-			writeChunkData(buffer, x, y, i, palette, data);
+			writeChunkData(chunks[i], x, y, i, palette, data, cache);
 		}
 
 #endif
+		std::vector<uint8_t> buffer;
+		layoutRegion(filename, chunks, timestamps, buffer);
+
+#if SATANIA_STATS
+		stats::Stats::get().region_sectors.add(buffer.size() / 4096);
+#endif
+
 		// Save the buffer to a file;
+		SATANIA_PROFILE_ZONE("write file", filename);
 		FILE* mca_file;
 		errno_t err = fopen_s(&mca_file, filename.c_str(), "wb");
 		if (err) {
-			fprintf(stderr, "cannot create/overwrite .mca file");
+			fprintf(stderr, "Cannot create/overwrite %s\n", filename.c_str());
+			return false;
 		}
-		else
-		{
-			size_t size = fwrite(buffer.data(), sizeof(buffer[0]), buffer.size(), mca_file);
 
-			if (size != buffer.size() * sizeof(buffer[0])) {
-				fprintf(stderr, "The .mca buffer was not entirely written");
-			}
+		size_t size = fwrite(buffer.data(), sizeof(buffer[0]), buffer.size(), mca_file);
+		bool closed = fclose(mca_file) == 0;
 
-			fclose(mca_file);
+		if (size != buffer.size() || !closed) {
+			fprintf(stderr, "The .mca buffer was not entirely written to %s\n", filename.c_str());
+			return false;
 		}
 
+		return true;
 	}
 
-	void writeChunkData(std::vector<uint8_t>& buf, int mca_x, int mca_y, int index, const std::vector<std::string>& palette, const std::vector<uint64_t>& data)
+	// Encode a chunk as stored on disk: 4 bytes length, 1 byte compression type and the payload
+	void writeChunkData(std::vector<uint8_t>& entry, int mca_x, int mca_y, int index, const std::vector<std::string>& palette, const std::vector<uint64_t>& data, ChunkCache* cache)
 	{
 		// Constants
-		constexpr int index_stride = 4;
-		constexpr int timestamp_offset = 4096;
-		constexpr int chunk_location_offset = 4096;
 		constexpr size_t chunk_reserve_size = 65536;
 
-		// set chunk data location and timestamp in mca header file
-		uint32_t location = _byteswap_ulong(((index + 2) << 8) + 1);
-		uint32_t timestamp = _byteswap_ulong(time(NULL));
-
-		auto ptr = buf.data();
-
-		// copy the data to the buffer
-		memcpy(ptr + (index * index_stride), &location, sizeof(location));
-		memcpy(ptr + (index * index_stride) + timestamp_offset, &timestamp, sizeof(timestamp));
-
 		std::vector<uint8_t> chunk, chunk_compressed;
 		chunk.reserve(chunk_reserve_size);
 
 		int x = index % 32;
 		int z = index / 32;
 
-		writeChunk(chunk, mca_x, mca_y, x, z, palette, data);
+		if (cache != nullptr)
+		{
+			compressChunk(mca_x, mca_y, x, z, palette, data, *cache, chunk_compressed);
+		}
+		else
+		{
+			writeChunk(chunk, mca_x, mca_y, x, z, palette, data);
 
-		compressMemory(chunk.data(), chunk.size() * sizeof(chunk[0]), chunk_compressed);
+			compressMemory(chunk.data(), chunk.size() * sizeof(chunk[0]), chunk_compressed);
+		}
 
 		uint32_t length = _byteswap_ulong((uint32_t)chunk_compressed.size() + 1);
 		uint8_t compression = 2;
 
-		memcpy(ptr + ((index + 2) * 4096), &length, sizeof(length));
-		memcpy(ptr + ((index + 2) * 4096) + 4, &compression, sizeof(compression));
-		memcpy(ptr + ((index + 2) * 4096) + 5, chunk_compressed.data(), chunk_compressed.size() * sizeof(chunk_compressed[0]));
+		entry.resize(5 + chunk_compressed.size());
+		memcpy(entry.data(), &length, sizeof(length));
+		memcpy(entry.data() + 4, &compression, sizeof(compression));
+		memcpy(entry.data() + 5, chunk_compressed.data(), chunk_compressed.size() * sizeof(chunk_compressed[0]));
 
 		//printf("Finished chunk (%i, %i)\n", x, z);
 	}
 
-	void writeChunk(nbt::bytes& chunk, int mca_x, int mca_y, int x, int z, const std::vector<std::string>& palette, const std::vector<uint64_t>& data)
+	// Region file of the encoded chunks: the header, then every chunk on as many sectors as it needs
+	void layoutRegion(const std::string& filename, const std::vector<std::vector<uint8_t>>& chunks, const std::vector<uint32_t>& timestamps, std::vector<uint8_t>& buffer)
+	{
+		constexpr size_t sector_size = 4096;
+		constexpr size_t header_size = 2 * sector_size;
+		constexpr int timestamp_offset = 4096;
+
+		size_t total_size = header_size;
+		for (const auto& chunk : chunks)
+		{
+			total_size += (chunk.size() + sector_size - 1) / sector_size * sector_size;
+		}
+
+		buffer.assign(header_size, 0);
+		buffer.reserve(total_size);
+		for (int i = 0; i < (int)entries; i++)
+		{
+			if (chunks[i].empty())
+			{
+				continue;
+			}
+
+			size_t sector = buffer.size() / sector_size;
+			size_t sector_count = (chunks[i].size() + sector_size - 1) / sector_size;
+			if (sector_count > 255)
+			{
+				fprintf(stderr, "Chunk (%i, %i) of %s is bigger than 1MB, dropping it\n", i % 32, i / 32, filename.c_str());
+				continue;
+			}
+
+			uint32_t location = _byteswap_ulong((uint32_t)((sector << 8) + sector_count));
+			memcpy(buffer.data() + (i * 4), &location, sizeof(location));
+			memcpy(buffer.data() + (i * 4) + timestamp_offset, &timestamps[i], sizeof(timestamps[i]));
+
+			buffer.insert(buffer.end(), chunks[i].begin(), chunks[i].end());
+			buffer.resize((sector + sector_count) * sector_size, 0);
+		}
+	}
+
+	void writeChunk(nbt::bytes& chunk, int mca_x, int mca_y, int x, int z, const std::vector<std::string>& palette, const std::vector<uint64_t>& data, const std::vector<bool>* known_chunks)
+	{
+		ChunkLight light;
+		computeSkyLight(x, z, palette, data, known_chunks, light);
+
+		writeChunkPosition(chunk, mca_x, mca_y, x, z);
+		writeChunkBody(chunk, x, z, palette, data, light);
+	}
+
+	// Opens the chunk compound up to its position, the only part of a chunk that depends on where it is
+	void writeChunkPosition(nbt::bytes& chunk, int mca_x, int mca_y, int x, int z)
 	{
 		int data_version = 2975; // 1.18.2
-		int chunk_height = data.size() / (512 * 32);
-		int section_count = chunk_height / 16;
-		int min_height = -4;
-		std::vector<int64_t> data_long(256, 0);
 
 		nbt::addCompoundTag(chunk, "");
 		nbt::addIntTag(chunk, "DataVersion", data_version);
-		nbt::addIntTag(chunk, "xPos", mca_x + x);
-		nbt::addIntTag(chunk, "zPos", mca_y + z);
+		nbt::addIntTag(chunk, "xPos", mca_x * 32 + x);
+		nbt::addIntTag(chunk, "zPos", mca_y * 32 + z);
+	}
+
+	void writeChunkBody(nbt::bytes& chunk, int x, int z, const std::vector<std::string>& palette, const std::vector<uint64_t>& data, const ChunkLight& light)
+	{
+		int bits = bitsPerBlock(palette.size());
+		int section_longs = longsPerSection(bits);
+		int section_count = sectionCount(palette, data);
+		int min_height = -4;
+		const uint64_t* chunk_data = chunkData(x, z, palette, data);
+		std::vector<int64_t> data_long(section_longs, 0);
+		std::vector<uint8_t> sky_light(2048, 0);
+
+		// Highest block of every column, used for the heightmaps
+		std::array<int, 256> heights;
+		computeHeights(chunk_data, section_count, bits, heights);
+
 		nbt::addIntTag(chunk, "yPos", min_height);
 		nbt::addStringTag(chunk, "Status", "full");
 		nbt::addLongTag(chunk, "LastUpdate", 0);
@@ -147,27 +338,19 @@ namespace mca
 			// TODO: remove unused pallete element and remove data long array if it is a unique chunk
 			
 
+			// The section is already packed, it only needs to be copied
+			const uint64_t* section_data = chunk_data + y * section_longs;
 			bool edited = false;
-			for (int local_y = 0; local_y < 16; local_y++)
+			for (int i = 0; i < section_longs; i++)
 			{
-				for (int local_z = 0; local_z < 16; local_z++)
-				{
-					int chunk_y = y * 16 + local_y;
-					int chunk_z = z * 16 + local_z;
-
-					int data_index = (chunk_z * chunk_height + chunk_y) * 32 + x;
-					int data_long_index = (local_y * 16) + local_z;
-
-					data_long[data_long_index] = data[data_index];
-
-					if (data_long[data_long_index] != 0 && !edited)
-					{
-						// printf("CHUNK (%i, %i) section %i, modified\n", x, z, y);
-						edited = true;
-					}
-				}
+				data_long[i] = (int64_t)section_data[i];
+				edited |= section_data[i] != 0;
 			}
 
+#if SATANIA_STATS
+			stats::Stats::get().occupied_blocks.add(edited ? occupiedBlocks(section_data, bits) : 0);
+#endif
+
 			if (edited)
 			{
 				nbt::addListTag(chunk, "palette", nbt::TAG_Compound, palette.size());
@@ -189,12 +372,38 @@ namespace mca
 			
 
 			nbt::addEndTag(chunk);
+
+			// Every block over the highest column top is fully lit
+			if ((size_t)(y + 1) * 2048 > light.sky_light.size())
+			{
+				std::fill(sky_light.begin(), sky_light.end(), 0xFF);
+			}
+			else
+			{
+				std::copy(light.sky_light.begin() + y * 2048, light.sky_light.begin() + (y + 1) * 2048, sky_light.begin());
+			}
+			nbt::addByteArrayTag(chunk, "SkyLight", sky_light);
+
 			nbt::addEndTag(chunk);
 		}
 
+		// Heights are stored relative to the bottom of the world, 9 bits per column and 7 columns per long.
+		// Our blocks are all solid so every heightmap type is the same
+		std::vector<int64_t> heightmap(37, 0);
+		for (int i = 0; i < 256; i++)
+		{
+			heightmap[i / 7] |= (int64_t)heights[i] << ((i % 7) * 9);
+		}
+
 		nbt::addListTag(chunk, "block_entities", nbt::TAG_Compound, 0);
 		nbt::addCompoundTag(chunk, "Heightmaps");
+		for (const char* heightmap_type : { "MOTION_BLOCKING", "MOTION_BLOCKING_NO_LEAVES", "OCEAN_FLOOR", "WORLD_SURFACE" })
+		{
+			nbt::addLongArrayTag(chunk, heightmap_type, std::vector<int64_t>(heightmap));
+		}
 		nbt::addEndTag(chunk);
+		// Without the full light the server relights the chunk, and its neighbours with it
+		nbt::addByteTag(chunk, "isLightOn", light.complete ? 1 : 0);
 		nbt::addListTag(chunk, "fluid_ticks", nbt::TAG_Compound, 0);
 		nbt::addListTag(chunk, "block_ticks", nbt::TAG_Compound, 0);
 		nbt::addListTag(chunk, "entities", nbt::TAG_Compound, 0);
@@ -223,8 +432,278 @@ namespace mca
 		nbt::addEndTag(chunk);
 	}
 
-	void compressMemory(void* in_data, size_t in_data_size, std::vector<uint8_t>& out_data)
+	void compressChunk(int mca_x, int mca_y, int x, int z, const std::vector<std::string>& palette, const std::vector<uint64_t>& data, ChunkCache& cache, std::vector<uint8_t>& out_data, const std::vector<bool>* known_chunks)
 	{
+		constexpr size_t chunk_reserve_size = 65536;
+
+		// The sections of this chunk and their light are the key of the cache
+		const uint64_t* chunk_data = chunkData(x, z, palette, data);
+		std::vector<uint64_t> voxels(chunk_data, chunk_data + sectionCount(palette, data) * longsPerSection(bitsPerBlock(palette.size())));
+
+		ChunkLight light;
+		computeSkyLight(x, z, palette, data, known_chunks, light);
+
+		uint64_t hash = ChunkCache::hash(voxels, palette);
+		std::shared_ptr<const ChunkCache::Entry> entry = cache.find(hash, voxels, palette, light.sky_light, light.complete);
+
+		if (entry == nullptr)
+		{
+			nbt::bytes body;
+			body.reserve(chunk_reserve_size);
+			writeChunkBody(body, x, z, palette, data, light);
+
+			auto new_entry = std::make_shared<ChunkCache::Entry>();
+			new_entry->voxels = std::move(voxels);
+			new_entry->palette = palette;
+			new_entry->sky_light = std::move(light.sky_light);
+			new_entry->light_complete = light.complete;
+			new_entry->body_adler = adler32(adler32(0, nullptr, 0), body.data(), body.size());
+			new_entry->body_size = body.size();
+
+			// Raw deflate so the stream can be appended after the position block
+			compressMemory(body.data(), body.size() * sizeof(body[0]), new_entry->body_compressed, -15);
+
+			cache.insert(hash, new_entry);
+			entry = new_entry;
+		}
+
+		nbt::bytes position;
+		writeChunkPosition(position, mca_x, mca_y, x, z);
+
+		// zlib stream: header, position as a non final stored block, cached body blocks, adler32 of both
+		std::vector<uint8_t> buffer;
+		buffer.reserve(2 + 5 + position.size() + entry->body_compressed.size() + 4);
+
+		uint16_t position_size = (uint16_t)position.size();
+		uint8_t header[7] = {
+			0x78, 0xDA,
+			0x00,
+			(uint8_t)(position_size & 0xFF), (uint8_t)(position_size >> 8),
+			(uint8_t)(~position_size & 0xFF), (uint8_t)((uint16_t)~position_size >> 8),
+		};
+		buffer.insert(buffer.end(), header, header + sizeof(header));
+		buffer.insert(buffer.end(), position.begin(), position.end());
+		buffer.insert(buffer.end(), entry->body_compressed.begin(), entry->body_compressed.end());
+
+		uint32_t position_adler = adler32(adler32(0, nullptr, 0), position.data(), position.size());
+		uint32_t adler = _byteswap_ulong(adler32_combine(position_adler, entry->body_adler, entry->body_size));
+		buffer.insert(buffer.end(), (uint8_t*)&adler, (uint8_t*)&adler + sizeof(adler));
+
+		out_data.swap(buffer);
+	}
+
+	void computeHeights(const uint64_t* chunk_data, int section_count, int bits, std::array<int, 256>& heights)
+	{
+		constexpr uint64_t nibble_low_bits = 0x1111111111111111;
+		int section_longs = longsPerSection(bits);
+
+		heights.fill(0);
+
+		if (bits != 4)
+		{
+			for (int i = 0; i < 256; i++)
+			{
+				for (int chunk_y = section_count * 16 - 1; chunk_y >= 0; chunk_y--)
+				{
+					if (blockAt(chunk_data + (chunk_y / 16) * section_longs, bits, (chunk_y % 16) * 256 + i) != 0)
+					{
+						heights[i] = chunk_y + 1;
+						break;
+					}
+				}
+			}
+			return;
+		}
+
+		for (int local_z = 0; local_z < 16; local_z++)
+		{
+			// Scan a row of 16 columns from the top, a long holds one block of each column so
+			// all of them are tested at once and the scan stops as soon as every column is found
+			uint64_t found = 0;
+			for (int chunk_y = section_count * 16 - 1; chunk_y >= 0 && found != nibble_low_bits; chunk_y--)
+			{
+				uint64_t row = chunk_data[(chunk_y / 16) * section_longs + (chunk_y % 16) * 16 + local_z];
+				uint64_t solid = (row | (row >> 1) | (row >> 2) | (row >> 3)) & nibble_low_bits & ~found;
+				found |= solid;
+
+				while (solid)
+				{
+					heights[local_z * 16 + std::countr_zero(solid) / 4] = chunk_y + 1;
+					solid &= solid - 1;
+				}
+			}
+		}
+	}
+
+	// Blocks over their column top get the full light, which then spreads sideways and down under overhangs, losing one
+	// level per block like the server does. A level reaches at most 14 blocks away, so the light of a chunk is spread
+	// through the window of the known chunks within 15 blocks of it, across the chunk borders.
+	void computeSkyLight(int x, int z, const std::vector<std::string>& palette, const std::vector<uint64_t>& data, const std::vector<bool>* known_chunks, ChunkLight& light)
+	{
+		constexpr int margin = 15;
+		constexpr int region_blocks = 512;
+		int bits = bitsPerBlock(palette.size());
+		int section_longs = longsPerSection(bits);
+		int section_count = sectionCount(palette, data);
+
+		auto known = [&](int chunk_x, int chunk_z) {
+			return chunk_x >= 0 && chunk_x < 32 && chunk_z >= 0 && chunk_z < 32 && (known_chunks == nullptr || (*known_chunks)[chunk_z * 32 + chunk_x]);
+		};
+
+		// Window in block coordinates of the region, it spans at most 3 x 3 chunks
+		int min_x = std::max(x * 16 - margin, 0);
+		int min_z = std::max(z * 16 - margin, 0);
+		int size_x = std::min(x * 16 + 16 + margin, region_blocks) - min_x;
+		int size_z = std::min(z * 16 + 16 + margin, region_blocks) - min_z;
+		int area = size_x * size_z;
+		int first_chunk_x = min_x / 16;
+		int first_chunk_z = min_z / 16;
+
+		// Column tops of the window, -1 in the chunks the data does not hold
+		const uint64_t* window_chunks[9] = {};
+		std::vector<int> heights(area, -1);
+		int top = 0;
+		for (int chunk_z = first_chunk_z; chunk_z * 16 < min_z + size_z; chunk_z++)
+		{
+			for (int chunk_x = first_chunk_x; chunk_x * 16 < min_x + size_x; chunk_x++)
+			{
+				if (!known(chunk_x, chunk_z))
+				{
+					continue;
+				}
+
+				const uint64_t* chunk_data = chunkData(chunk_x, chunk_z, palette, data);
+				window_chunks[(chunk_z - first_chunk_z) * 3 + chunk_x - first_chunk_x] = chunk_data;
+
+				std::array<int, 256> chunk_heights;
+				computeHeights(chunk_data, section_count, bits, chunk_heights);
+				for (int i = 0; i < 256; i++)
+				{
+					int window_x = chunk_x * 16 + i % 16 - min_x;
+					int window_z = chunk_z * 16 + i / 16 - min_z;
+					if (window_x >= 0 && window_x < size_x && window_z >= 0 && window_z < size_z)
+					{
+						heights[window_z * size_x + window_x] = chunk_heights[i];
+						top = std::max(top, chunk_heights[i]);
+					}
+				}
+			}
+		}
+
+		// Light of the window below the highest top, one byte per block in y-z-x order
+		std::vector<uint8_t> levels((size_t)top * area, 0);
+		std::vector<int> queue;
+		for (int column = 0; column < area; column++)
+		{
+			if (heights[column] < 0)
+			{
+				continue;
+			}
+
+			int window_x = column % size_x;
+			int window_z = column / size_x;
+			for (int y = heights[column]; y < top; y++)
+			{
+				levels[(size_t)y * area + column] = 15;
+			}
+
+			// Only the lit blocks next to a covered one can spread their light
+			int covered = 0;
+			if (window_x > 0) covered = std::max(covered, heights[column - 1]);
+			if (window_x + 1 < size_x) covered = std::max(covered, heights[column + 1]);
+			if (window_z > 0) covered = std::max(covered, heights[column - size_x]);
+			if (window_z + 1 < size_z) covered = std::max(covered, heights[column + size_x]);
+			for (int y = heights[column]; y < covered; y++)
+			{
+				queue.push_back(y * area + column);
+			}
+		}
+
+		auto air = [&](int block) {
+			int column = block % area;
+			int y = block / area;
+			int block_x = min_x + column % size_x;
+			int block_z = min_z + column / size_x;
+			const uint64_t* chunk_data = window_chunks[(block_z / 16 - first_chunk_z) * 3 + block_x / 16 - first_chunk_x];
+			return blockAt(chunk_data + (y / 16) * section_longs, bits, (y % 16) * 256 + (block_z % 16) * 16 + block_x % 16) == 0;
+		};
+
+		auto spread = [&](int block, uint8_t level) {
+			if (heights[block % area] < 0 || levels[block] >= level || !air(block))
+			{
+				return;
+			}
+			levels[block] = level;
+			queue.push_back(block);
+		};
+
+		for (size_t next = 0; next < queue.size(); next++)
+		{
+			int block = queue[next];
+			uint8_t level = levels[block] - 1;
+			if (level == 0)
+			{
+				continue;
+			}
+
+			int column = block % area;
+			int window_x = column % size_x;
+			int window_z = column / size_x;
+			int y = block / area;
+			if (window_x > 0) spread(block - 1, level);
+			if (window_x + 1 < size_x) spread(block + 1, level);
+			if (window_z > 0) spread(block - size_x, level);
+			if (window_z + 1 < size_z) spread(block + size_x, level);
+			if (y > 0) spread(block - area, level);
+			if (y + 1 < top) spread(block + area, level);
+		}
+
+		// Light can still come in from the chunks the window does not hold: past the region, or not known. It can
+		// only raise a shadowed air block next to them, the server relights the chunk if there is one.
+		light.complete = true;
+		for (int column = 0; column < area && light.complete; column++)
+		{
+			if (heights[column] < 0)
+			{
+				continue;
+			}
+
+			int block_x = min_x + column % size_x;
+			int block_z = min_z + column / size_x;
+			bool open = !known((block_x - 1) >> 4, block_z >> 4) || !known((block_x + 1) >> 4, block_z >> 4) ||
+			            !known(block_x >> 4, (block_z - 1) >> 4) || !known(block_x >> 4, (block_z + 1) >> 4);
+			for (int y = 0; open && y < heights[column] && light.complete; y++)
+			{
+				int block = y * area + column;
+				light.complete = levels[block] == 15 || !air(block);
+			}
+		}
+
+		// Sections of the chunk up to its own top, packed like the SkyLight arrays
+		int chunk_top = 0;
+		for (int i = 0; i < 256; i++)
+		{
+			chunk_top = std::max(chunk_top, heights[(z * 16 + i / 16 - min_z) * size_x + x * 16 + i % 16 - min_x]);
+		}
+
+		int light_sections = std::min((chunk_top + 15) / 16, section_count);
+		light.sky_light.assign((size_t)light_sections * 2048, 0);
+		for (int y = 0; y < light_sections * 16; y++)
+		{
+			for (int i = 0; i < 256; i++)
+			{
+				int column = (z * 16 + i / 16 - min_z) * size_x + x * 16 + i % 16 - min_x;
+				uint8_t level = y < top ? levels[(size_t)y * area + column] : 15;
+				int block = y * 256 + i;
+				light.sky_light[block / 2] |= level << ((block % 2) * 4);
+			}
+		}
+	}
+
+	void compressMemory(void* in_data, size_t in_data_size, std::vector<uint8_t>& out_data, int window_bits)
+	{
+		SATANIA_PROFILE_ZONE("compress");
+
 		std::vector<uint8_t> buffer;
 
 		const size_t BUFSIZE = 128 * 1024;
@@ -238,7 +717,7 @@ namespace mca
 		strm.next_out = temp_buffer;
 		strm.avail_out = BUFSIZE;
 
-		deflateInit(&strm, Z_BEST_COMPRESSION);
+		deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY);
 
 		while (strm.avail_in != 0)
 		{
@@ -268,7 +747,512 @@ namespace mca
 		buffer.insert(buffer.end(), temp_buffer, temp_buffer + BUFSIZE - strm.avail_out);
 		deflateEnd(&strm);
 
+#if SATANIA_STATS
+		stats::Stats::get().raw_bytes.add(in_data_size);
+		stats::Stats::get().compressed_bytes.add(buffer.size());
+#endif
+
 		out_data.swap(buffer);
 	}
 
+	bool decompressMemory(const void* in_data, size_t in_data_size, std::vector<uint8_t>& out_data)
+	{
+		std::vector<uint8_t> buffer;
+
+		const size_t BUFSIZE = 128 * 1024;
+		uint8_t temp_buffer[BUFSIZE]{};
+
+		z_stream strm{};
+		strm.zalloc = 0;
+		strm.zfree = 0;
+		strm.next_in = (uint8_t*)in_data;
+		strm.avail_in = in_data_size;
+
+		// 15 + 32 detects both zlib (compression type 2) and gzip (compression type 1) headers
+		if (inflateInit2(&strm, 15 + 32) != Z_OK)
+		{
+			return false;
+		}
+
+		int inflate_res = Z_OK;
+		while (inflate_res == Z_OK)
+		{
+			strm.next_out = temp_buffer;
+			strm.avail_out = BUFSIZE;
+			inflate_res = inflate(&strm, Z_NO_FLUSH);
+			buffer.insert(buffer.end(), temp_buffer, temp_buffer + BUFSIZE - strm.avail_out);
+		}
+		inflateEnd(&strm);
+
+		if (inflate_res != Z_STREAM_END)
+		{
+			return false;
+		}
+
+		out_data.swap(buffer);
+		return true;
+	}
+
+	bool mergeMCA(const std::string& filename, int x, int y, const std::vector<std::string>& palette, const std::vector<uint64_t>& data, ChunkCache* cache, const std::vector<bool>* replaced_chunks)
+	{
+		// Defines constants
+		constexpr size_t sector_size = 4096;
+		constexpr size_t header_size = 2 * sector_size;
+		constexpr int timestamp_offset = 4096;
+		constexpr size_t chunk_reserve_size = 65536;
+
+		// Load the existing region, without one there is nothing to merge with
+		std::vector<uint8_t> region;
+		FILE* mca_file;
+		errno_t err = fopen_s(&mca_file, filename.c_str(), "rb");
+		if (!err)
+		{
+			fseek(mca_file, 0, SEEK_END);
+			long file_size = ftell(mca_file);
+			fseek(mca_file, 0, SEEK_SET);
+
+			if (file_size > 0)
+			{
+				region.resize(file_size);
+				region.resize(fread(region.data(), sizeof(region[0]), region.size(), mca_file));
+			}
+
+			fclose(mca_file);
+		}
+
+		if (region.size() < header_size)
+		{
+			return writeMCA(filename, x, y, palette, data, cache);
+		}
+
+		// Every chunk as stored on disk: 4 bytes length, 1 byte compression type and the payload
+		std::vector<std::vector<uint8_t>> chunks(entries);
+		std::vector<uint32_t> timestamps(entries, 0);
+		std::vector<int> touched_chunks;
+
+		auto chunk_offset = [&](int index) {
+			uint32_t location;
+			memcpy(&location, region.data() + index * 4, sizeof(location));
+			return (size_t)(_byteswap_ulong(location) >> 8) * sector_size;
+		};
+
+		// Copy a chunk through verbatim, still compressed. A chunk whose length runs past its sectors or the
+		// file keeps the bytes of its sectors as they are, it is never dropped.
+		auto copy_chunk = [&](int index) {
+			size_t offset = chunk_offset(index);
+			if (offset == 0 || offset >= region.size())
+			{
+				return; // chunk not generated yet
+			}
+
+			uint32_t location;
+			memcpy(&location, region.data() + index * 4, sizeof(location));
+			size_t sectors_end = std::min(offset + (size_t)(_byteswap_ulong(location) & 0xFF) * sector_size, region.size());
+
+			uint32_t length = 0;
+			if (offset + 5 <= region.size())
+			{
+				memcpy(&length, region.data() + offset, sizeof(length));
+				length = _byteswap_ulong(length);
+			}
+
+			size_t end = offset + 4 + (size_t)length;
+			if (length == 0 || end > sectors_end)
+			{
+				fprintf(stderr, "Chunk (%i, %i) of %s is truncated, keeping its sectors as they are\n", index % 32, index / 32, filename.c_str());
+				end = sectors_end;
+			}
+
+			chunks[index].assign(region.data() + offset, region.data() + end);
+		};
+
+		// Untouched chunks are copied through
+		for (int i = 0; i < (int)entries; i++)
+		{
+			memcpy(&timestamps[i], region.data() + i * 4 + timestamp_offset, sizeof(timestamps[i]));
+
+			if (replaced_chunks != nullptr ? (*replaced_chunks)[i] : chunkTouched(i % 32, i / 32, palette, data))
+			{
+				touched_chunks.push_back(i);
+				continue;
+			}
+
+			copy_chunk(i);
+		}
+
+		// Light spreads across the chunks written from the voxels alone, the merged ones keep blocks we cannot see
+		std::vector<bool> known_chunks(entries, false);
+		for (int index : touched_chunks)
+		{
+			known_chunks[index] = replaced_chunks != nullptr || chunk_offset(index) == 0 || chunk_offset(index) >= region.size();
+		}
+
+		// Touched chunks are decoded, merged with the voxels and encoded again
+		auto merge_function = [&](int index) {
+			int chunk_x = index % 32;
+			int chunk_z = index / 32;
+			size_t offset = chunk_offset(index);
+
+			nbt::bytes chunk;
+			chunk.reserve(chunk_reserve_size);
+
+			bool merged = false;
+			if (replaced_chunks == nullptr && offset != 0 && offset < region.size())
+			{
+				uint32_t length = 0;
+				uint8_t compression = 0;
+				if (offset + 5 <= region.size())
+				{
+					memcpy(&length, region.data() + offset, sizeof(length));
+					length = _byteswap_ulong(length);
+					compression = region[offset + 4];
+				}
+
+				std::vector<uint8_t> raw;
+				bool decoded = false;
+				if (length >= 1 && offset + 4 + length <= region.size())
+				{
+					const uint8_t* payload = region.data() + offset + 5;
+					if (compression == 1 || compression == 2)
+					{
+						decoded = decompressMemory(payload, length - 1, raw);
+					}
+					else if (compression == 3)
+					{
+						raw.assign(payload, payload + length - 1);
+						decoded = true;
+					}
+				}
+
+				nbt::Tag root;
+				const uint8_t* ptr = raw.data();
+				if (decoded && nbt::readTag(ptr, raw.data() + raw.size(), root) && mergeChunk(root, chunk_x, chunk_z, palette, data))
+				{
+					nbt::writeTag(chunk, root);
+					merged = true;
+				}
+				else
+				{
+					// Older layouts, other compressions and corrupt chunks are the player's terrain all the same
+					fprintf(stderr, "Cannot merge chunk (%i, %i) of %s, keeping it as is\n", chunk_x, chunk_z, filename.c_str());
+					copy_chunk(index);
+					return;
+				}
+			}
+
+			std::vector<uint8_t> chunk_compressed;
+			if (!merged && cache != nullptr)
+			{
+				compressChunk(x, y, chunk_x, chunk_z, palette, data, *cache, chunk_compressed, &known_chunks);
+			}
+			else
+			{
+				if (!merged)
+				{
+					writeChunk(chunk, x, y, chunk_x, chunk_z, palette, data, &known_chunks);
+				}
+				compressMemory(chunk.data(), chunk.size() * sizeof(chunk[0]), chunk_compressed);
+			}
+
+			uint32_t length = _byteswap_ulong((uint32_t)chunk_compressed.size() + 1);
+			uint8_t compression = 2;
+
+			auto& entry = chunks[index];
+			entry.resize(5 + chunk_compressed.size());
+			memcpy(entry.data(), &length, sizeof(length));
+			memcpy(entry.data() + 4, &compression, sizeof(compression));
+			memcpy(entry.data() + 5, chunk_compressed.data(), chunk_compressed.size() * sizeof(chunk_compressed[0]));
+
+			timestamps[index] = _byteswap_ulong(time(NULL));
+		};
+
+#if SATANIA_MULTITHREADING
+
+		int num_thread = std::max(1, std::min((int)std::thread::hardware_concurrency(), (int)touched_chunks.size()));
+		std::vector<std::thread> threads;
+
+		for (int t = 0; t < num_thread; t++)
+		{
+			threads.push_back(std::thread([&, t]() {
+				SATANIA_PROFILE_THREAD("mca encoder");
+				SATANIA_PROFILE_ZONE("merge chunks");
+				for (size_t i = t; i < touched_chunks.size(); i += num_thread) {
+					merge_function(touched_chunks[i]);
+				}
+			}));
+		}
+
+		// Wait for all the tread to be finished
+		for (auto& thread : threads) {
+			thread.join();
+		}
+#else
+
+		for (int index : touched_chunks) {
+			merge_function(index);
+		}
+
+#endif
+
+		// Lay the chunks out again, they no longer fit in their old sectors
+		std::vector<uint8_t> buffer;
+		layoutRegion(filename, chunks, timestamps, buffer);
+
+#if SATANIA_STATS
+		stats::Stats::get().region_sectors.add(buffer.size() / sector_size);
+#endif
+
+		// Save the buffer to a file;
+		SATANIA_PROFILE_ZONE("write file", filename);
+		err = fopen_s(&mca_file, filename.c_str(), "wb");
+		if (err) {
+			fprintf(stderr, "Cannot create/overwrite %s\n", filename.c_str());
+			return false;
+		}
+
+		size_t size = fwrite(buffer.data(), sizeof(buffer[0]), buffer.size(), mca_file);
+		bool closed = fclose(mca_file) == 0;
+
+		if (size != buffer.size() || !closed) {
+			fprintf(stderr, "The .mca buffer was not entirely written to %s\n", filename.c_str());
+			return false;
+		}
+
+		return true;
+	}
+
+	bool mergeChunk(nbt::Tag& chunk, int x, int z, const std::vector<std::string>& palette, const std::vector<uint64_t>& data)
+	{
+		int bits = bitsPerBlock(palette.size());
+		int section_longs = longsPerSection(bits);
+		int section_count = sectionCount(palette, data);
+		int min_height = -4;
+		const uint64_t* chunk_data = chunkData(x, z, palette, data);
+
+		// Chunks older than 1.18 keep their sections inside a "Level" compound and are not supported
+		nbt::Tag* sections = chunk.find("sections");
+		if (chunk.type != nbt::TAG_Compound || sections == nullptr || sections->type != nbt::TAG_List)
+		{
+			return false;
+		}
+		if (sections->children.empty())
+		{
+			sections->list_type = nbt::TAG_Compound;
+		}
+		if (sections->list_type != nbt::TAG_Compound)
+		{
+			return false;
+		}
+
+		std::vector<uint16_t> blocks(4096, 0);
+		bool edited_chunk = false;
+
+		for (int y = 0; y < section_count; y++)
+		{
+			const uint64_t* section_data = chunk_data + y * section_longs;
+			bool edited = std::any_of(section_data, section_data + section_longs, [](uint64_t block) { return block != 0; });
+
+			if (!edited)
+			{
+				continue;
+			}
+
+			// Find the stored section or create an empty one
+			nbt::Tag* section = nullptr;
+			for (auto& child : sections->children)
+			{
+				nbt::Tag* section_y = child.find("Y");
+				if (section_y != nullptr && nbt::getInteger(*section_y) == y + min_height)
+				{
+					section = &child;
+					break;
+				}
+			}
+
+			if (section == nullptr)
+			{
+				nbt::Tag biome_palette = nbt::makeListTag("palette", nbt::TAG_String);
+				biome_palette.children.push_back(nbt::makeStringTag("", "minecraft:the_void"));
+				nbt::Tag biomes = nbt::makeTag(nbt::TAG_Compound, "biomes");
+				biomes.children.push_back(std::move(biome_palette));
+
+				nbt::Tag new_section = nbt::makeTag(nbt::TAG_Compound, "");
+				new_section.children.push_back(nbt::makeByteTag("Y", y + min_height));
+				new_section.children.push_back(std::move(biomes));
+
+				sections->children.push_back(std::move(new_section));
+				section = &sections->children.back();
+			}
+
+			if (section->find("block_states") == nullptr)
+			{
+				section->children.push_back(nbt::makeTag(nbt::TAG_Compound, "block_states"));
+			}
+			nbt::Tag* block_states = section->find("block_states");
+
+			if (block_states->find("palette") == nullptr)
+			{
+				block_states->children.push_back(nbt::makeListTag("palette", nbt::TAG_Compound));
+			}
+			nbt::Tag* block_palette = block_states->find("palette");
+			if (block_palette->children.empty())
+			{
+				nbt::Tag block = nbt::makeTag(nbt::TAG_Compound, "");
+				block.children.push_back(nbt::makeStringTag("Name", palette[0]));
+				block_palette->list_type = nbt::TAG_Compound;
+				block_palette->children.push_back(std::move(block));
+			}
+			if (block_palette->list_type != nbt::TAG_Compound)
+			{
+				return false;
+			}
+
+			// Unpack the stored block indices
+			std::fill(blocks.begin(), blocks.end(), 0);
+			nbt::Tag* block_data = block_states->find("data");
+			if (block_data != nullptr && block_palette->children.size() > 1)
+			{
+				int stored_bits = bitsPerBlock(block_palette->children.size());
+				std::vector<int64_t> data_long = nbt::getLongArray(*block_data);
+
+				if (data_long.size() >= (size_t)longsPerSection(stored_bits))
+				{
+					for (int i = 0; i < 4096; i++)
+					{
+						blocks[i] = (uint16_t)blockAt((const uint64_t*)data_long.data(), stored_bits, i);
+					}
+				}
+			}
+
+			// Map our palette onto the section palette
+			std::vector<uint16_t> remap(palette.size(), 0);
+			for (size_t p = 1; p < palette.size(); p++)
+			{
+				size_t index = 0;
+				for (; index < block_palette->children.size(); index++)
+				{
+					nbt::Tag& block = block_palette->children[index];
+					nbt::Tag* name = block.find("Name");
+					if (name != nullptr && nbt::getString(*name) == palette[p] && block.find("Properties") == nullptr)
+					{
+						break;
+					}
+				}
+
+				if (index == block_palette->children.size())
+				{
+					nbt::Tag block = nbt::makeTag(nbt::TAG_Compound, "");
+					block.children.push_back(nbt::makeStringTag("Name", palette[p]));
+					block_palette->children.push_back(std::move(block));
+				}
+
+				remap[p] = (uint16_t)index;
+			}
+
+			// Our blocks win over the existing ones, air voxels keep the terrain
+			for (int i = 0; i < 4096; i++)
+			{
+				uint32_t block = blockAt(section_data, bits, i);
+				if (block != 0 && block < palette.size())
+				{
+					blocks[i] = remap[block];
+				}
+			}
+
+			// Encode the section again
+			if (block_palette->children.size() == 1)
+			{
+				block_states->erase("data");
+			}
+			else
+			{
+				int stored_bits = bitsPerBlock(block_palette->children.size());
+				int per_long = 64 / stored_bits;
+
+				std::vector<int64_t> data_long(longsPerSection(stored_bits), 0);
+				for (int i = 0; i < 4096; i++)
+				{
+					data_long[i / per_long] |= (int64_t)((uint64_t)blocks[i] << ((i % per_long) * stored_bits));
+				}
+
+				if (block_states->find("data") == nullptr)
+				{
+					block_states->children.push_back(nbt::makeTag(nbt::TAG_Long_Array, "data"));
+				}
+				nbt::setLongArray(*block_states->find("data"), data_long);
+			}
+
+			// The stored light no longer matches the blocks
+			section->erase("SkyLight");
+			section->erase("BlockLight");
+			edited_chunk = true;
+		}
+
+		// Let the server relight the chunk and recompute its heightmaps
+		if (edited_chunk)
+		{
+			if (nbt::Tag* light_on = chunk.find("isLightOn"))
+			{
+				*light_on = nbt::makeByteTag("isLightOn", 0);
+			}
+			if (nbt::Tag* heightmaps = chunk.find("Heightmaps"))
+			{
+				heightmaps->children.clear();
+			}
+		}
+
+		return true;
+	}
+
+	bool chunkTouched(int x, int z, const std::vector<std::string>& palette, const std::vector<uint64_t>& data)
+	{
+		const uint64_t* chunk_data = chunkData(x, z, palette, data);
+		size_t chunk_longs = (size_t)sectionCount(palette, data) * longsPerSection(bitsPerBlock(palette.size()));
+
+		return std::any_of(chunk_data, chunk_data + chunk_longs, [](uint64_t block) { return block != 0; });
+	}
+
+	// Minecraft uses at least 4 bits per block and entries never span two longs
+	int bitsPerBlock(size_t palette_size)
+	{
+		int bits = 4;
+		while (((size_t)1 << bits) < palette_size) {
+			bits++;
+		}
+		return bits;
+	}
+
+	int longsPerSection(int bits)
+	{
+		int per_long = 64 / bits;
+		return (4096 + per_long - 1) / per_long;
+	}
+
+	int sectionCount(const std::vector<std::string>& palette, const std::vector<uint64_t>& data)
+	{
+		return (int)(data.size() / (entries * longsPerSection(bitsPerBlock(palette.size()))));
+	}
+
+	const uint64_t* chunkData(int x, int z, const std::vector<std::string>& palette, const std::vector<uint64_t>& data)
+	{
+		size_t chunk_longs = (size_t)sectionCount(palette, data) * longsPerSection(bitsPerBlock(palette.size()));
+		return data.data() + (z * 32 + x) * chunk_longs;
+	}
+
+	uint32_t blockAt(const uint64_t* section_data, int bits, int block)
+	{
+		int per_long = 64 / bits;
+		return (uint32_t)((section_data[block / per_long] >> ((block % per_long) * bits)) & (((uint64_t)1 << bits) - 1));
+	}
+
+	int occupiedBlocks(const uint64_t* section_data, int bits)
+	{
+		int count = 0;
+		for (int block = 0; block < 4096; block++)
+		{
+			count += blockAt(section_data, bits, block) != 0;
+		}
+		return count;
+	}
+
 }
\ No newline at end of file
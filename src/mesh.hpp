@@ -3,7 +3,7 @@
 struct Vertex
 {
     glm::vec3 position;
-    GLfloat p_pos[1];
+    GLint texture; // 1 + index of the texture in the scene, 0 without
     glm::vec4 color;
     glm::vec2 uv;
     GLfloat p_uv[2];
@@ -14,3 +14,28 @@ struct Mesh
     std::vector<Vertex> vertices;
     std::vector<unsigned int> elements;
 };
+
+/**
+ * @brief Read-only structure of arrays mesh, used to build a BVH from memory the caller owns
+ * (a memory mapped .satmesh file for example)
+ */
+struct MeshView
+{
+    const glm::vec3 *positions;
+    const glm::vec4 *colors; // optional
+    const glm::vec2 *uvs;    // optional
+    const unsigned int *elements;
+    size_t vertex_count;
+    size_t triangle_count;
+    int texture; // 1 + index of the texture in the scene, 0 without
+};
+
+inline size_t triangleCount(const Mesh &mesh)
+{
+    return mesh.elements.size() / 3;
+}
+
+inline size_t triangleCount(const MeshView &mesh)
+{
+    return mesh.triangle_count;
+}
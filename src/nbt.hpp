@@ -347,6 +347,304 @@ namespace nbt
 		return _addArrayTag(dst, TAG_Long_Array, name, arr, elem);
 	}
 
+	/*************************************
+
+		 Reading Tags from bytes vector
+
+	*************************************/
+
+	// Generic tag tree used to edit existing NBT (e.g. chunks already stored in a region file).
+	// Value, string and array tags keep their big-endian payload untouched so a read/write
+	// round trip is lossless even for tags we never look at.
+	struct Tag
+	{
+		TagType             type = TAG_End;
+		std::string         name;
+		TagType             list_type = TAG_End;
+		bytes               payload;
+		std::vector<Tag>    children;
+
+		Tag* find(const std::string& child_name)
+		{
+			for (auto& child : children) {
+				if (child.name == child_name) {
+					return &child;
+				}
+			}
+			return nullptr;
+		}
+
+		void erase(const std::string& child_name)
+		{
+			children.erase(std::remove_if(children.begin(), children.end(), [&](const Tag& child) { return child.name == child_name; }), children.end());
+		}
+	};
+
+	template <typename T>
+	bool _readValue(const uint8_t*& ptr, const uint8_t* end, T& val)
+	{
+		if (end - ptr < (ptrdiff_t)sizeof(T)) {
+			return false;
+		}
+		memcpy(&val, ptr, sizeof(T));
+		swap_endian(val);
+		ptr += sizeof(T);
+		return true;
+	}
+
+	bool _readPayload(const uint8_t*& ptr, const uint8_t* end, Tag& tag, int depth)
+	{
+		// Guard against corrupted data nesting forever
+		if (depth > 512) {
+			return false;
+		}
+
+		const uint8_t* begin = ptr;
+		int32_t count = 0;
+
+		switch (tag.type)
+		{
+		case TAG_Byte:
+			ptr += 1;
+			break;
+		case TAG_Short:
+			ptr += 2;
+			break;
+		case TAG_Int:
+		case TAG_Float:
+			ptr += 4;
+			break;
+		case TAG_Long:
+		case TAG_Double:
+			ptr += 8;
+			break;
+		case TAG_String:
+		{
+			int16_t len = 0;
+			if (!_readValue(ptr, end, len)) {
+				return false;
+			}
+			ptr += (uint16_t)len;
+			break;
+		}
+		case TAG_Byte_Array:
+		case TAG_Int_Array:
+		case TAG_Long_Array:
+		{
+			if (!_readValue(ptr, end, count) || count < 0) {
+				return false;
+			}
+			size_t elem_size = tag.type == TAG_Byte_Array ? 1 : (tag.type == TAG_Int_Array ? 4 : 8);
+			if ((size_t)(end - ptr) < count * elem_size) {
+				return false;
+			}
+			ptr += count * elem_size;
+			break;
+		}
+		case TAG_List:
+		{
+			if (ptr >= end) {
+				return false;
+			}
+			tag.list_type = (TagType)*ptr++;
+			if (!_readValue(ptr, end, count) || count < 0) {
+				return false;
+			}
+			tag.children.resize(count);
+			for (auto& child : tag.children) {
+				child.type = tag.list_type;
+				if (!_readPayload(ptr, end, child, depth + 1)) {
+					return false;
+				}
+			}
+			return true;
+		}
+		case TAG_Compound:
+		{
+			while (ptr < end && *ptr != TAG_End) {
+				Tag child;
+				child.type = (TagType)*ptr++;
+
+				int16_t len = 0;
+				if (!_readValue(ptr, end, len) || end - ptr < (uint16_t)len) {
+					return false;
+				}
+				child.name.assign((const char*)ptr, (uint16_t)len);
+				ptr += (uint16_t)len;
+
+				if (!_readPayload(ptr, end, child, depth + 1)) {
+					return false;
+				}
+				tag.children.push_back(std::move(child));
+			}
+			if (ptr >= end) {
+				return false;
+			}
+			ptr++; // TAG_End
+			return true;
+		}
+		default:
+			return false;
+		}
+
+		if (ptr > end) {
+			return false;
+		}
+
+		tag.payload.assign(begin, ptr);
+		return true;
+	}
+
+	// Read one named tag (the root of a chunk is a nameless TAG_Compound)
+	bool readTag(const uint8_t*& ptr, const uint8_t* end, Tag& tag)
+	{
+		if (ptr >= end) {
+			return false;
+		}
+		tag = Tag{};
+		tag.type = (TagType)*ptr++;
+
+		int16_t len = 0;
+		if (!_readValue(ptr, end, len) || end - ptr < (uint16_t)len) {
+			return false;
+		}
+		tag.name.assign((const char*)ptr, (uint16_t)len);
+		ptr += (uint16_t)len;
+
+		return _readPayload(ptr, end, tag, 0);
+	}
+
+	void _writePayload(bytes& dst, const Tag& tag)
+	{
+		switch (tag.type)
+		{
+		case TAG_List:
+			dst.push_back((uint8_t)tag.list_type);
+			_addValue(dst, (int32_t)tag.children.size());
+			for (const auto& child : tag.children) {
+				_writePayload(dst, child);
+			}
+			break;
+		case TAG_Compound:
+			for (const auto& child : tag.children) {
+				dst.push_back((uint8_t)child.type);
+				_addValue(dst, (int16_t)child.name.size());
+				dst.insert(dst.end(), child.name.begin(), child.name.end());
+				_writePayload(dst, child);
+			}
+			addEndTag(dst);
+			break;
+		default:
+			dst.insert(dst.end(), tag.payload.begin(), tag.payload.end());
+			break;
+		}
+	}
+
+	void writeTag(bytes& dst, const Tag& tag)
+	{
+		dst.push_back((uint8_t)tag.type);
+		_addValue(dst, (int16_t)tag.name.size());
+		dst.insert(dst.end(), tag.name.begin(), tag.name.end());
+		_writePayload(dst, tag);
+	}
+
+	// Helpers to build and access the tags of a tree
+
+	Tag makeTag(TagType type, const std::string& name)
+	{
+		Tag tag;
+		tag.type = type;
+		tag.name = name;
+		return tag;
+	}
+
+	Tag makeByteTag(const std::string& name, int8_t val)
+	{
+		Tag tag = makeTag(TAG_Byte, name);
+		_addValue(tag.payload, val);
+		return tag;
+	}
+
+	Tag makeStringTag(const std::string& name, const std::string& val)
+	{
+		Tag tag = makeTag(TAG_String, name);
+		addStringTag(tag.payload, "", val);
+		return tag;
+	}
+
+	Tag makeListTag(const std::string& name, TagType list_type)
+	{
+		Tag tag = makeTag(TAG_List, name);
+		tag.list_type = list_type;
+		return tag;
+	}
+
+	int64_t getInteger(const Tag& tag)
+	{
+		const uint8_t* ptr = tag.payload.data();
+		const uint8_t* end = ptr + tag.payload.size();
+
+		switch (tag.type)
+		{
+		case TAG_Byte:
+			return tag.payload.empty() ? 0 : (int8_t)tag.payload[0];
+		case TAG_Short:
+		{
+			int16_t val = 0;
+			_readValue(ptr, end, val);
+			return val;
+		}
+		case TAG_Int:
+		{
+			int32_t val = 0;
+			_readValue(ptr, end, val);
+			return val;
+		}
+		case TAG_Long:
+		{
+			int64_t val = 0;
+			_readValue(ptr, end, val);
+			return val;
+		}
+		default:
+			return 0;
+		}
+	}
+
+	std::string getString(const Tag& tag)
+	{
+		if (tag.type != TAG_String || tag.payload.size() < 2) {
+			return {};
+		}
+		return std::string((const char*)tag.payload.data() + 2, tag.payload.size() - 2);
+	}
+
+	std::vector<int64_t> getLongArray(const Tag& tag)
+	{
+		std::vector<int64_t> val;
+		if (tag.type != TAG_Long_Array) {
+			return val;
+		}
+
+		const uint8_t* ptr = tag.payload.data();
+		const uint8_t* end = ptr + tag.payload.size();
+
+		int32_t count = 0;
+		_readValue(ptr, end, count);
+		val.resize(count);
+		for (auto& elem : val) {
+			_readValue(ptr, end, elem);
+		}
+		return val;
+	}
+
+	void setLongArray(Tag& tag, std::vector<int64_t> val)
+	{
+		tag.type = TAG_Long_Array;
+		tag.payload.clear();
+		addLongArrayTag(tag.payload, "", val);
+	}
+
 	template <typename T> void swap_endian(T& val)
 	{
 		union U {
@@ -0,0 +1,279 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "mapped_file.hpp"
+#include "mesh.hpp"
+#include "profiler.hpp"
+
+namespace obj
+{
+    // Range of the file parsed by one thread, always starting at the beginning of a line
+    struct Block
+    {
+        const char *begin;
+        const char *end;
+        size_t vertex_count;
+        size_t triangle_count;
+        size_t vertex_offset;
+        size_t triangle_offset;
+        bool uses_materials; // a "usemtl" line, the colors and textures are left to assimp
+    };
+
+    inline const char *skipSpaces(const char *ptr, const char *end)
+    {
+        while (ptr < end && (*ptr == ' ' || *ptr == '\t'))
+        {
+            ptr++;
+        }
+        return ptr;
+    }
+
+    inline const char *skipToken(const char *ptr, const char *end)
+    {
+        while (ptr < end && *ptr != ' ' && *ptr != '\t' && *ptr != '\r' && *ptr != '\n')
+        {
+            ptr++;
+        }
+        return ptr;
+    }
+
+    inline const char *nextLine(const char *ptr, const char *end)
+    {
+        const char *line_end = (const char *)memchr(ptr, '\n', end - ptr);
+        return line_end ? line_end + 1 : end;
+    }
+
+    inline bool isKeyword(const char *ptr, const char *end, char keyword)
+    {
+        return end - ptr >= 2 && ptr[0] == keyword && (ptr[1] == ' ' || ptr[1] == '\t');
+    }
+
+    // Number of corners of the face starting at ptr (after the "f")
+    inline int countCorners(const char *ptr, const char *end)
+    {
+        int corners = 0;
+        for (ptr = skipSpaces(ptr, end); ptr < end && *ptr != '\r' && *ptr != '\n'; ptr = skipSpaces(ptr, end))
+        {
+            ptr = skipToken(ptr, end);
+            corners++;
+        }
+        return corners;
+    }
+
+    /**
+     * @brief First pass: count the vertices and triangles of a block
+     */
+    inline void countBlock(Block &block)
+    {
+        block.vertex_count = 0;
+        block.triangle_count = 0;
+        block.uses_materials = false;
+
+        for (const char *line = block.begin; line < block.end; line = nextLine(line, block.end))
+        {
+            const char *ptr = skipSpaces(line, block.end);
+            if (isKeyword(ptr, block.end, 'v'))
+            {
+                block.vertex_count++;
+            }
+            else if (isKeyword(ptr, block.end, 'f'))
+            {
+                block.triangle_count += std::max(countCorners(ptr + 1, block.end) - 2, 0);
+            }
+            else if (block.end - ptr > 6 && memcmp(ptr, "usemtl", 6) == 0)
+            {
+                block.uses_materials = true;
+            }
+        }
+    }
+
+    /**
+     * @brief Second pass: parse a block straight into its slice of the mesh
+     *
+     * @return false if a face references a vertex that does not exist
+     */
+    inline bool parseBlock(const Block &block, Mesh &mesh)
+    {
+        size_t vertex = block.vertex_offset;
+        size_t element = block.triangle_offset * 3;
+        const size_t total_vertex_count = mesh.vertices.size();
+
+        for (const char *line = block.begin; line < block.end; line = nextLine(line, block.end))
+        {
+            const char *ptr = skipSpaces(line, block.end);
+            const char *line_end = std::min(nextLine(ptr, block.end), block.end);
+
+            if (isKeyword(ptr, line_end, 'v'))
+            {
+                // "v x y z [r g b]", some scanners store a color after the position
+                float values[6] = {0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f};
+                int value_count = 0;
+
+                ptr++;
+                for (; value_count < 6; value_count++)
+                {
+                    ptr = skipSpaces(ptr, line_end);
+                    auto result = std::from_chars(ptr, line_end, values[value_count]);
+                    if (result.ec != std::errc())
+                    {
+                        break;
+                    }
+                    ptr = result.ptr;
+                }
+
+                Vertex &v = mesh.vertices[vertex++];
+                v.position = glm::vec3(values[0], values[1], values[2]);
+                v.color = value_count >= 6 ? glm::vec4(values[3], values[4], values[5], 1.0f) : glm::vec4(1.0f);
+            }
+            else if (isKeyword(ptr, line_end, 'f'))
+            {
+                // "f v1[/vt1[/vn1]] v2... vn", polygons are triangulated as a fan
+                unsigned int first = 0, previous = 0;
+                int corner = 0;
+
+                for (ptr = skipSpaces(ptr + 1, line_end); ptr < line_end && *ptr != '\r' && *ptr != '\n';
+                     ptr = skipSpaces(ptr, line_end))
+                {
+                    long long index = 0;
+                    auto result = std::from_chars(ptr, line_end, index);
+                    if (result.ec != std::errc())
+                    {
+                        return false;
+                    }
+                    ptr = skipToken(result.ptr, line_end);
+
+                    // Negative indices are relative to the vertices read so far
+                    index = index < 0 ? (long long)vertex + index : index - 1;
+                    if (index < 0 || index >= (long long)total_vertex_count)
+                    {
+                        return false;
+                    }
+
+                    if (corner == 0)
+                    {
+                        first = (unsigned int)index;
+                    }
+                    else if (corner >= 2)
+                    {
+                        mesh.elements[element++] = first;
+                        mesh.elements[element++] = previous;
+                        mesh.elements[element++] = (unsigned int)index;
+                    }
+                    previous = (unsigned int)index;
+                    corner++;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Load the geometry of a Wavefront OBJ file without going through assimp
+     *
+     * The file is memory mapped and split in one block per thread. A first pass counts the vertices
+     * and triangles of every block so the second pass can parse each block directly into its part of
+     * the mesh. Only positions (and optional vertex colors) are read, every object of the file ends
+     * up in the same mesh. Files using materials are refused, the caller loads them with assimp.
+     *
+     * @return false if the file cannot be read, is malformed or uses materials
+     */
+    inline bool loadOBJ(const std::string &filename, Mesh &mesh, int num_thread = std::thread::hardware_concurrency())
+    {
+        MappedFile file(filename);
+        if (file.data() == nullptr)
+        {
+            return false;
+        }
+
+        const char *begin = (const char *)file.data();
+        const char *end = begin + file.size();
+
+        // Small files are not worth the threads
+        constexpr size_t min_block_size = 1 << 20;
+        num_thread = std::clamp((int)(file.size() / min_block_size), 1, std::max(num_thread, 1));
+
+        std::vector<Block> blocks(num_thread);
+        for (int t = 0; t < num_thread; t++)
+        {
+            const char *block_begin = begin + file.size() * t / num_thread;
+            blocks[t].begin = t == 0 ? begin : nextLine(block_begin - 1, end);
+        }
+        for (int t = 0; t < num_thread; t++)
+        {
+            blocks[t].end = t + 1 < num_thread ? blocks[t + 1].begin : end;
+        }
+
+        auto run = [&](auto &&function) {
+            if (num_thread == 1)
+            {
+                function(blocks[0]);
+                return;
+            }
+
+            std::vector<std::thread> threads;
+            for (auto &block : blocks)
+            {
+                threads.push_back(std::thread([&]() { function(block); }));
+            }
+            for (auto &thread : threads)
+            {
+                thread.join();
+            }
+        };
+
+        run([](Block &block) {
+            SATANIA_PROFILE_ZONE("count obj block");
+            countBlock(block);
+        });
+
+        if (std::any_of(blocks.begin(), blocks.end(), [](const Block &block) { return block.uses_materials; }))
+        {
+            printf("\"%s\" uses materials, it is not read by the fast OBJ loader\n", filename.c_str());
+            return false;
+        }
+
+        size_t vertex_count = 0;
+        size_t triangle_count = 0;
+        for (auto &block : blocks)
+        {
+            block.vertex_offset = vertex_count;
+            block.triangle_offset = triangle_count;
+            vertex_count += block.vertex_count;
+            triangle_count += block.triangle_count;
+        }
+
+        mesh.vertices.resize(vertex_count);
+        mesh.elements.resize(triangle_count * 3);
+
+        std::atomic<bool> valid = true;
+        run([&](Block &block) {
+            SATANIA_PROFILE_ZONE("parse obj block");
+            if (!parseBlock(block, mesh))
+            {
+                valid = false;
+            }
+        });
+
+        if (!valid || triangle_count == 0)
+        {
+            fprintf(stderr, "Cannot parse \"%s\" as an OBJ file\n", filename.c_str());
+            mesh.vertices.clear();
+            mesh.elements.clear();
+            return false;
+        }
+
+        return true;
+    }
+} // namespace obj
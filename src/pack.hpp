@@ -0,0 +1,354 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SATANIA_PACK_SSE2 1
+#include <emmintrin.h>
+#else
+#define SATANIA_PACK_SSE2 0
+#endif
+
+#include "mca.hpp"
+#include "profiler.hpp"
+
+namespace pack
+{
+    /**
+     * @brief Order of the voxels written by the voxelizer, must match voxelizer.comp
+     */
+    enum Layout
+    {
+        LAYOUT_LINEAR, // x + y * X + z * X * Y over the whole grid
+        LAYOUT_BRICK,  // contiguous 16^3 sections, blocks in Minecraft's y-z-x order
+        LAYOUT_MORTON, // contiguous 16^3 sections, blocks in morton order
+        LAYOUT_MAX
+    };
+
+    inline uint32_t spreadBits4(uint32_t v)
+    {
+        v = (v | (v << 4)) & 0x0C3u;
+        v = (v | (v << 2)) & 0x249u;
+        return v;
+    }
+
+    inline uint32_t compactBits4(uint32_t v)
+    {
+        v &= 0x249u;
+        v = (v | (v >> 2)) & 0x0C3u;
+        v = (v | (v >> 4)) & 0x00Fu;
+        return v;
+    }
+
+    /**
+     * @brief Index of a voxel in the voxelizer output. Sections are ordered like the chunks of a region
+     * (x then z) and from the bottom up, so a chunk column is contiguous as well.
+     */
+    inline size_t voxelIndex(glm::ivec3 voxel, glm::ivec3 size, Layout layout)
+    {
+        if (layout == LAYOUT_LINEAR)
+        {
+            return voxel.x + (size_t)voxel.y * size.x + (size_t)voxel.z * size.x * size.y;
+        }
+
+        glm::ivec3 brick = voxel / 16;
+        glm::ivec3 local = voxel - brick * 16;
+        glm::ivec3 brick_count = size / 16;
+        size_t brick_index = ((size_t)brick.z * brick_count.x + brick.x) * brick_count.y + brick.y;
+
+        uint32_t local_index = layout == LAYOUT_MORTON
+                                   ? spreadBits4(local.x) | (spreadBits4(local.y) << 1) | (spreadBits4(local.z) << 2)
+                                   : local.x + local.z * 16 + local.y * 256;
+
+        return brick_index * 4096 + local_index;
+    }
+
+    /**
+     * @brief Inverse of voxelIndex
+     */
+    inline glm::ivec3 voxelPosition(size_t index, glm::ivec3 size, Layout layout)
+    {
+        if (layout == LAYOUT_LINEAR)
+        {
+            return glm::ivec3(index % size.x, (index / size.x) % size.y, index / ((size_t)size.x * size.y));
+        }
+
+        glm::ivec3 brick_count = size / 16;
+        size_t brick_index = index / 4096;
+        uint32_t local_index = index % 4096;
+
+        glm::ivec3 brick;
+        brick.y = brick_index % brick_count.y;
+        brick.x = (brick_index / brick_count.y) % brick_count.x;
+        brick.z = brick_index / ((size_t)brick_count.y * brick_count.x);
+
+        glm::ivec3 local = layout == LAYOUT_MORTON ? glm::ivec3(compactBits4(local_index), compactBits4(local_index >> 1),
+                                                                compactBits4(local_index >> 2))
+                                                   : glm::ivec3(local_index % 16, local_index / 256, (local_index / 16) % 16);
+
+        return brick * 16 + local;
+    }
+
+    /**
+     * @brief Bricked layouts need every axis of the grid to be a multiple of a section
+     */
+    inline bool layoutSupported(glm::ivec3 size, Layout layout)
+    {
+        return layout == LAYOUT_LINEAR || (size.x % 16 == 0 && size.y % 16 == 0 && size.z % 16 == 0);
+    }
+
+    /**
+     * @brief Pack 16 consecutive voxels (one x row of a section) into the 4 bits entries of a long.
+     * Values are clamped to [0, 15].
+     */
+    inline uint64_t packRow4(const int *voxels)
+    {
+#if SATANIA_PACK_SSE2
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(voxels + 0));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(voxels + 4));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(voxels + 8));
+        __m128i v3 = _mm_loadu_si128((const __m128i *)(voxels + 12));
+
+        // 16 x int32 -> 16 x uint8, negative values saturate to 0
+        __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(v0, v1), _mm_packs_epi32(v2, v3));
+        bytes = _mm_min_epu8(bytes, _mm_set1_epi8(0x0F));
+
+        // Merge each pair of bytes into one: low nibble from the even voxel, high nibble from the odd one
+        __m128i nibbles = _mm_or_si128(bytes, _mm_srli_epi16(bytes, 4));
+        nibbles = _mm_and_si128(nibbles, _mm_set1_epi16(0x00FF));
+
+        uint64_t row;
+        _mm_storel_epi64((__m128i *)&row, _mm_packus_epi16(nibbles, nibbles));
+        return row;
+#else
+        uint64_t row = 0;
+        for (int x = 0; x < 16; x++)
+        {
+            row |= (uint64_t)std::clamp(voxels[x], 0, 15) << (x * 4);
+        }
+        return row;
+#endif
+    }
+
+    /**
+     * @brief Pack the blocks of one x row of a chunk (16 voxels) into its section
+     *
+     * @param row first voxel of the row
+     * @param local_y y position of the row inside its section
+     * @param local_z z position of the row inside its section
+     * @param bits bits per block, see mca::bitsPerBlock
+     * @param section_data mca::longsPerSection(bits) longs, must be zeroed for bits other than 4
+     */
+    inline void packRow(const int *row, int local_y, int local_z, int bits, uint64_t *section_data)
+    {
+        if (bits == 4)
+        {
+            // One long per x row, longs ordered by y then z
+            section_data[local_y * 16 + local_z] = packRow4(row);
+            return;
+        }
+
+        // Wider entries do not line up with the rows anymore
+        const int per_long = 64 / bits;
+        const int max_value = (1 << bits) - 1;
+        for (int local_x = 0; local_x < 16; local_x++)
+        {
+            int block = (local_y * 16 + local_z) * 16 + local_x;
+            section_data[block / per_long] |= (uint64_t)std::clamp(row[local_x], 0, max_value)
+                                              << ((block % per_long) * bits);
+        }
+    }
+
+    /**
+     * @brief Convert the voxelizer output of a tile into the layout expected by mca::writeMCA, in place
+     * in the packed data of the region holding the tile
+     *
+     * The voxels are read once in their stored order and every row is written to its section in
+     * Minecraft's y-z-x order. Threads get whole rows of chunks so they never share a long.
+     *
+     * @param voxels voxel grid of the tile, y must be a multiple of 16
+     * @param size size of the voxel grid, it must fit in the region from chunk_offset
+     * @param chunk_offset first chunk (x, z) of the tile in the region
+     * @param bits bits per block, see mca::bitsPerBlock
+     * @param data packed region of mca::entries chunks of size.y / 16 sections, only the chunks of the tile are written
+     * @param num_thread number of threads to pack with
+     * @param layout order of the voxels in the grid
+     */
+    inline void packTile(const int *voxels, glm::ivec3 size, glm::ivec2 chunk_offset, int bits,
+                         std::vector<uint64_t> &data, int num_thread = std::thread::hardware_concurrency(),
+                         Layout layout = LAYOUT_LINEAR)
+    {
+        const int section_count = size.y / 16;
+        const int section_longs = mca::longsPerSection(bits);
+        const size_t chunk_longs = (size_t)section_count * section_longs;
+        const int chunks_x = std::min(size.x / 16, 32 - chunk_offset.x);
+        const int chunks_z = std::min(size.z / 16, 32 - chunk_offset.y);
+        const size_t first_chunk = (size_t)chunk_offset.y * 32 + chunk_offset.x;
+
+        // Bricked layouts already hold each section in one block, read it from start to end
+        auto pack_chunk_bricks = [&](int first, int last) {
+            uint32_t morton_rows[256];
+            uint32_t morton_x[16];
+            for (int i = 0; i < 256; i++)
+            {
+                morton_rows[i] = (spreadBits4(i / 16) << 1) | (spreadBits4(i % 16) << 2);
+            }
+            for (int i = 0; i < 16; i++)
+            {
+                morton_x[i] = spreadBits4(i);
+            }
+
+            int row[16];
+            for (int chunk_z = first; chunk_z < last; chunk_z++)
+            {
+                for (int chunk_x = 0; chunk_x < chunks_x; chunk_x++)
+                {
+                    uint64_t *chunk_data = data.data() + (first_chunk + chunk_z * 32 + chunk_x) * chunk_longs;
+                    const int *chunk_voxels = voxels + ((size_t)chunk_z * (size.x / 16) + chunk_x) * section_count * 4096;
+
+                    for (int section_y = 0; section_y < section_count; section_y++)
+                    {
+                        const int *brick = chunk_voxels + section_y * 4096;
+                        uint64_t *section_data = chunk_data + section_y * section_longs;
+
+                        for (int i = 0; i < 256; i++)
+                        {
+                            const int *brick_row = brick + i * 16;
+                            if (layout == LAYOUT_MORTON)
+                            {
+                                for (int local_x = 0; local_x < 16; local_x++)
+                                {
+                                    row[local_x] = brick[morton_rows[i] | morton_x[local_x]];
+                                }
+                                brick_row = row;
+                            }
+
+                            packRow(brick_row, i / 16, i % 16, bits, section_data);
+                        }
+                    }
+                }
+            }
+        };
+
+        auto pack_chunk_rows = [&](int first, int last) {
+            SATANIA_PROFILE_ZONE("pack rows");
+            if (layout != LAYOUT_LINEAR)
+            {
+                pack_chunk_bricks(first, last);
+                return;
+            }
+
+            for (int z = first * 16; z < last * 16; z++)
+            {
+                for (int y = 0; y < section_count * 16; y++)
+                {
+                    const int *row = voxels + (size_t)z * size.x * size.y + (size_t)y * size.x;
+                    uint64_t *section_data =
+                        data.data() + (first_chunk + (z / 16) * 32) * chunk_longs + (y / 16) * section_longs;
+
+                    for (int chunk_x = 0; chunk_x < chunks_x; chunk_x++)
+                    {
+                        packRow(row + chunk_x * 16, y % 16, z % 16, bits, section_data + chunk_x * chunk_longs);
+                    }
+                }
+            }
+        };
+
+        num_thread = std::clamp(num_thread, 1, std::max(chunks_z, 1));
+        if (num_thread == 1)
+        {
+            pack_chunk_rows(0, chunks_z);
+            return;
+        }
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < num_thread; t++)
+        {
+            threads.push_back(std::thread(pack_chunk_rows, chunks_z * t / num_thread, chunks_z * (t + 1) / num_thread));
+        }
+
+        // Wait for all the tread to be finished
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    /**
+     * @brief Pack a linear grid that is not aligned on sections into the packed data of its region, block
+     * by block. Slower than packTile but the grid can start and end anywhere in the region.
+     *
+     * @param size size of the grid, it must fit in the region from offset
+     * @param offset first voxel (x, z) of the grid in the region
+     * @param section_count sections per chunk of data, the voxels above them are dropped
+     * @param data packed region of mca::entries chunks of section_count sections, the blocks of the grid
+     * are overwritten
+     */
+    inline void packBlocks(const int *voxels, glm::ivec3 size, glm::ivec2 offset, int section_count, int bits,
+                           std::vector<uint64_t> &data, int num_thread = std::thread::hardware_concurrency())
+    {
+        const int section_longs = mca::longsPerSection(bits);
+        const size_t chunk_longs = (size_t)section_count * section_longs;
+        const int per_long = 64 / bits;
+        const int max_value = (1 << bits) - 1;
+        const int height = std::min(size.y, section_count * 16);
+
+        auto pack_chunk_rows = [&](int first, int last) {
+            SATANIA_PROFILE_ZONE("pack blocks");
+            for (int z = std::max(first * 16 - offset.y, 0); z < std::min(last * 16 - offset.y, size.z); z++)
+            {
+                const int region_z = offset.y + z;
+                for (int y = 0; y < height; y++)
+                {
+                    const int *row = voxels + (size_t)z * size.x * size.y + (size_t)y * size.x;
+                    for (int x = 0; x < size.x; x++)
+                    {
+                        const int region_x = offset.x + x;
+                        size_t chunk = (size_t)(region_z / 16) * 32 + region_x / 16;
+                        int block = ((y % 16) * 16 + region_z % 16) * 16 + region_x % 16;
+                        int shift = (block % per_long) * bits;
+
+                        uint64_t &entry = data[chunk * chunk_longs + (y / 16) * section_longs + block / per_long];
+                        entry = (entry & ~((uint64_t)max_value << shift)) |
+                                (uint64_t)std::clamp(row[x], 0, max_value) << shift;
+                    }
+                }
+            }
+        };
+
+        // Threads get whole rows of chunks so they never share a long
+        const int first_row = offset.y / 16;
+        const int row_count = (offset.y + size.z + 15) / 16 - first_row;
+        num_thread = std::clamp(num_thread, 1, std::max(row_count, 1));
+
+        std::vector<std::thread> threads;
+        for (int t = 1; t < num_thread; t++)
+        {
+            threads.push_back(std::thread(pack_chunk_rows, first_row + row_count * t / num_thread,
+                                          first_row + row_count * (t + 1) / num_thread));
+        }
+        pack_chunk_rows(first_row, first_row + row_count / num_thread);
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    /**
+     * @brief Pack the voxelizer output of a whole region, see packTile
+     *
+     * @param size size of the voxel grid, at most 512 x 512 horizontally
+     * @param data packed region, resized and overwritten
+     */
+    inline void packRegion(const int *voxels, glm::ivec3 size, int bits, std::vector<uint64_t> &data,
+                           int num_thread = std::thread::hardware_concurrency(), Layout layout = LAYOUT_LINEAR)
+    {
+        data.assign(mca::entries * (size_t)(size.y / 16) * mca::longsPerSection(bits), 0);
+        packTile(voxels, size, glm::ivec2(0), bits, data, num_thread, layout);
+    }
+} // namespace pack
@@ -0,0 +1,306 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "aabb.hpp"
+#include "mca.hpp"
+#include "scene.hpp"
+
+/**
+ * Splits the voxel grid of a scene into tiles, each one voxelized by a single dispatch.
+ *
+ * Tiles are whole columns of Minecraft sections and divide a region evenly, so every tile packs into
+ * one region and a region is written once its last tile is done. Tiles that no mesh touches are
+ * never dispatched.
+ */
+namespace planner
+{
+    constexpr int region_size = 512; // voxels per region on x and z
+    constexpr int section_size = 16;
+
+    struct Budget
+    {
+        size_t memory_bytes = (size_t)2 << 30;
+        size_t fixed_bytes = 0; // already taken by the BVH buffers and the scene
+        int num_thread = std::thread::hardware_concurrency();
+        glm::ivec2 max_tile_size = glm::ivec2(region_size); // on x and z
+        int max_voxel_buffers = 2;
+        int lod_levels = 0; // reduced levels written along the tiles, see lod.hpp
+        bool hollow = false; // interior voxels emptied, see hollow.hpp
+    };
+
+    struct Tile
+    {
+        glm::ivec3 voxel_offset;  // in the voxel grid of the scene
+        glm::ivec2 region;        // region file r.x.z
+        glm::ivec2 chunk_offset;  // first chunk of the tile in its region
+        bool first_in_region;
+        bool last_in_region;
+    };
+
+    struct Plan
+    {
+        glm::ivec3 tile_size;
+        glm::ivec3 grid_size; // voxels, rounded up to whole tiles
+        std::vector<Tile> tiles;
+        int voxel_buffers;    // tiles in flight, the GPU voxelizes one while the previous one is written
+        int num_thread;       // packing threads
+        size_t cache_bytes;   // left for mca::ChunkCache
+        size_t memory_bytes;  // estimated peak of the plan
+    };
+
+    /**
+     * @brief Memory a plan needs on top of the fixed budget: the persistent mapped voxel buffers, one
+     * packed region, the region file buffer and the scratch of the packing and encoding threads, plus the
+     * reduced tile and the packed region of every level of detail, and the bit grids of the hollow shell
+     * with a hollowed copy of every reduced tile
+     */
+    inline size_t planMemory(glm::ivec3 tile_size, int voxel_buffers, int num_thread, int bits, int lod_levels = 0,
+                             bool hollow = false)
+    {
+        constexpr size_t sector_size = 4096;
+        constexpr size_t thread_scratch = 256 * 1024; // chunk NBT and deflate buffers
+
+        size_t tile_bytes = (size_t)tile_size.x * tile_size.y * tile_size.z * sizeof(int);
+        size_t region_bytes =
+            mca::entries * (size_t)(tile_size.y / section_size) * mca::longsPerSection(bits) * sizeof(uint64_t);
+        size_t file_bytes = (mca::entries + 2) * sector_size;
+
+        size_t lod_bytes = 0;
+        for (int level = 1; level <= lod_levels; level++)
+        {
+            int sections = std::max(((tile_size.y >> level) + section_size - 1) / section_size, 1);
+            lod_bytes += (tile_bytes >> (3 * level)) * (hollow ? 2 : 1) +
+                         mca::entries * (size_t)sections * mca::longsPerSection(bits) * sizeof(uint64_t);
+        }
+
+        // Four grids of one bit per voxel
+        size_t hollow_bytes = hollow ? tile_bytes / 8 : 0;
+
+        return tile_bytes * voxel_buffers + region_bytes + file_bytes + thread_scratch * num_thread + lod_bytes +
+               hollow_bytes;
+    }
+
+    /**
+     * @brief Flag the first and the last tile of every region, tiles must be ordered region by region
+     */
+    inline void markRegions(std::vector<Tile> &tiles)
+    {
+        for (size_t i = 0; i < tiles.size(); i++)
+        {
+            tiles[i].first_in_region = i == 0 || tiles[i - 1].region != tiles[i].region;
+            tiles[i].last_in_region = i + 1 == tiles.size() || tiles[i + 1].region != tiles[i].region;
+        }
+    }
+
+    /**
+     * @brief Order the tiles by the Morton code of their region, tiles of a region keep their order. Every
+     * aligned block of 2^k x 2^k regions then comes in one piece, the region of level k of detail it
+     * reduces to is done once its last tile is.
+     */
+    inline void orderRegionsMorton(std::vector<Tile> &tiles)
+    {
+        auto morton = [](glm::ivec2 region) {
+            uint64_t code = 0;
+            for (int bit = 0; bit < 31; bit++)
+            {
+                code |= (uint64_t)((region.x >> bit) & 1) << (2 * bit);
+                code |= (uint64_t)((region.y >> bit) & 1) << (2 * bit + 1);
+            }
+            return code;
+        };
+
+        std::stable_sort(tiles.begin(), tiles.end(),
+                         [&](const Tile &a, const Tile &b) { return morton(a.region) < morton(b.region); });
+        markRegions(tiles);
+    }
+
+    /**
+     * @brief Whether a box of the scene may hold a triangle, walks both levels of the BVH down to the leaves
+     */
+    inline bool boxOccupied(const SceneBVH &bvh, const glm::vec3 &box_min, const glm::vec3 &box_max)
+    {
+        if (bvh.empty())
+        {
+            return false;
+        }
+
+        auto overlap = [&](const glm::vec3 &min, const glm::vec3 &max) {
+            return min.x <= box_max.x && box_min.x <= max.x && min.y <= box_max.y && box_min.y <= max.y &&
+                   min.z <= box_max.z && box_min.z <= max.z;
+        };
+
+        std::vector<int> top_stack = {0};
+        std::vector<int> stack;
+        while (!top_stack.empty())
+        {
+            const BVH::Node &top_node = bvh.m_top_nodes[top_stack.back()];
+            top_stack.pop_back();
+            if (!overlap(top_node.aabb.min, top_node.aabb.max))
+            {
+                continue;
+            }
+
+            for (int i = top_node.leaf; i < top_node.leaf + top_node.leaf_elem; i++)
+            {
+                const SceneBVH::GPUInstance &instance = bvh.m_instances[i];
+                if (!overlap(instance.bound_min, instance.bound_max))
+                {
+                    continue;
+                }
+
+                stack.assign(1, instance.node_offset);
+                while (!stack.empty())
+                {
+                    const BVH::Node &node = bvh.m_nodes[stack.back()];
+                    stack.pop_back();
+
+                    AABB bounds = scene::transformAABB(node.aabb, instance.transform);
+                    if (!overlap(bounds.min, bounds.max))
+                    {
+                        continue;
+                    }
+                    if (node.leaf_elem > 0)
+                    {
+                        return true;
+                    }
+
+                    stack.push_back(instance.node_offset + node.node_left);
+                    stack.push_back(instance.node_offset + node.node_right);
+                }
+            }
+
+            if (top_node.leaf_elem == 0)
+            {
+                top_stack.push_back(top_node.node_left);
+                top_stack.push_back(top_node.node_right);
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * @brief Pick the tiles of a scene for a memory budget
+     *
+     * Every tile size dividing a region that fits the budget is tried, largest first. The one that
+     * voxelizes the fewest voxels wins, a dispatch counting as dispatch_cost voxels so small tiles only
+     * win when they skip enough empty space. Two voxel buffers are used when they fit so writing a
+     * region overlaps the voxelization of the next tile.
+     *
+     * @param voxel_extent size of the scene in voxels, the height is already clamped to the build height
+     * @param origin world position of voxel (0, 0, 0)
+     */
+    inline Plan planTiles(const SceneBVH &bvh, glm::ivec3 voxel_extent, const glm::vec3 &origin, float resolution,
+                          int bits, const Budget &budget)
+    {
+        constexpr double dispatch_cost = 1 << 20;
+
+        const int height = std::max(section_size, (voxel_extent.y + section_size - 1) / section_size * section_size);
+        const size_t available =
+            budget.memory_bytes > budget.fixed_bytes ? budget.memory_bytes - budget.fixed_bytes : 0;
+        const int num_thread = std::max(budget.num_thread, 1);
+
+        // The tiles of a plan that voxel_extent fits in, empty tiles left out
+        auto make_tiles = [&](glm::ivec3 tile_size, glm::ivec3 &grid_size) {
+            const glm::ivec2 extent(voxel_extent.x, voxel_extent.z);
+            const glm::ivec2 size(tile_size.x, tile_size.z);
+            glm::ivec2 regions = (extent + region_size - 1) / region_size;
+            glm::ivec2 tiles_per_region = glm::ivec2(region_size) / size;
+            glm::ivec2 tile_count = (extent + size - 1) / size;
+            grid_size = glm::ivec3(tile_count.x * size.x, height, tile_count.y * size.y);
+
+            std::vector<Tile> tiles;
+            for (int region_z = 0; region_z < regions.y; region_z++)
+            {
+                for (int region_x = 0; region_x < regions.x; region_x++)
+                {
+                    for (int z = 0; z < tiles_per_region.y; z++)
+                    {
+                        for (int x = 0; x < tiles_per_region.x; x++)
+                        {
+                            glm::ivec2 tile = glm::ivec2(region_x, region_z) * tiles_per_region + glm::ivec2(x, z);
+                            if (tile.x >= tile_count.x || tile.y >= tile_count.y)
+                            {
+                                continue;
+                            }
+
+                            Tile t{};
+                            t.voxel_offset = glm::ivec3(tile.x * tile_size.x, 0, tile.y * tile_size.z);
+                            t.region = glm::ivec2(region_x, region_z);
+                            t.chunk_offset = glm::ivec2(x * tile_size.x, z * tile_size.z) / section_size;
+
+                            // Tiles reach half a voxel out of their grid cells, like the voxels of the shader
+                            glm::vec3 box_min = origin + (glm::vec3(t.voxel_offset) - 0.5f) * resolution;
+                            glm::vec3 box_max = origin + (glm::vec3(t.voxel_offset + tile_size) - 0.5f) * resolution;
+                            if (boxOccupied(bvh, box_min, box_max))
+                            {
+                                tiles.push_back(t);
+                            }
+                        }
+                    }
+                }
+            }
+            if (budget.lod_levels > 0)
+            {
+                orderRegionsMorton(tiles);
+            }
+            else
+            {
+                markRegions(tiles);
+            }
+            return tiles;
+        };
+
+        Plan best{};
+        double best_cost = 0.0;
+        for (int size = region_size; size >= section_size; size /= 2)
+        {
+            if (size > section_size && (size > budget.max_tile_size.x || size > budget.max_tile_size.y))
+            {
+                continue;
+            }
+            glm::ivec3 tile_size(size, height, size);
+
+            int voxel_buffers = std::max(budget.max_voxel_buffers, 1);
+            while (voxel_buffers > 1 &&
+                   planMemory(tile_size, voxel_buffers, num_thread, bits, budget.lod_levels, budget.hollow) >
+                       available)
+            {
+                voxel_buffers--;
+            }
+            size_t memory = planMemory(tile_size, voxel_buffers, num_thread, bits, budget.lod_levels, budget.hollow);
+
+            // The smallest tile is kept even over budget, there is nothing smaller to fall back on
+            if (memory > available && size > section_size)
+            {
+                continue;
+            }
+
+            Plan plan{};
+            plan.tile_size = tile_size;
+            plan.tiles = make_tiles(tile_size, plan.grid_size);
+            plan.voxel_buffers = voxel_buffers;
+            plan.num_thread = num_thread;
+            plan.memory_bytes = memory;
+            plan.cache_bytes = std::clamp<size_t>(available > memory ? available - memory : 0, 16 << 20, 256 << 20);
+
+            // A second buffer hides the writing of a region behind the voxelization
+            double cost = (double)plan.tiles.size() * ((double)tile_size.x * tile_size.y * tile_size.z + dispatch_cost);
+            cost /= voxel_buffers > 1 ? 1.5 : 1.0;
+
+            if (best.tile_size.x == 0 || cost < best_cost)
+            {
+                best = std::move(plan);
+                best_cost = cost;
+            }
+        }
+
+        return best;
+    }
+} // namespace planner
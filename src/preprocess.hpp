@@ -0,0 +1,406 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "mesh.hpp"
+
+namespace preprocess
+{
+    struct Options
+    {
+        // Vertices closer than this on every axis are merged, 0 only merges identical positions
+        float weld_distance = 0.0f;
+        // Sort the triangles along a morton curve so BVH leaves and memory accesses stay local
+        bool reorder = true;
+        int num_thread = std::thread::hardware_concurrency();
+    };
+
+    struct Stats
+    {
+        size_t input_vertices = 0;
+        size_t input_triangles = 0;
+        size_t welded_vertices = 0;
+        size_t unused_vertices = 0;
+        size_t degenerate_triangles = 0;
+        size_t duplicate_triangles = 0;
+        size_t output_vertices = 0;
+        size_t output_triangles = 0;
+    };
+
+    // Run function(first, last) over [0, count) split between num_thread threads of at least grain items
+    template <typename Function>
+    void parallelFor(size_t count, int num_thread, Function &&function, size_t grain = 4096)
+    {
+        num_thread = (int)std::clamp<size_t>(count / grain, 1, std::max(num_thread, 1));
+        if (num_thread == 1)
+        {
+            function((size_t)0, count);
+            return;
+        }
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < num_thread; t++)
+        {
+            threads.push_back(std::thread(function, count * t / num_thread, count * (t + 1) / num_thread));
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    inline uint64_t hash64(uint64_t v)
+    {
+        v ^= v >> 33;
+        v *= 0xFF51AFD7ED558CCDull;
+        v ^= v >> 33;
+        v *= 0xC4CEB9FE1A85EC53ull;
+        v ^= v >> 33;
+        return v;
+    }
+
+    inline uint32_t floatKey(float v)
+    {
+        // -0 and +0 must weld together
+        return v == 0.0f ? 0u : std::bit_cast<uint32_t>(v);
+    }
+
+    // Hash of the options that change the output mesh, never 0 so it differs from unprocessed meshes
+    inline uint64_t optionsHash(const Options &options)
+    {
+        return hash64((((uint64_t)floatKey(options.weld_distance) << 1) | options.reorder) + 1);
+    }
+
+    inline uint32_t spreadBits10(uint32_t v)
+    {
+        v &= 0x3FFu;
+        v = (v | (v << 16)) & 0x030000FFu;
+        v = (v | (v << 8)) & 0x0300F00Fu;
+        v = (v | (v << 4)) & 0x030C30C3u;
+        v = (v | (v << 2)) & 0x09249249u;
+        return v;
+    }
+
+    struct CellKey
+    {
+        uint32_t x, y, z;
+
+        bool operator==(const CellKey &other) const
+        {
+            return x == other.x && y == other.y && z == other.z;
+        }
+    };
+
+    /**
+     * @brief Find, for every item, the first item equal to it
+     *
+     * Items are spread over the threads by hash, so every thread owns an open addressing table over
+     * its share and no lock is needed. Ignored items are left untouched in first.
+     *
+     * @param hashes hash of every item
+     * @param ignored items to skip, can be null
+     * @param equal equal(a, b) compares two items with the same hash
+     * @param first index of the first equal item, its own index for the first occurrence
+     */
+    template <typename Equal>
+    void findFirstEqual(const std::vector<uint64_t> &hashes, const uint8_t *ignored, int num_thread, Equal &&equal,
+                        std::vector<unsigned int> &first)
+    {
+        const size_t count = hashes.size();
+        const unsigned int empty = ~0u;
+        const size_t buckets = std::max(num_thread, 1);
+        first.resize(count);
+
+        auto bucketOf = [&](size_t i) { return (hashes[i] >> 32) % buckets; };
+        auto rangeBegin = [&](size_t range) { return count * range / buckets; };
+
+        // Sort the items by bucket once, every thread counting then scattering its own range of items.
+        // Inside a bucket the items stay in index order, so the first occurrence is still the lowest index.
+        // offsets[range * buckets + bucket] is where the range writes its items of that bucket
+        std::vector<size_t> offsets(buckets * buckets, 0);
+        parallelFor(buckets, buckets, [&](size_t first_range, size_t last_range) {
+            for (size_t range = first_range; range < last_range; range++)
+            {
+                for (size_t i = rangeBegin(range); i < rangeBegin(range + 1); i++)
+                {
+                    if (!ignored || !ignored[i])
+                    {
+                        offsets[range * buckets + bucketOf(i)]++;
+                    }
+                }
+            }
+        }, 1);
+
+        std::vector<size_t> bucket_begin(buckets + 1, 0);
+        size_t offset = 0;
+        for (size_t bucket = 0; bucket < buckets; bucket++)
+        {
+            bucket_begin[bucket] = offset;
+            for (size_t range = 0; range < buckets; range++)
+            {
+                size_t range_count = offsets[range * buckets + bucket];
+                offsets[range * buckets + bucket] = offset;
+                offset += range_count;
+            }
+        }
+        bucket_begin[buckets] = offset;
+
+        std::vector<unsigned int> order(offset);
+        parallelFor(buckets, buckets, [&](size_t first_range, size_t last_range) {
+            for (size_t range = first_range; range < last_range; range++)
+            {
+                for (size_t i = rangeBegin(range); i < rangeBegin(range + 1); i++)
+                {
+                    if (!ignored || !ignored[i])
+                    {
+                        order[offsets[range * buckets + bucketOf(i)]++] = (unsigned int)i;
+                    }
+                }
+            }
+        }, 1);
+
+        parallelFor(buckets, buckets, [&](size_t first_bucket, size_t last_bucket) {
+            for (size_t bucket = first_bucket; bucket < last_bucket; bucket++)
+            {
+                const size_t bucket_count = bucket_begin[bucket + 1] - bucket_begin[bucket];
+                const size_t mask = std::bit_ceil(bucket_count * 2 + 1) - 1;
+                std::vector<unsigned int> table(mask + 1, empty);
+                for (size_t k = bucket_begin[bucket]; k < bucket_begin[bucket + 1]; k++)
+                {
+                    const unsigned int i = order[k];
+                    for (size_t slot = hashes[i] & mask;; slot = (slot + 1) & mask)
+                    {
+                        unsigned int other = table[slot];
+                        if (other == empty)
+                        {
+                            table[slot] = i;
+                            first[i] = i;
+                            break;
+                        }
+                        if (hashes[other] == hashes[i] && equal(other, i))
+                        {
+                            first[i] = other;
+                            break;
+                        }
+                    }
+                }
+            }
+        }, 1);
+    }
+
+    /**
+     * @brief Give every vertex the index of the first vertex of its weld cell with the same color, uv and
+     * texture, so welding never moves a texture seam
+     */
+    inline void weldVertices(const Mesh &mesh, float weld_distance, int num_thread, std::vector<unsigned int> &remap)
+    {
+        const size_t vertex_count = mesh.vertices.size();
+        std::vector<CellKey> keys(vertex_count);
+        std::vector<uint64_t> hashes(vertex_count);
+
+        parallelFor(vertex_count, num_thread, [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; i++)
+            {
+                glm::vec3 p = mesh.vertices[i].position;
+                if (weld_distance > 0.0f)
+                {
+                    glm::vec3 cell = glm::floor(p / weld_distance + 0.5f);
+                    keys[i] = CellKey{(uint32_t)(int32_t)cell.x, (uint32_t)(int32_t)cell.y, (uint32_t)(int32_t)cell.z};
+                }
+                else
+                {
+                    keys[i] = CellKey{floatKey(p.x), floatKey(p.y), floatKey(p.z)};
+                }
+                hashes[i] = hash64(((uint64_t)keys[i].x << 32 | keys[i].y) ^ hash64(keys[i].z));
+            }
+        });
+
+        findFirstEqual(
+            hashes, nullptr, num_thread,
+            [&](size_t a, size_t b) {
+                const Vertex &vertex_a = mesh.vertices[a];
+                const Vertex &vertex_b = mesh.vertices[b];
+                return keys[a] == keys[b] && vertex_a.color == vertex_b.color && vertex_a.uv == vertex_b.uv &&
+                       vertex_a.texture == vertex_b.texture;
+            },
+            remap);
+    }
+
+    inline bool degenerate(const Mesh &mesh, const unsigned int *triangle)
+    {
+        if (triangle[0] == triangle[1] || triangle[1] == triangle[2] || triangle[0] == triangle[2])
+        {
+            return true;
+        }
+
+        glm::dvec3 v0 = glm::dvec3(mesh.vertices[triangle[0]].position);
+        glm::dvec3 v1 = glm::dvec3(mesh.vertices[triangle[1]].position);
+        glm::dvec3 v2 = glm::dvec3(mesh.vertices[triangle[2]].position);
+        glm::dvec3 normal = glm::cross(v1 - v0, v2 - v0);
+
+        return glm::dot(normal, normal) == 0.0;
+    }
+
+    /**
+     * @brief Clean a mesh before building its BVH
+     *
+     * 1. weld the vertices sharing a position (or a weld cell) and their attributes
+     * 2. drop the triangles with a repeated vertex or no area, they cannot add a voxel
+     * 3. drop the triangles using the same three vertices as an earlier one, whatever the winding
+     * 4. optionally sort the triangles by the morton code of their centroid
+     * 5. remove the vertices no triangle uses anymore
+     */
+    inline Stats preprocessMesh(Mesh &mesh, const Options &options = Options{})
+    {
+        Stats stats;
+        stats.input_vertices = mesh.vertices.size();
+        stats.input_triangles = mesh.elements.size() / 3;
+
+        const int num_thread = std::max(options.num_thread, 1);
+        const size_t triangle_count = mesh.elements.size() / 3;
+
+        std::vector<unsigned int> remap;
+        weldVertices(mesh, options.weld_distance, num_thread, remap);
+
+        // 0 keep, 1 degenerate, 2 duplicate
+        std::vector<uint8_t> removed(triangle_count, 0);
+        std::vector<std::array<unsigned int, 3>> sorted_triangles(triangle_count);
+        std::vector<uint64_t> triangle_hashes(triangle_count);
+
+        parallelFor(triangle_count, num_thread, [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; i++)
+            {
+                unsigned int *triangle = &mesh.elements[i * 3];
+                for (int j = 0; j < 3; j++)
+                {
+                    triangle[j] = remap[triangle[j]];
+                }
+
+                if (degenerate(mesh, triangle))
+                {
+                    removed[i] = 1;
+                    continue;
+                }
+
+                auto &sorted = sorted_triangles[i];
+                sorted = {triangle[0], triangle[1], triangle[2]};
+                std::sort(sorted.begin(), sorted.end());
+                triangle_hashes[i] = hash64(hash64(((uint64_t)sorted[0] << 32) | sorted[1]) ^ sorted[2]);
+            }
+        });
+
+        std::vector<unsigned int> first_triangle;
+        findFirstEqual(
+            triangle_hashes, removed.data(), num_thread,
+            [&](size_t a, size_t b) { return sorted_triangles[a] == sorted_triangles[b]; }, first_triangle);
+
+        for (size_t i = 0; i < triangle_count; i++)
+        {
+            if (!removed[i] && first_triangle[i] != i)
+            {
+                removed[i] = 2;
+            }
+        }
+
+        std::vector<unsigned int> kept;
+        kept.reserve(triangle_count);
+        for (size_t i = 0; i < triangle_count; i++)
+        {
+            if (removed[i] == 1)
+            {
+                stats.degenerate_triangles++;
+            }
+            else if (removed[i] == 2)
+            {
+                stats.duplicate_triangles++;
+            }
+            else
+            {
+                kept.push_back((unsigned int)i);
+            }
+        }
+
+        if (options.reorder && !kept.empty())
+        {
+            glm::vec3 bound_min = mesh.vertices[mesh.elements[kept[0] * 3]].position;
+            glm::vec3 bound_max = bound_min;
+            for (unsigned int i : kept)
+            {
+                for (int j = 0; j < 3; j++)
+                {
+                    bound_min = glm::min(bound_min, mesh.vertices[mesh.elements[i * 3 + j]].position);
+                    bound_max = glm::max(bound_max, mesh.vertices[mesh.elements[i * 3 + j]].position);
+                }
+            }
+            glm::vec3 scale = 1023.0f / glm::max(bound_max - bound_min, glm::vec3(1e-20f));
+
+            std::vector<uint64_t> codes(kept.size());
+            parallelFor(kept.size(), num_thread, [&](size_t first, size_t last) {
+                for (size_t k = first; k < last; k++)
+                {
+                    const unsigned int *triangle = &mesh.elements[kept[k] * 3];
+                    glm::vec3 centroid = (mesh.vertices[triangle[0]].position + mesh.vertices[triangle[1]].position +
+                                          mesh.vertices[triangle[2]].position) /
+                                         3.0f;
+                    glm::vec3 cell = glm::clamp((centroid - bound_min) * scale, 0.0f, 1023.0f);
+                    uint32_t code = spreadBits10((uint32_t)cell.x) | (spreadBits10((uint32_t)cell.y) << 1) |
+                                    (spreadBits10((uint32_t)cell.z) << 2);
+                    // Keep the original order between triangles of a same cell
+                    codes[k] = ((uint64_t)code << 32) | kept[k];
+                }
+            });
+
+            std::sort(codes.begin(), codes.end());
+            for (size_t k = 0; k < kept.size(); k++)
+            {
+                kept[k] = (unsigned int)codes[k];
+            }
+        }
+
+        // Vertices are renumbered in order of first use, which follows the triangle order
+        const unsigned int unused = ~0u;
+        std::vector<unsigned int> new_index(mesh.vertices.size(), unused);
+        std::vector<Vertex> vertices;
+        std::vector<unsigned int> elements(kept.size() * 3);
+        vertices.reserve(mesh.vertices.size());
+
+        for (size_t k = 0; k < kept.size(); k++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                unsigned int vertex = mesh.elements[kept[k] * 3 + j];
+                if (new_index[vertex] == unused)
+                {
+                    new_index[vertex] = (unsigned int)vertices.size();
+                    vertices.push_back(mesh.vertices[vertex]);
+                }
+                elements[k * 3 + j] = new_index[vertex];
+            }
+        }
+
+        size_t representatives = 0;
+        for (size_t i = 0; i < remap.size(); i++)
+        {
+            representatives += remap[i] == i;
+        }
+
+        stats.welded_vertices = stats.input_vertices - representatives;
+        stats.unused_vertices = representatives - vertices.size();
+        stats.output_vertices = vertices.size();
+        stats.output_triangles = kept.size();
+
+        mesh.vertices = std::move(vertices);
+        mesh.elements = std::move(elements);
+        return stats;
+    }
+} // namespace preprocess
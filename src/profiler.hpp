@@ -0,0 +1,246 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifndef SATANIA_PROFILING
+#define SATANIA_PROFILING 1
+#endif
+
+namespace profiler
+{
+    struct Event
+    {
+        const char *name;
+        std::string label; // optional detail, exported as an argument of the event
+        int64_t start;     // nanoseconds since the start of the profiler
+        int64_t duration;
+    };
+
+    /**
+     * @brief Events of one track of the trace, only written by the thread that owns it
+     */
+    struct Track
+    {
+        uint32_t id;
+        std::string name;
+        std::vector<Event> events;
+    };
+
+    class Profiler
+    {
+    public:
+        static Profiler &get()
+        {
+            static Profiler profiler;
+            return profiler;
+        }
+
+        int64_t now() const
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_epoch)
+                .count();
+        }
+
+        /**
+         * @brief Track of the calling thread. Tracks of finished threads are handed to the next new
+         * thread, so short lived workers do not add a row to the trace each.
+         */
+        Track &threadTrack()
+        {
+            struct Owner
+            {
+                Track *track = nullptr;
+
+                ~Owner()
+                {
+                    if (track != nullptr)
+                    {
+                        Profiler::get().releaseTrack(track);
+                    }
+                }
+            };
+
+            thread_local Owner owner;
+            if (owner.track == nullptr)
+            {
+                owner.track = acquireTrack();
+            }
+            return *owner.track;
+        }
+
+        void setThreadName(const std::string &name)
+        {
+            threadTrack().name = name;
+        }
+
+        /**
+         * @brief Track not bound to a thread, for events measured elsewhere (GPU queries)
+         */
+        Track &addTrack(const std::string &name)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tracks.push_back(std::make_unique<Track>(Track{(uint32_t)m_tracks.size() + 1, name, {}}));
+            return *m_tracks.back();
+        }
+
+        /**
+         * @brief Export every event as Chrome trace JSON (chrome://tracing, ui.perfetto.dev)
+         *
+         * Must be called while no other thread records events.
+         */
+        bool writeChromeTrace(const std::string &filename)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            FILE *file = fopen(filename.c_str(), "wb");
+            if (file == nullptr)
+            {
+                fprintf(stderr, "Cannot write the trace \"%s\"\n", filename.c_str());
+                return false;
+            }
+
+            fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+            bool first = true;
+            for (const auto &track : m_tracks)
+            {
+                fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                        first ? "" : ",\n", track->id, escape(track->name).c_str());
+                first = false;
+
+                for (const auto &event : track->events)
+                {
+                    fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                            escape(event.name).c_str(), track->id, event.start / 1000.0, event.duration / 1000.0);
+                    if (!event.label.empty())
+                    {
+                        fprintf(file, ",\"args\":{\"detail\":\"%s\"}", escape(event.label).c_str());
+                    }
+                    fprintf(file, "}");
+                }
+            }
+            fprintf(file, "\n]}\n");
+
+            bool success = ferror(file) == 0;
+            fclose(file);
+            return success;
+        }
+
+    private:
+        Profiler() : m_epoch{std::chrono::steady_clock::now()}
+        {
+        }
+
+        Track *acquireTrack()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_free_tracks.empty())
+            {
+                Track *track = m_free_tracks.back();
+                m_free_tracks.pop_back();
+                return track;
+            }
+
+            uint32_t id = (uint32_t)m_tracks.size() + 1;
+            m_tracks.push_back(std::make_unique<Track>(Track{id, "thread " + std::to_string(id), {}}));
+            return m_tracks.back().get();
+        }
+
+        void releaseTrack(Track *track)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_free_tracks.push_back(track);
+        }
+
+        static std::string escape(const std::string &text)
+        {
+            std::string escaped;
+            escaped.reserve(text.size());
+            for (char c : text)
+            {
+                if (c == '"' || c == '\\')
+                {
+                    escaped += '\\';
+                    escaped += c;
+                }
+                else if ((unsigned char)c < 0x20)
+                {
+                    escaped += ' ';
+                }
+                else
+                {
+                    escaped += c;
+                }
+            }
+            return escaped;
+        }
+
+        std::chrono::steady_clock::time_point m_epoch;
+        std::mutex m_mutex;
+        std::vector<std::unique_ptr<Track>> m_tracks;
+        std::vector<Track *> m_free_tracks;
+    };
+
+    /**
+     * @brief Records an event covering its lifetime, or until end(), on the track of the calling thread
+     */
+    class Zone
+    {
+    public:
+        explicit Zone(const char *name) : m_name{name}, m_start{Profiler::get().now()}
+        {
+        }
+
+        Zone(const char *name, std::string label) : m_name{name}, m_label{std::move(label)}, m_start{Profiler::get().now()}
+        {
+        }
+
+        Zone(const Zone &) = delete;
+        Zone &operator=(const Zone &) = delete;
+
+        ~Zone()
+        {
+            end();
+        }
+
+        // Close the zone before the end of its scope
+        void end()
+        {
+            if (m_name == nullptr)
+            {
+                return;
+            }
+
+            Profiler &profiler = Profiler::get();
+            int64_t end = profiler.now();
+            profiler.threadTrack().events.push_back(Event{m_name, std::move(m_label), m_start, end - m_start});
+            m_name = nullptr;
+        }
+
+    private:
+        const char *m_name;
+        std::string m_label;
+        int64_t m_start;
+    };
+} // namespace profiler
+
+#if SATANIA_PROFILING
+#define SATANIA_PROFILE_CONCAT_(a, b) a##b
+#define SATANIA_PROFILE_CONCAT(a, b) SATANIA_PROFILE_CONCAT_(a, b)
+// SATANIA_PROFILE_ZONE(name) or SATANIA_PROFILE_ZONE(name, label), name must outlive the profiler
+#define SATANIA_PROFILE_ZONE(...) profiler::Zone SATANIA_PROFILE_CONCAT(profile_zone_, __LINE__)(__VA_ARGS__)
+#define SATANIA_PROFILE_THREAD(name) profiler::Profiler::get().setThreadName(name)
+// Zone ending before its scope does: SATANIA_PROFILE_BEGIN(zone, name[, label]) ... SATANIA_PROFILE_END(zone)
+#define SATANIA_PROFILE_BEGIN(zone, ...) profiler::Zone zone(__VA_ARGS__)
+#define SATANIA_PROFILE_END(zone) zone.end()
+#else
+#define SATANIA_PROFILE_ZONE(...) (void)0
+#define SATANIA_PROFILE_THREAD(name) (void)0
+#define SATANIA_PROFILE_BEGIN(zone, ...) (void)0
+#define SATANIA_PROFILE_END(zone) (void)0
+#endif
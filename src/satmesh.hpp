@@ -0,0 +1,424 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "mapped_file.hpp"
+#include "material.hpp"
+#include "mesh.hpp"
+#include "scene.hpp"
+
+/**
+ * .satmesh binary scene format, little endian, every array aligned to 64 bytes:
+ *
+ *   Header
+ *   MeshEntry[mesh_count]        at meshes_offset
+ *   InstanceEntry[instance_count] at instances_offset
+ *   TextureEntry[texture_count]  at textures_offset
+ *   per mesh:
+ *     float[3 * vertex_count]    positions
+ *     float[4 * vertex_count]    colors (optional)
+ *     float[2 * vertex_count]    uvs (optional)
+ *     uint32[3 * triangle_count] elements
+ *   per texture:
+ *     uint32[]                   RGBA8 texels in tiles, see material::Texture
+ *
+ * The size and modification time of the source file and a hash of the options the meshes were preprocessed
+ * with are stored, so a stale cache can be detected.
+ */
+namespace satmesh
+{
+    constexpr char magic[8] = {'S', 'A', 'T', 'M', 'E', 'S', 'H', '\0'};
+    constexpr uint32_t version = 3;
+    constexpr uint64_t alignment = 64;
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t mesh_count;
+        uint32_t instance_count;
+        uint32_t texture_count;
+        uint64_t source_size;
+        int64_t source_time;
+        uint64_t source_options;
+        uint64_t meshes_offset;
+        uint64_t instances_offset;
+        uint64_t textures_offset;
+        uint64_t file_size;
+    };
+
+    struct MeshEntry
+    {
+        uint64_t vertex_count;
+        uint64_t triangle_count;
+        uint64_t positions_offset;
+        uint64_t colors_offset; // 0 if the mesh has no colors
+        uint64_t uvs_offset;    // 0 if the mesh has no uvs
+        uint64_t elements_offset;
+        uint32_t texture; // 1 + index of the texture, 0 without
+        uint32_t reserved;
+    };
+
+    struct InstanceEntry
+    {
+        float transform[16];
+        uint32_t mesh;
+        uint32_t reserved[3];
+    };
+
+    struct TextureEntry
+    {
+        uint32_t width;
+        uint32_t height;
+        uint64_t texels_offset;
+    };
+
+    struct SourceInfo
+    {
+        uint64_t size = 0;
+        int64_t time = 0;
+        uint64_t options = 0; // hash of the preprocessing options, 0 when the meshes are not preprocessed
+    };
+
+    inline SourceInfo sourceInfo(const std::string &filename, uint64_t options = 0)
+    {
+        std::error_code error;
+        SourceInfo info;
+        info.size = std::filesystem::file_size(filename, error);
+        info.time = std::filesystem::last_write_time(filename, error).time_since_epoch().count();
+        info.options = options;
+        return info;
+    }
+
+    // Where the cache of a source mesh is written
+    inline std::string cachePath(const std::string &filename)
+    {
+        return filename + ".satmesh";
+    }
+
+    // Where the cache goes when the directory of the source cannot be written
+    inline std::string fallbackCachePath(const std::string &filename, const std::string &directory)
+    {
+        return (std::filesystem::path(directory) / std::filesystem::path(cachePath(filename)).filename()).string();
+    }
+
+    inline uint64_t alignOffset(uint64_t offset)
+    {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    /**
+     * @brief Write a scene as a .satmesh file
+     *
+     * The file is written next to its destination and renamed, so a reader never maps a partial file.
+     * Colors and uvs are only stored when a vertex has a non default value, the texture of a mesh is the
+     * one of its first vertex.
+     */
+    inline bool writeScene(const std::string &filename, const Scene &scene, const SourceInfo &source)
+    {
+        Header header{};
+        memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.mesh_count = (uint32_t)scene.meshes.size();
+        header.instance_count = (uint32_t)scene.instances.size();
+        header.texture_count = (uint32_t)scene.textures.size();
+        header.source_size = source.size;
+        header.source_time = source.time;
+        header.source_options = source.options;
+        header.meshes_offset = alignOffset(sizeof(Header));
+        header.instances_offset = alignOffset(header.meshes_offset + header.mesh_count * sizeof(MeshEntry));
+
+        header.textures_offset = alignOffset(header.instances_offset + header.instance_count * sizeof(InstanceEntry));
+
+        uint64_t offset = alignOffset(header.textures_offset + header.texture_count * sizeof(TextureEntry));
+        std::vector<MeshEntry> entries(scene.meshes.size());
+        for (size_t m = 0; m < scene.meshes.size(); m++)
+        {
+            const Mesh &mesh = scene.meshes[m];
+            MeshEntry &entry = entries[m];
+
+            bool has_colors = false;
+            bool has_uvs = false;
+            for (const auto &vertex : mesh.vertices)
+            {
+                has_colors |= vertex.color != glm::vec4(1.0f);
+                has_uvs |= vertex.uv != glm::vec2(0.0f);
+            }
+
+            entry.vertex_count = mesh.vertices.size();
+            entry.triangle_count = mesh.elements.size() / 3;
+            entry.positions_offset = offset;
+            offset = alignOffset(offset + entry.vertex_count * sizeof(glm::vec3));
+            if (has_colors)
+            {
+                entry.colors_offset = offset;
+                offset = alignOffset(offset + entry.vertex_count * sizeof(glm::vec4));
+            }
+            if (has_uvs)
+            {
+                entry.uvs_offset = offset;
+                offset = alignOffset(offset + entry.vertex_count * sizeof(glm::vec2));
+            }
+            entry.elements_offset = offset;
+            offset = alignOffset(offset + entry.triangle_count * 3 * sizeof(uint32_t));
+            entry.texture = mesh.vertices.empty() ? 0 : (uint32_t)mesh.vertices[0].texture;
+        }
+
+        std::vector<TextureEntry> textures(scene.textures.size());
+        for (size_t t = 0; t < scene.textures.size(); t++)
+        {
+            textures[t].width = (uint32_t)scene.textures[t].width();
+            textures[t].height = (uint32_t)scene.textures[t].height();
+            textures[t].texels_offset = offset;
+            offset = alignOffset(offset + scene.textures[t].texels().size() * sizeof(uint32_t));
+        }
+        header.file_size = offset;
+
+        std::string temp_filename = filename + ".tmp";
+        FILE *file = fopen(temp_filename.c_str(), "wb");
+        if (file == nullptr)
+        {
+            fprintf(stderr, "Cannot write \"%s\"\n", temp_filename.c_str());
+            return false;
+        }
+
+        uint64_t position = 0;
+        auto write = [&](uint64_t at, const void *data, size_t size) {
+            static const uint8_t padding[alignment] = {};
+            while (position < at)
+            {
+                size_t pad = (size_t)std::min<uint64_t>(at - position, alignment);
+                fwrite(padding, 1, pad, file);
+                position += pad;
+            }
+            if (size > 0)
+            {
+                fwrite(data, 1, size, file);
+                position += size;
+            }
+        };
+
+        write(0, &header, sizeof(header));
+        write(header.meshes_offset, entries.data(), entries.size() * sizeof(MeshEntry));
+
+        std::vector<InstanceEntry> instances(scene.instances.size());
+        for (size_t i = 0; i < scene.instances.size(); i++)
+        {
+            instances[i] = InstanceEntry{};
+            memcpy(instances[i].transform, &scene.instances[i].transform[0][0], sizeof(instances[i].transform));
+            instances[i].mesh = (uint32_t)scene.instances[i].mesh;
+        }
+        write(header.instances_offset, instances.data(), instances.size() * sizeof(InstanceEntry));
+        write(header.textures_offset, textures.data(), textures.size() * sizeof(TextureEntry));
+
+        std::vector<uint8_t> buffer;
+        for (size_t m = 0; m < scene.meshes.size(); m++)
+        {
+            const Mesh &mesh = scene.meshes[m];
+            const MeshEntry &entry = entries[m];
+
+            // Gather one attribute of the interleaved vertices at a time
+            auto write_attribute = [&](uint64_t at, size_t attribute_offset, size_t attribute_size) {
+                buffer.resize(mesh.vertices.size() * attribute_size);
+                for (size_t v = 0; v < mesh.vertices.size(); v++)
+                {
+                    memcpy(buffer.data() + v * attribute_size, (const uint8_t *)&mesh.vertices[v] + attribute_offset,
+                           attribute_size);
+                }
+                write(at, buffer.data(), buffer.size());
+            };
+
+            write_attribute(entry.positions_offset, offsetof(Vertex, position), sizeof(glm::vec3));
+            if (entry.colors_offset)
+            {
+                write_attribute(entry.colors_offset, offsetof(Vertex, color), sizeof(glm::vec4));
+            }
+            if (entry.uvs_offset)
+            {
+                write_attribute(entry.uvs_offset, offsetof(Vertex, uv), sizeof(glm::vec2));
+            }
+            write(entry.elements_offset, mesh.elements.data(), mesh.elements.size() * sizeof(uint32_t));
+        }
+        for (size_t t = 0; t < scene.textures.size(); t++)
+        {
+            const std::vector<uint32_t> &texels = scene.textures[t].texels();
+            write(textures[t].texels_offset, texels.data(), texels.size() * sizeof(uint32_t));
+        }
+        write(header.file_size, nullptr, 0);
+
+        bool success = ferror(file) == 0;
+        fclose(file);
+
+        std::error_code error;
+        if (success)
+        {
+            std::filesystem::rename(temp_filename, filename, error);
+        }
+        if (!success || error)
+        {
+            fprintf(stderr, "Cannot write \"%s\"\n", filename.c_str());
+            std::filesystem::remove(temp_filename, error);
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Memory mapped .satmesh file, the mesh views point straight into the mapping
+     */
+    class SceneFile
+    {
+    public:
+        /**
+         * @param source if not null, the file is rejected when it was written from another version of the source
+         * @return false if the file is missing, invalid or stale
+         */
+        bool open(const std::string &filename, const SourceInfo *source = nullptr)
+        {
+            m_meshes.clear();
+            m_instances.clear();
+            m_textures.clear();
+
+            if (!m_file.open(filename) || m_file.size() < sizeof(Header))
+            {
+                return false;
+            }
+
+            const Header &header = *(const Header *)m_file.data();
+            if (memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != version ||
+                header.file_size != m_file.size())
+            {
+                fprintf(stderr, "\"%s\" is not a valid satmesh file\n", filename.c_str());
+                return close();
+            }
+            if (source != nullptr && (header.source_size != source->size || header.source_time != source->time ||
+                                      header.source_options != source->options))
+            {
+                return close();
+            }
+
+            auto in_file = [&](uint64_t offset, uint64_t count, uint64_t size) {
+                return offset % alignof(float) == 0 && offset <= m_file.size() &&
+                       count <= (m_file.size() - offset) / size;
+            };
+
+            if (!in_file(header.meshes_offset, header.mesh_count, sizeof(MeshEntry)) ||
+                !in_file(header.instances_offset, header.instance_count, sizeof(InstanceEntry)) ||
+                !in_file(header.textures_offset, header.texture_count, sizeof(TextureEntry)))
+            {
+                fprintf(stderr, "\"%s\" is truncated\n", filename.c_str());
+                return close();
+            }
+
+            const MeshEntry *entries = (const MeshEntry *)(m_file.data() + header.meshes_offset);
+            for (uint32_t m = 0; m < header.mesh_count; m++)
+            {
+                const MeshEntry &entry = entries[m];
+                if (!in_file(entry.positions_offset, entry.vertex_count, sizeof(glm::vec3)) ||
+                    (entry.colors_offset && !in_file(entry.colors_offset, entry.vertex_count, sizeof(glm::vec4))) ||
+                    (entry.uvs_offset && !in_file(entry.uvs_offset, entry.vertex_count, sizeof(glm::vec2))) ||
+                    !in_file(entry.elements_offset, entry.triangle_count, 3 * sizeof(uint32_t)) ||
+                    entry.texture > header.texture_count)
+                {
+                    fprintf(stderr, "\"%s\" is truncated\n", filename.c_str());
+                    return close();
+                }
+
+                // Checked once here so the BVH can trust the elements
+                const uint32_t *elements = (const uint32_t *)(m_file.data() + entry.elements_offset);
+                for (uint64_t i = 0; i < entry.triangle_count * 3; i++)
+                {
+                    if (elements[i] >= entry.vertex_count)
+                    {
+                        fprintf(stderr, "\"%s\" has an element out of range\n", filename.c_str());
+                        return close();
+                    }
+                }
+
+                MeshView view{};
+                view.positions = (const glm::vec3 *)(m_file.data() + entry.positions_offset);
+                view.colors = entry.colors_offset ? (const glm::vec4 *)(m_file.data() + entry.colors_offset) : nullptr;
+                view.uvs = entry.uvs_offset ? (const glm::vec2 *)(m_file.data() + entry.uvs_offset) : nullptr;
+                view.elements = (const unsigned int *)(m_file.data() + entry.elements_offset);
+                view.vertex_count = entry.vertex_count;
+                view.triangle_count = entry.triangle_count;
+                view.texture = (int)entry.texture;
+                m_meshes.push_back(view);
+            }
+
+            const InstanceEntry *instances = (const InstanceEntry *)(m_file.data() + header.instances_offset);
+            for (uint32_t i = 0; i < header.instance_count; i++)
+            {
+                if (instances[i].mesh >= header.mesh_count)
+                {
+                    fprintf(stderr, "\"%s\" has an instance of a missing mesh\n", filename.c_str());
+                    return close();
+                }
+
+                Instance instance;
+                memcpy(&instance.transform[0][0], instances[i].transform, sizeof(instances[i].transform));
+                instance.mesh = (int)instances[i].mesh;
+                m_instances.push_back(instance);
+            }
+
+            // Textures are small next to the meshes, they are copied out of the mapping
+            const TextureEntry *textures = (const TextureEntry *)(m_file.data() + header.textures_offset);
+            for (uint32_t t = 0; t < header.texture_count; t++)
+            {
+                size_t texel_count = material::Texture::tiledSize(textures[t].width, textures[t].height);
+                if (textures[t].width > 1 << 16 || textures[t].height > 1 << 16 ||
+                    !in_file(textures[t].texels_offset, texel_count, sizeof(uint32_t)))
+                {
+                    fprintf(stderr, "\"%s\" is truncated\n", filename.c_str());
+                    return close();
+                }
+
+                const uint32_t *texels = (const uint32_t *)(m_file.data() + textures[t].texels_offset);
+                m_textures.push_back(material::Texture::fromTiles(textures[t].width, textures[t].height,
+                                                                  std::vector<uint32_t>(texels, texels + texel_count)));
+            }
+
+            return true;
+        }
+
+        const std::vector<MeshView> &meshes() const
+        {
+            return m_meshes;
+        }
+
+        const std::vector<Instance> &instances() const
+        {
+            return m_instances;
+        }
+
+        const std::vector<material::Texture> &textures() const
+        {
+            return m_textures;
+        }
+
+    private:
+        bool close()
+        {
+            m_file.close();
+            m_meshes.clear();
+            m_instances.clear();
+            m_textures.clear();
+            return false;
+        }
+
+        MappedFile m_file;
+        std::vector<MeshView> m_meshes;
+        std::vector<Instance> m_instances;
+        std::vector<material::Texture> m_textures;
+    };
+} // namespace satmesh
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <assimp/Importer.hpp>
+#include <assimp/postprocess.h>
+#include <assimp/scene.h>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "aabb.hpp"
+#include "bvh.hpp"
+#include "material.hpp"
+#include "mesh.hpp"
+
+/**
+ * @brief Placement of a mesh in the scene. Meshes referenced by several nodes are stored once.
+ */
+struct Instance
+{
+    glm::mat4 transform;
+    int mesh;
+};
+
+struct Scene
+{
+    std::vector<Mesh> meshes;
+    std::vector<Instance> instances;
+    std::vector<material::Texture> textures; // Vertex::texture - 1
+
+    void addMesh(Mesh &&mesh, const glm::mat4 &transform = glm::mat4(1.0f))
+    {
+        meshes.push_back(std::move(mesh));
+        instances.push_back(Instance{transform, (int)meshes.size() - 1});
+    }
+};
+
+namespace scene
+{
+    inline glm::mat4 toMat4(const aiMatrix4x4 &m)
+    {
+        // assimp matrices are row major
+        return glm::mat4(m.a1, m.b1, m.c1, m.d1, m.a2, m.b2, m.c2, m.d2, m.a3, m.b3, m.c3, m.d3, m.a4, m.b4, m.c4, m.d4);
+    }
+
+    inline void addNode(const aiNode *node, const glm::mat4 &parent, Scene &scene)
+    {
+        glm::mat4 transform = parent * toMat4(node->mTransformation);
+
+        for (unsigned int i = 0; i < node->mNumMeshes; i++)
+        {
+            scene.instances.push_back(Instance{transform, (int)node->mMeshes[i]});
+        }
+        for (unsigned int i = 0; i < node->mNumChildren; i++)
+        {
+            addNode(node->mChildren[i], transform, scene);
+        }
+    }
+
+    /**
+     * @brief Diffuse texture of a material, added to the scene the first time it is used
+     *
+     * Only the textures stored uncompressed in the file can be read, there is no image decoder.
+     *
+     * @return 1 + index of the texture in scene.textures, 0 if the material has none or it cannot be read
+     */
+    inline int loadTexture(const aiScene *ai_scene, const aiMaterial *ai_material, std::map<std::string, int> &loaded,
+                           Scene &scene)
+    {
+        aiString path;
+        if (ai_material->GetTexture(aiTextureType_DIFFUSE, 0, &path) != AI_SUCCESS)
+        {
+            return 0;
+        }
+
+        auto found = loaded.find(path.C_Str());
+        if (found != loaded.end())
+        {
+            return found->second;
+        }
+
+        int texture = 0;
+        const aiTexture *ai_texture = ai_scene->GetEmbeddedTexture(path.C_Str());
+        if (ai_texture == nullptr || ai_texture->mHeight == 0)
+        {
+            fprintf(stderr, "Texture \"%s\" is not stored uncompressed in the file, its material keeps its color\n",
+                    path.C_Str());
+        }
+        else
+        {
+            std::vector<uint32_t> rgba((size_t)ai_texture->mWidth * ai_texture->mHeight);
+            for (size_t i = 0; i < rgba.size(); i++)
+            {
+                const aiTexel &texel = ai_texture->pcData[i];
+                rgba[i] = texel.r | (texel.g << 8) | (texel.b << 16) | ((uint32_t)texel.a << 24);
+            }
+            scene.textures.emplace_back((int)ai_texture->mWidth, (int)ai_texture->mHeight, rgba.data());
+            texture = (int)scene.textures.size();
+        }
+
+        loaded[path.C_Str()] = texture;
+        return texture;
+    }
+
+    /**
+     * @brief Load every mesh of a file and one instance per node referencing it, with the vertex colors,
+     * the uvs and the diffuse color and texture of their material
+     *
+     * @return false if the file cannot be read or has no mesh
+     */
+    inline bool loadScene(const std::string &filename, Scene &scene)
+    {
+        Assimp::Importer importer;
+        const aiScene *ai_scene = importer.ReadFile(filename, aiProcess_DropNormals | aiProcess_Triangulate);
+        if (ai_scene == nullptr || ai_scene->mNumMeshes == 0 || ai_scene->mRootNode == nullptr)
+        {
+            fprintf(stderr, "Cannot load mesh \"%s\": %s\n", filename.c_str(), importer.GetErrorString());
+            return false;
+        }
+
+        std::map<std::string, int> loaded_textures;
+        scene.meshes.resize(ai_scene->mNumMeshes);
+        for (unsigned int m = 0; m < ai_scene->mNumMeshes; m++)
+        {
+            const aiMesh *ai_mesh = ai_scene->mMeshes[m];
+            Mesh &mesh = scene.meshes[m];
+
+            glm::vec4 diffuse(1.0f);
+            int texture = 0;
+            if (ai_mesh->mMaterialIndex < ai_scene->mNumMaterials)
+            {
+                const aiMaterial *ai_material = ai_scene->mMaterials[ai_mesh->mMaterialIndex];
+                aiColor4D color;
+                if (ai_material->Get(AI_MATKEY_COLOR_DIFFUSE, color) == AI_SUCCESS)
+                {
+                    diffuse = glm::vec4(color.r, color.g, color.b, color.a);
+                }
+                if (ai_mesh->HasTextureCoords(0))
+                {
+                    texture = loadTexture(ai_scene, ai_material, loaded_textures, scene);
+                }
+            }
+
+            mesh.vertices.resize(ai_mesh->mNumVertices);
+            for (unsigned int i = 0; i < ai_mesh->mNumVertices; i++)
+            {
+                Vertex &vertex = mesh.vertices[i];
+                vertex = Vertex{};
+                vertex.position = glm::vec3(ai_mesh->mVertices[i].x, ai_mesh->mVertices[i].y, ai_mesh->mVertices[i].z);
+                vertex.color = diffuse;
+                if (ai_mesh->HasVertexColors(0))
+                {
+                    const aiColor4D &color = ai_mesh->mColors[0][i];
+                    vertex.color *= glm::vec4(color.r, color.g, color.b, color.a);
+                }
+                if (ai_mesh->HasTextureCoords(0))
+                {
+                    vertex.uv = glm::vec2(ai_mesh->mTextureCoords[0][i].x, ai_mesh->mTextureCoords[0][i].y);
+                }
+                vertex.texture = texture;
+            }
+
+            // Points and lines are left in the mesh by aiProcess_Triangulate, they cannot be voxelized
+            mesh.elements.reserve(ai_mesh->mNumFaces * 3);
+            for (unsigned int i = 0; i < ai_mesh->mNumFaces; i++)
+            {
+                if (ai_mesh->mFaces[i].mNumIndices == 3)
+                {
+                    mesh.elements.push_back(ai_mesh->mFaces[i].mIndices[0]);
+                    mesh.elements.push_back(ai_mesh->mFaces[i].mIndices[1]);
+                    mesh.elements.push_back(ai_mesh->mFaces[i].mIndices[2]);
+                }
+            }
+        }
+
+        addNode(ai_scene->mRootNode, glm::mat4(1.0f), scene);
+        return true;
+    }
+
+    /**
+     * @brief World space bounds of a transformed box
+     */
+    inline AABB transformAABB(const AABB &aabb, const glm::mat4 &transform)
+    {
+        glm::vec3 center = glm::vec3(transform * glm::vec4((aabb.min + aabb.max) / 2.0f, 1.0f));
+        glm::vec3 extent = (aabb.max - aabb.min) / 2.0f;
+
+        glm::mat3 abs_transform = glm::mat3(transform);
+        for (int i = 0; i < 3; i++)
+        {
+            abs_transform[i] = glm::abs(abs_transform[i]);
+        }
+        extent = abs_transform * extent;
+
+        AABB result{};
+        result.min = center - extent;
+        result.max = center + extent;
+        result.center = center;
+        return result;
+    }
+} // namespace scene
+
+/**
+ * @brief Two level acceleration structure: one BVH per unique mesh and a BVH over the instances
+ *
+ * The BVHs of all the meshes are concatenated in m_nodes and m_triangles, node and leaf indices
+ * staying relative to their own mesh. Instances store where their mesh starts, so the voxelizer
+ * can walk m_top_nodes down to an instance and then the mesh BVH in the instance space.
+ *
+ * Both levels come with their escape links (see BVH::escapeLinks), relative to their mesh like the
+ * child indices, so they are walked without a stack.
+ */
+class SceneBVH
+{
+public:
+    // Must match the Instance struct of voxelizer.comp
+    struct GPUInstance
+    {
+        glm::mat4 transform;
+        glm::vec3 bound_min;
+        int node_offset;
+        glm::vec3 bound_max;
+        int triangle_offset;
+    };
+
+    struct MeshRange
+    {
+        int node_offset;
+        int node_count;
+        int triangle_offset;
+        int triangle_count;
+    };
+
+    std::vector<BVH::Node> m_nodes;
+    std::vector<int> m_escapes;
+    std::vector<BVH::Triangle> m_triangles;
+    std::vector<MeshRange> m_meshes;
+    std::vector<GPUInstance> m_instances;
+    std::vector<BVH::Node> m_top_nodes;
+    std::vector<int> m_top_escapes;
+
+    SceneBVH(const Scene &scene, int leaf_max_size = 4, int depth_max_size = 512, int top_leaf_max_size = 2)
+        : SceneBVH(scene.meshes, scene.instances, leaf_max_size, depth_max_size, top_leaf_max_size)
+    {
+    }
+
+    /**
+     * @param meshes unique meshes, either Mesh or MeshView
+     * @param instances placements of the meshes
+     */
+    template <typename MeshType>
+    SceneBVH(const std::vector<MeshType> &meshes, const std::vector<Instance> &instances, int leaf_max_size = 4,
+             int depth_max_size = 512, int top_leaf_max_size = 2)
+    {
+        m_meshes.resize(meshes.size(), MeshRange{0, 0, 0, 0});
+        for (size_t m = 0; m < meshes.size(); m++)
+        {
+            if (triangleCount(meshes[m]) == 0)
+            {
+                continue;
+            }
+
+            BVH bvh(meshes[m], leaf_max_size, depth_max_size);
+
+            m_meshes[m] = MeshRange{(int)m_nodes.size(), (int)bvh.m_nodes.size(), (int)m_triangles.size(),
+                                    (int)bvh.m_triangles.size()};
+            m_nodes.insert(m_nodes.end(), bvh.m_nodes.begin(), bvh.m_nodes.end());
+            m_escapes.insert(m_escapes.end(), bvh.m_escapes.begin(), bvh.m_escapes.end());
+            m_triangles.insert(m_triangles.end(), bvh.m_triangles.begin(), bvh.m_triangles.end());
+        }
+
+        for (const auto &instance : instances)
+        {
+            const MeshRange &range = m_meshes[instance.mesh];
+            if (range.triangle_count == 0)
+            {
+                continue;
+            }
+
+            AABB bounds = scene::transformAABB(m_nodes[range.node_offset].aabb, instance.transform);
+            m_instances.push_back(
+                GPUInstance{instance.transform, bounds.min, range.node_offset, bounds.max, range.triangle_offset});
+        }
+
+        buildTopLevel(m_instances, top_leaf_max_size, m_top_nodes, m_top_escapes);
+    }
+
+    /**
+     * @brief BVH over instances and its escape links, the instances are reordered so each leaf holds a range
+     * of them. Also builds the top level of a subset of the instances of a scene, see binning::TileBVH.
+     */
+    static void buildTopLevel(std::vector<GPUInstance> &instances, int top_leaf_max_size,
+                              std::vector<BVH::Node> &top_nodes, std::vector<int> &top_escapes)
+    {
+        top_nodes.clear();
+        top_escapes.clear();
+        if (!instances.empty())
+        {
+            top_nodes.reserve(instances.size() * 2);
+            buildTopNode(instances, top_leaf_max_size, top_nodes, 0, (int)instances.size());
+            top_escapes = BVH::escapeLinks(top_nodes);
+        }
+    }
+
+    bool empty() const
+    {
+        return m_top_nodes.empty();
+    }
+
+    // Bounds of the whole scene
+    const AABB &aabb() const
+    {
+        return m_top_nodes[0].aabb;
+    }
+
+private:
+    static int buildTopNode(std::vector<GPUInstance> &instances, int top_leaf_max_size,
+                            std::vector<BVH::Node> &top_nodes, int first, int last)
+    {
+        int index = (int)top_nodes.size();
+        top_nodes.push_back(BVH::Node{});
+
+        AABB aabb{};
+        aabb.min = instances[first].bound_min;
+        aabb.max = instances[first].bound_max;
+        for (int i = first + 1; i < last; i++)
+        {
+            aabb.min = glm::min(aabb.min, instances[i].bound_min);
+            aabb.max = glm::max(aabb.max, instances[i].bound_max);
+        }
+        aabb.center = (aabb.min + aabb.max) / 2.0f;
+        top_nodes[index].aabb = aabb;
+
+        if (last - first <= top_leaf_max_size)
+        {
+            top_nodes[index].leaf = first;
+            top_nodes[index].leaf_elem = last - first;
+            top_nodes[index].node_left = 0;
+            top_nodes[index].node_right = 0;
+            return index;
+        }
+
+        // Median split along the longest axis, instances are few enough for it to be cheap
+        glm::vec3 size = aabb.max - aabb.min;
+        int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+        int middle = (first + last) / 2;
+        std::nth_element(instances.begin() + first, instances.begin() + middle, instances.begin() + last,
+                         [axis](const GPUInstance &a, const GPUInstance &b) {
+                             return a.bound_min[axis] + a.bound_max[axis] < b.bound_min[axis] + b.bound_max[axis];
+                         });
+
+        int node_left = buildTopNode(instances, top_leaf_max_size, top_nodes, first, middle);
+        int node_right = buildTopNode(instances, top_leaf_max_size, top_nodes, middle, last);
+        top_nodes[index].node_left = node_left;
+        top_nodes[index].node_right = node_right;
+        top_nodes[index].leaf = 0;
+        top_nodes[index].leaf_elem = 0;
+        return index;
+    }
+};
@@ -0,0 +1,565 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <glm/glm.hpp>
+
+#include "planner.hpp"
+
+/**
+ * Sharded conversion: a coordinator splits the regions of a plan into shards and publishes them in a
+ * queue directory, workers claim shards one at a time and write their regions. Workers can run on any
+ * machine that shares the queue directory and the output folder, a region belongs to a single shard so
+ * no two workers write the same region file.
+ *
+ * The queue is a directory of small text files, moved from one state to the next with a rename:
+ *
+ *   <index>.todo           waiting: the number of failed attempts, then one "x z" line per region
+ *   <index>.<worker>.run   claimed by a worker, its heartbeat thread counts up the "beat" line at the end
+ *   <index>.done           every region written
+ *   <index>.failed         given up after too many attempts
+ */
+namespace shard
+{
+    struct Shard
+    {
+        int index = -1;
+        int attempts = 0;
+        std::vector<glm::ivec2> regions;
+        long long beat = 0; // heartbeats of the worker running it, 0 before the first one
+    };
+
+    struct Counts
+    {
+        int todo = 0;
+        int running = 0;
+        int done = 0;
+        int failed = 0;
+    };
+
+    /**
+     * @brief Name of this process in the queue, unique across the machines sharing it
+     */
+    inline std::string workerId()
+    {
+#ifdef _WIN32
+        const char *host = std::getenv("COMPUTERNAME");
+        int pid = _getpid();
+#else
+        const char *host = std::getenv("HOSTNAME");
+        int pid = getpid();
+#endif
+        return std::string(host != nullptr ? host : "local") + "-" + std::to_string(pid);
+    }
+
+    /**
+     * @brief Split the regions of a plan into shards of about the same number of tiles, in plan order
+     *
+     * @param group_shift regions sharing region >> group_shift stay in the same shard, so a worker writes
+     * every level of detail of its regions whole (see lod.hpp)
+     */
+    inline std::vector<std::vector<glm::ivec2>> splitRegions(const std::vector<planner::Tile> &tiles, int shard_count,
+                                                             int group_shift = 0)
+    {
+        std::vector<std::pair<glm::ivec2, int>> regions; // region and its number of tiles
+        for (const planner::Tile &tile : tiles)
+        {
+            if (tile.first_in_region)
+            {
+                regions.push_back({tile.region, 0});
+            }
+            regions.back().second++;
+        }
+
+        shard_count = std::clamp(shard_count, 1, std::max((int)regions.size(), 1));
+        std::vector<std::vector<glm::ivec2>> shards(1);
+        size_t tiles_done = 0;
+        for (const auto &[region, tile_count] : regions)
+        {
+            // Start the next shard once this one holds its share of the tiles
+            size_t target = tiles.size() * shards.size() / shard_count;
+            if (!shards.back().empty() && tiles_done >= target &&
+                region >> group_shift != shards.back().back() >> group_shift)
+            {
+                shards.emplace_back();
+            }
+            shards.back().push_back(region);
+            tiles_done += tile_count;
+        }
+
+        if (shards.back().empty())
+        {
+            shards.pop_back();
+        }
+        return shards;
+    }
+
+    /**
+     * @brief Tiles of a plan that belong to the regions of a shard, in plan order
+     */
+    inline std::vector<size_t> selectTiles(const std::vector<planner::Tile> &tiles, const Shard &shard)
+    {
+        std::vector<size_t> selected;
+        for (size_t i = 0; i < tiles.size(); i++)
+        {
+            if (std::find(shard.regions.begin(), shard.regions.end(), tiles[i].region) != shard.regions.end())
+            {
+                selected.push_back(i);
+            }
+        }
+        return selected;
+    }
+
+    class Queue
+    {
+    public:
+        explicit Queue(std::filesystem::path directory) : m_directory{std::move(directory)}
+        {
+        }
+
+        const std::filesystem::path &directory() const
+        {
+            return m_directory;
+        }
+
+        /**
+         * @brief Publish the shards of a new conversion, the previous content of the queue is removed
+         */
+        bool create(const std::vector<std::vector<glm::ivec2>> &shards)
+        {
+            std::error_code error;
+            std::filesystem::remove_all(m_directory, error);
+            if (!std::filesystem::create_directories(m_directory, error))
+            {
+                fprintf(stderr, "Cannot create the shard queue \"%s\": %s\n", m_directory.string().c_str(),
+                        error.message().c_str());
+                return false;
+            }
+
+            for (size_t i = 0; i < shards.size(); i++)
+            {
+                if (!publish(Shard{(int)i, 0, shards[i]}))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /**
+         * @brief Take the first waiting shard, the rename fails for every worker but one
+         *
+         * @return false if no shard is waiting
+         */
+        bool claim(const std::string &worker, Shard &shard)
+        {
+            std::vector<int> waiting = indices(".todo");
+            for (int index : waiting)
+            {
+                std::error_code error;
+                std::filesystem::rename(path(index, ".todo"), runPath(index, worker), error);
+                if (error)
+                {
+                    continue;
+                }
+
+                if (read(runPath(index, worker), shard))
+                {
+                    shard.index = index;
+                    return true;
+                }
+                fprintf(stderr, "Shard %i is unreadable, dropping it\n", index);
+                std::filesystem::rename(runPath(index, worker), path(index, ".failed"), error);
+            }
+            return false;
+        }
+
+        /**
+         * @brief Tell the coordinator the worker of a shard is still alive: the beat counter at the end of the
+         * run file goes up. Only the counter is compared, the clocks of the machines never are.
+         *
+         * The file is rewritten in place and never created, a shard the coordinator already took back stays
+         * gone. The beat only grows, so the new content always covers the old one.
+         */
+        void heartbeat(Shard &shard, const std::string &worker)
+        {
+            std::fstream file(runPath(shard.index, worker), std::ios::in | std::ios::out);
+            if (!file)
+            {
+                return;
+            }
+
+            shard.beat++;
+            write(file, shard);
+            file.flush();
+        }
+
+        void complete(const Shard &shard, const std::string &worker)
+        {
+            std::error_code error;
+            std::filesystem::rename(runPath(shard.index, worker), path(shard.index, ".done"), error);
+            if (error)
+            {
+                fprintf(stderr, "Cannot mark shard %i as done: %s\n", shard.index, error.message().c_str());
+            }
+        }
+
+        /**
+         * @brief Put the shards a worker was running back in the queue, once a worker exited or stopped
+         * beating. A shard failing max_attempts times is given up.
+         *
+         * @param worker only requeue the shards of this worker, all the stale ones if empty
+         * @param stale_after shards whose beat did not change for this long, on the clock of this process, are
+         * requeued. Ignored if worker is set.
+         * @return number of shards requeued or given up
+         */
+        int requeue(const std::string &worker, std::chrono::seconds stale_after, int max_attempts)
+        {
+            int requeued = 0;
+            std::error_code error;
+            auto now = std::chrono::steady_clock::now();
+            std::map<std::string, Beat> beats;
+            for (const auto &entry : std::filesystem::directory_iterator(m_directory, error))
+            {
+                std::string name = entry.path().filename().string();
+                size_t dot = name.find('.');
+                if (entry.path().extension() != ".run" || dot == std::string::npos)
+                {
+                    continue;
+                }
+
+                Shard shard;
+                if (!read(entry.path(), shard))
+                {
+                    continue;
+                }
+                shard.index = std::atoi(name.c_str());
+
+                std::string owner = name.substr(dot + 1, name.size() - dot - 1 - 4);
+                if (worker.empty())
+                {
+                    // A run seen for the first time or with a new beat is alive from now on
+                    auto last = m_beats.find(name);
+                    if (last == m_beats.end() || last->second.beat != shard.beat)
+                    {
+                        beats[name] = Beat{shard.beat, now};
+                        continue;
+                    }
+                    if (now - last->second.seen < stale_after)
+                    {
+                        beats[name] = last->second;
+                        continue;
+                    }
+                }
+                else if (owner != worker)
+                {
+                    continue;
+                }
+                shard.attempts++;
+
+                if (shard.attempts >= max_attempts)
+                {
+                    fprintf(stderr, "Shard %i failed %i times, giving up on it\n", shard.index, shard.attempts);
+                    std::filesystem::rename(entry.path(), path(shard.index, ".failed"), error);
+                }
+                else
+                {
+                    printf("Shard %i of worker %s is queued again (attempt %i)\n", shard.index, owner.c_str(),
+                           shard.attempts + 1);
+                    if (publish(shard))
+                    {
+                        std::filesystem::remove(entry.path(), error);
+                    }
+                }
+                requeued++;
+            }
+
+            // The runs gone since the last call are forgotten
+            if (worker.empty())
+            {
+                m_beats = std::move(beats);
+            }
+            return requeued;
+        }
+
+        Counts counts() const
+        {
+            Counts counts;
+            std::error_code error;
+            for (const auto &entry : std::filesystem::directory_iterator(m_directory, error))
+            {
+                std::string extension = entry.path().extension().string();
+                counts.todo += extension == ".todo";
+                counts.running += extension == ".run";
+                counts.done += extension == ".done";
+                counts.failed += extension == ".failed";
+            }
+            return counts;
+        }
+
+    private:
+        // Last beat read from a run file, and when it was read first
+        struct Beat
+        {
+            long long beat;
+            std::chrono::steady_clock::time_point seen;
+        };
+
+        std::filesystem::path path(int index, const char *extension) const
+        {
+            return m_directory / (std::to_string(index) + extension);
+        }
+
+        std::filesystem::path runPath(int index, const std::string &worker) const
+        {
+            return m_directory / (std::to_string(index) + "." + worker + ".run");
+        }
+
+        std::vector<int> indices(const char *extension) const
+        {
+            std::vector<int> result;
+            std::error_code error;
+            for (const auto &entry : std::filesystem::directory_iterator(m_directory, error))
+            {
+                if (entry.path().extension() == extension)
+                {
+                    result.push_back(std::atoi(entry.path().filename().string().c_str()));
+                }
+            }
+            std::sort(result.begin(), result.end());
+            return result;
+        }
+
+        // Written next to its final name then renamed, a worker never claims a partial shard
+        bool publish(const Shard &shard) const
+        {
+            std::filesystem::path temporary = path(shard.index, ".tmp");
+            {
+                std::ofstream file(temporary, std::ios::trunc);
+                write(file, Shard{shard.index, shard.attempts, shard.regions});
+                if (!file)
+                {
+                    fprintf(stderr, "Cannot write shard %i to \"%s\"\n", shard.index, temporary.string().c_str());
+                    return false;
+                }
+            }
+
+            std::error_code error;
+            std::filesystem::rename(temporary, path(shard.index, ".todo"), error);
+            return !error;
+        }
+
+        // The beat line is only written once a worker beats, a waiting shard has none
+        static void write(std::ostream &file, const Shard &shard)
+        {
+            file << shard.attempts << "\n";
+            for (const glm::ivec2 &region : shard.regions)
+            {
+                file << region.x << " " << region.y << "\n";
+            }
+            if (shard.beat > 0)
+            {
+                file << "beat " << shard.beat << "\n";
+            }
+        }
+
+        static bool read(const std::filesystem::path &filename, Shard &shard)
+        {
+            std::ifstream file(filename);
+            if (!(file >> shard.attempts))
+            {
+                return false;
+            }
+
+            shard.regions.clear();
+            glm::ivec2 region;
+            while (file >> region.x >> region.y)
+            {
+                shard.regions.push_back(region);
+            }
+
+            file.clear();
+            std::string keyword;
+            shard.beat = 0;
+            if (file >> keyword && keyword == "beat")
+            {
+                file >> shard.beat;
+            }
+            return !shard.regions.empty();
+        }
+
+        std::filesystem::path m_directory;
+        std::map<std::string, Beat> m_beats; // run files the coordinator watches, by name
+    };
+
+    /**
+     * @brief Beat for the shard a worker runs from a thread of its own, so a long tile, region write or level of
+     * detail never looks like a dead worker
+     */
+    class Heartbeat
+    {
+    public:
+        Heartbeat(Queue &queue, std::string worker, std::chrono::milliseconds interval)
+            : m_queue{queue}, m_worker{std::move(worker)}, m_interval{interval}
+        {
+            m_thread = std::thread([this]() {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                while (!m_stop)
+                {
+                    if (m_shard.index >= 0)
+                    {
+                        m_queue.heartbeat(m_shard, m_worker);
+                    }
+                    m_wake.wait_for(lock, m_interval);
+                }
+            });
+        }
+
+        Heartbeat(const Heartbeat &) = delete;
+        Heartbeat &operator=(const Heartbeat &) = delete;
+
+        ~Heartbeat()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_wake.notify_one();
+            m_thread.join();
+        }
+
+        /**
+         * @brief Beat for this shard from now on, a shard without index stops beating. Once this returns no
+         * beat writes the previous shard anymore, it can be completed.
+         */
+        void follow(const Shard &shard)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_shard = shard;
+        }
+
+    private:
+        Queue &m_queue;
+        std::string m_worker;
+        std::chrono::milliseconds m_interval;
+        Shard m_shard;
+        bool m_stop = false;
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        std::thread m_thread;
+    };
+
+    // Workers beat several times per stale_after, a late beat or two does not requeue their shard
+    inline std::chrono::milliseconds heartbeatInterval(std::chrono::seconds stale_after)
+    {
+        return std::max(std::chrono::duration_cast<std::chrono::milliseconds>(stale_after) / 4,
+                        std::chrono::milliseconds(250));
+    }
+
+    struct CoordinatorOptions
+    {
+        int workers = 1;                                // local worker processes
+        int max_attempts = 3;                           // per shard
+        std::chrono::seconds stale_after{120};          // without heartbeat, for workers on other machines
+        std::chrono::milliseconds poll_interval{1000};
+    };
+
+    /**
+     * @brief Run local workers until every shard of the queue is done or given up
+     *
+     * @param worker_command command line of a worker, "{worker}" is replaced by the worker id or the id is
+     * appended if it has none
+     * @return number of shards given up
+     */
+    inline int runCoordinator(Queue &queue, const std::string &worker_command, const CoordinatorOptions &options)
+    {
+        auto finished = [&]() {
+            Counts counts = queue.counts();
+            return counts.todo == 0 && counts.running == 0;
+        };
+
+        // A worker takes shards until none is waiting, the shards it held when it exited go back in the queue
+        std::atomic<int> launches{0};
+        auto run_worker = [&](int slot) {
+            while (!finished())
+            {
+                if (queue.counts().todo == 0)
+                {
+                    std::this_thread::sleep_for(options.poll_interval);
+                    continue;
+                }
+
+                std::string worker = workerId() + "-" + std::to_string(slot) + "-" + std::to_string(launches++);
+                std::string command = worker_command;
+                size_t placeholder = command.find("{worker}");
+                if (placeholder != std::string::npos)
+                {
+                    command.replace(placeholder, std::string("{worker}").size(), worker);
+                }
+                else
+                {
+                    command += " \"" + worker + "\"";
+                }
+
+#ifdef _WIN32
+                // cmd /c strips the first and the last quote of a line starting with one, the extra pair keeps
+                // the quotes of the program and its arguments
+                command = "\"" + command + "\"";
+#endif
+                int status = std::system(command.c_str());
+                if (status != 0)
+                {
+                    fprintf(stderr, "Worker %s exited with status %i\n", worker.c_str(), status);
+                }
+                queue.requeue(worker, options.stale_after, options.max_attempts);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < std::max(options.workers, 1); i++)
+        {
+            threads.push_back(std::thread(run_worker, i));
+        }
+
+        // Workers on other machines are only seen through their heartbeats
+        Counts last{-1, -1, -1, -1};
+        while (!finished())
+        {
+            std::this_thread::sleep_for(options.poll_interval);
+            queue.requeue("", options.stale_after, options.max_attempts);
+
+            Counts counts = queue.counts();
+            if (counts.done != last.done || counts.failed != last.failed)
+            {
+                printf("Shards: %i done, %i running, %i waiting, %i failed\n", counts.done, counts.running,
+                       counts.todo, counts.failed);
+                last = counts;
+            }
+        }
+
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        return queue.counts().failed;
+    }
+} // namespace shard
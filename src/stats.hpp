@@ -0,0 +1,157 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef SATANIA_STATS
+#define SATANIA_STATS 0
+#endif
+
+/**
+ * Counters of the voxelizer and the region encoder, summed over a run and written as a JSON report.
+ * They are only updated when SATANIA_STATS is set, the voxelizer shader counters cost an atomic per voxel.
+ */
+namespace stats
+{
+    /**
+     * @brief Number of samples, sum, min and max of a value, can be updated from any thread
+     */
+    struct Distribution
+    {
+        std::atomic<uint64_t> samples{0};
+        std::atomic<uint64_t> sum{0};
+        std::atomic<uint64_t> min{std::numeric_limits<uint64_t>::max()};
+        std::atomic<uint64_t> max{0};
+
+        void add(uint64_t value)
+        {
+            samples.fetch_add(1, std::memory_order_relaxed);
+            sum.fetch_add(value, std::memory_order_relaxed);
+
+            uint64_t current = min.load(std::memory_order_relaxed);
+            while (value < current && !min.compare_exchange_weak(current, value, std::memory_order_relaxed))
+            {
+            }
+            current = max.load(std::memory_order_relaxed);
+            while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed))
+            {
+            }
+        }
+
+        double mean() const
+        {
+            return samples ? (double)sum / samples : 0.0;
+        }
+
+        void write(FILE *file, const char *name, bool last = false) const
+        {
+            fprintf(file,
+                    "    \"%s\": {\"samples\": %llu, \"sum\": %llu, \"mean\": %.3f, \"min\": %llu, \"max\": %llu}%s\n",
+                    name, (unsigned long long)samples, (unsigned long long)sum, mean(),
+                    (unsigned long long)(samples ? min.load() : 0), (unsigned long long)max, last ? "" : ",");
+        }
+    };
+
+    /**
+     * @brief Work done by the BVH traversal, counted locally by a thread and added to the run once
+     */
+    struct Traversal
+    {
+        uint64_t voxels = 0;
+        uint64_t filled_voxels = 0;
+        uint64_t nodes_visited = 0; // top level and mesh nodes
+        uint64_t triangle_tests = 0;
+
+        Traversal &operator+=(const Traversal &other)
+        {
+            voxels += other.voxels;
+            filled_voxels += other.filled_voxels;
+            nodes_visited += other.nodes_visited;
+            triangle_tests += other.triangle_tests;
+            return *this;
+        }
+    };
+
+    class Stats
+    {
+    public:
+        static Stats &get()
+        {
+            static Stats stats;
+            return stats;
+        }
+
+        void addTraversal(const Traversal &traversal)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_traversal += traversal;
+        }
+
+        Traversal traversal()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_traversal;
+        }
+
+        Distribution occupied_blocks;   // per encoded section, blocks that are not air
+        Distribution raw_bytes;         // per compressMemory call
+        Distribution compressed_bytes;  // per compressMemory call
+        Distribution region_sectors;    // per written region file
+
+        /**
+         * @param parameters settings of the run, written along the counters so reports can be compared
+         */
+        bool writeReport(const std::string &filename, const std::vector<std::pair<std::string, double>> &parameters)
+        {
+            FILE *file = fopen(filename.c_str(), "wb");
+            if (file == nullptr)
+            {
+                fprintf(stderr, "Cannot write the stats report \"%s\"\n", filename.c_str());
+                return false;
+            }
+
+            Traversal counts = traversal();
+            double voxels = counts.voxels ? (double)counts.voxels : 1.0;
+
+            fprintf(file, "{\n  \"parameters\": {\n");
+            for (size_t i = 0; i < parameters.size(); i++)
+            {
+                fprintf(file, "    \"%s\": %g%s\n", parameters[i].first.c_str(), parameters[i].second,
+                        i + 1 < parameters.size() ? "," : "");
+            }
+            fprintf(file, "  },\n  \"traversal\": {\n");
+            fprintf(file, "    \"voxels\": %llu,\n", (unsigned long long)counts.voxels);
+            fprintf(file, "    \"filled_voxels\": %llu,\n", (unsigned long long)counts.filled_voxels);
+            fprintf(file, "    \"nodes_visited\": %llu,\n", (unsigned long long)counts.nodes_visited);
+            fprintf(file, "    \"triangle_tests\": %llu,\n", (unsigned long long)counts.triangle_tests);
+            fprintf(file, "    \"nodes_per_voxel\": %.3f,\n", counts.nodes_visited / voxels);
+            fprintf(file, "    \"triangle_tests_per_voxel\": %.3f\n", counts.triangle_tests / voxels);
+            fprintf(file, "  },\n  \"sections\": {\n");
+            occupied_blocks.write(file, "occupied_blocks", true);
+            fprintf(file, "  },\n  \"compression\": {\n");
+            raw_bytes.write(file, "raw_bytes");
+            compressed_bytes.write(file, "compressed_bytes");
+            fprintf(file, "    \"ratio\": %.3f\n",
+                    compressed_bytes.sum ? (double)raw_bytes.sum / compressed_bytes.sum : 0.0);
+            fprintf(file, "  },\n  \"regions\": {\n");
+            region_sectors.write(file, "sectors", true);
+            fprintf(file, "  }\n}\n");
+
+            bool success = ferror(file) == 0;
+            fclose(file);
+            return success;
+        }
+
+    private:
+        Stats() = default;
+
+        std::mutex m_mutex;
+        Traversal m_traversal;
+    };
+} // namespace stats
@@ -0,0 +1,410 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SATANIA_WIDE_BVH_SSE2 1
+#include <emmintrin.h>
+#else
+#define SATANIA_WIDE_BVH_SSE2 0
+#endif
+
+#include "cpu_voxelizer.hpp"
+#include "scene.hpp"
+
+/**
+ * Wide BVH for the CPU voxelizer: the mesh BVHs of a SceneBVH collapsed into nodes of 4 or 8 children,
+ * whose bounds are stored axis by axis so one SSE2 (4 wide) or AVX2 (8 wide) compare tests them all
+ * against the voxel box. AVX2 is picked at run time like the overlap test of cpu_voxelizer, 8 wide nodes
+ * take two SSE2 compares without it.
+ *
+ * The children of a wide node are gathered by opening the largest binary child until the node is full.
+ * Leaves and triangles are the ones of the binary BVH, so a voxel tests the same triangles and gets the
+ * same value. The top level over the instances is small and stays binary.
+ */
+namespace wide_bvh
+{
+    template <int Width>
+    struct alignas(Width * sizeof(float)) Node
+    {
+        float min_x[Width];
+        float min_y[Width];
+        float min_z[Width];
+        float max_x[Width];
+        float max_y[Width];
+        float max_z[Width];
+        int child[Width]; // wide node relative to the mesh, or first triangle of a leaf relative to the mesh
+        int count[Width]; // triangles of a leaf, 0 for a wide node, -1 for an empty slot
+    };
+
+    // See intersectMask, one child at a time
+    template <int Width>
+    inline uint32_t intersectMaskScalar(const Node<Width> &node, const glm::vec3 &box_min, const glm::vec3 &box_max)
+    {
+        uint32_t mask = 0;
+        for (int i = 0; i < Width; i++)
+        {
+            bool hit = node.min_x[i] <= box_max.x && box_min.x <= node.max_x[i] && node.min_y[i] <= box_max.y &&
+                       box_min.y <= node.max_y[i] && node.min_z[i] <= box_max.z && box_min.z <= node.max_z[i];
+            mask |= (uint32_t)hit << i;
+        }
+        return mask;
+    }
+
+#if SATANIA_WIDE_BVH_SSE2
+    // 4 children from first, the bounds of a node are aligned for every group of 4
+    inline uint32_t intersectMaskSSE2(const float *min_x, const float *min_y, const float *min_z,
+                                      const float *max_x, const float *max_y, const float *max_z,
+                                      const glm::vec3 &box_min, const glm::vec3 &box_max)
+    {
+        __m128 hit = _mm_and_ps(_mm_cmple_ps(_mm_load_ps(min_x), _mm_set1_ps(box_max.x)),
+                                _mm_cmple_ps(_mm_set1_ps(box_min.x), _mm_load_ps(max_x)));
+        hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_load_ps(min_y), _mm_set1_ps(box_max.y)));
+        hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_set1_ps(box_min.y), _mm_load_ps(max_y)));
+        hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_load_ps(min_z), _mm_set1_ps(box_max.z)));
+        hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_set1_ps(box_min.z), _mm_load_ps(max_z)));
+        return (uint32_t)_mm_movemask_ps(hit);
+    }
+#endif
+
+#if SATANIA_OVERLAP_AVX2
+    SATANIA_TARGET_AVX2 inline uint32_t intersectMaskAVX2(const Node<8> &node, const glm::vec3 &box_min,
+                                                          const glm::vec3 &box_max)
+    {
+        __m256 hit = _mm256_and_ps(_mm256_cmp_ps(_mm256_load_ps(node.min_x), _mm256_set1_ps(box_max.x), _CMP_LE_OQ),
+                                   _mm256_cmp_ps(_mm256_set1_ps(box_min.x), _mm256_load_ps(node.max_x), _CMP_LE_OQ));
+        hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_load_ps(node.min_y), _mm256_set1_ps(box_max.y), _CMP_LE_OQ));
+        hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_set1_ps(box_min.y), _mm256_load_ps(node.max_y), _CMP_LE_OQ));
+        hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_load_ps(node.min_z), _mm256_set1_ps(box_max.z), _CMP_LE_OQ));
+        hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_set1_ps(box_min.z), _mm256_load_ps(node.max_z), _CMP_LE_OQ));
+        return (uint32_t)_mm256_movemask_ps(hit);
+    }
+#endif
+
+    /**
+     * @brief Children of a node whose bounds touch a box, bit i set for child i. Empty slots have inverted
+     * bounds and never touch.
+     */
+    template <int Width>
+    inline uint32_t intersectMask(const Node<Width> &node, const glm::vec3 &box_min, const glm::vec3 &box_max)
+    {
+#if SATANIA_OVERLAP_AVX2
+        if constexpr (Width == 8)
+        {
+            if (cpu_voxelizer::hasAVX2())
+            {
+                return intersectMaskAVX2(node, box_min, box_max);
+            }
+        }
+#endif
+#if SATANIA_WIDE_BVH_SSE2
+        if constexpr (Width == 4 || Width == 8)
+        {
+            uint32_t mask = 0;
+            for (int i = 0; i < Width; i += 4)
+            {
+                mask |= intersectMaskSSE2(node.min_x + i, node.min_y + i, node.min_z + i, node.max_x + i,
+                                          node.max_y + i, node.max_z + i, box_min, box_max)
+                        << i;
+            }
+            return mask;
+        }
+#endif
+        return intersectMaskScalar(node, box_min, box_max);
+    }
+
+    /**
+     * @brief Instructions intersectMask takes for a width on this CPU: "avx2", "sse2" or "scalar"
+     */
+    template <int Width>
+    inline const char *intersectMaskPath()
+    {
+#if SATANIA_OVERLAP_AVX2
+        if (Width == 8 && cpu_voxelizer::hasAVX2())
+        {
+            return "avx2";
+        }
+#endif
+#if SATANIA_WIDE_BVH_SSE2
+        if (Width == 4 || Width == 8)
+        {
+            return "sse2";
+        }
+#endif
+        return "scalar";
+    }
+
+    template <int Width>
+    class WideBVH
+    {
+    public:
+        static_assert(Width >= 2 && Width <= 32, "a wide node holds 2 to 32 children");
+
+        std::vector<Node<Width>> m_nodes; // the meshes one after the other
+        std::vector<int> m_roots;         // root of the mesh of every instance of the scene, -1 without
+        std::vector<glm::mat4> m_inverse_transforms; // world to mesh space of every instance
+
+        /**
+         * @param bvh scene the wide BVH is built from, it must outlive it
+         */
+        explicit WideBVH(const SceneBVH &bvh) : m_bvh{&bvh}
+        {
+            std::vector<int> mesh_roots(bvh.m_meshes.size(), -1);
+            for (size_t m = 0; m < bvh.m_meshes.size(); m++)
+            {
+                const SceneBVH::MeshRange &range = bvh.m_meshes[m];
+                if (range.node_count == 0)
+                {
+                    continue;
+                }
+
+                mesh_roots[m] = (int)m_nodes.size();
+                collapse(range.node_offset, (int)m_nodes.size(), 0);
+            }
+
+            for (const SceneBVH::GPUInstance &instance : bvh.m_instances)
+            {
+                int root = -1;
+                for (size_t m = 0; m < bvh.m_meshes.size(); m++)
+                {
+                    if (mesh_roots[m] >= 0 && bvh.m_meshes[m].node_offset == instance.node_offset)
+                    {
+                        root = mesh_roots[m];
+                        break;
+                    }
+                }
+                m_roots.push_back(root);
+                m_inverse_transforms.push_back(glm::inverse(instance.transform));
+            }
+        }
+
+        const SceneBVH &scene() const
+        {
+            return *m_bvh;
+        }
+
+    private:
+        // Half the surface area of a binary node of a mesh, the largest child is opened first
+        float surfaceArea(int node_offset, int index) const
+        {
+            const AABB &aabb = m_bvh->m_nodes[node_offset + index].aabb;
+            glm::vec3 size = aabb.max - aabb.min;
+            return size.x * size.y + size.y * size.z + size.z * size.x;
+        }
+
+        /**
+         * @brief Wide node of a binary node and its subtree, parents before their children
+         *
+         * @param node_offset first binary node of the mesh
+         * @param mesh_first first wide node of the mesh
+         * @param index binary node relative to the mesh
+         * @return wide node relative to the mesh
+         */
+        int collapse(int node_offset, int mesh_first, int index)
+        {
+            const std::vector<BVH::Node> &nodes = m_bvh->m_nodes;
+            int wide = (int)m_nodes.size() - mesh_first;
+            m_nodes.emplace_back();
+
+            // A mesh small enough to be a single leaf gets a root with one child
+            std::vector<int> children;
+            if (nodes[node_offset + index].node_left > 0)
+            {
+                children = {nodes[node_offset + index].node_left, nodes[node_offset + index].node_right};
+            }
+            else
+            {
+                children = {index};
+            }
+
+            while ((int)children.size() < Width)
+            {
+                int largest = -1;
+                for (int i = 0; i < (int)children.size(); i++)
+                {
+                    if (nodes[node_offset + children[i]].node_left > 0 &&
+                        (largest < 0 || surfaceArea(node_offset, children[i]) >
+                                            surfaceArea(node_offset, children[largest])))
+                    {
+                        largest = i;
+                    }
+                }
+                if (largest < 0)
+                {
+                    break;
+                }
+
+                const BVH::Node &opened = nodes[node_offset + children[largest]];
+                children[largest] = opened.node_left;
+                children.insert(children.begin() + largest + 1, opened.node_right);
+            }
+
+            for (int i = 0; i < Width; i++)
+            {
+                Node<Width> &node = m_nodes[mesh_first + wide];
+                if (i >= (int)children.size())
+                {
+                    node.min_x[i] = node.min_y[i] = node.min_z[i] = INFINITY;
+                    node.max_x[i] = node.max_y[i] = node.max_z[i] = -INFINITY;
+                    node.child[i] = 0;
+                    node.count[i] = -1;
+                    continue;
+                }
+
+                const BVH::Node &binary = nodes[node_offset + children[i]];
+                node.min_x[i] = binary.aabb.min.x;
+                node.min_y[i] = binary.aabb.min.y;
+                node.min_z[i] = binary.aabb.min.z;
+                node.max_x[i] = binary.aabb.max.x;
+                node.max_y[i] = binary.aabb.max.y;
+                node.max_z[i] = binary.aabb.max.z;
+
+                if (binary.node_left > 0)
+                {
+                    node.count[i] = 0;
+                    int child = collapse(node_offset, mesh_first, children[i]); // m_nodes may move
+                    m_nodes[mesh_first + wide].child[i] = child;
+                }
+                else
+                {
+                    node.child[i] = binary.leaf;
+                    node.count[i] = binary.leaf_elem;
+                }
+            }
+            return wide;
+        }
+
+        const SceneBVH *m_bvh;
+    };
+
+    /**
+     * @brief Walk both levels down to the leaves whose bounds touch a voxel, see cpu_voxelizer::walkLeaves. The
+     * voxel box is taken to the mesh space of each instance, padded so the float rounding of the transform
+     * never culls a node the binary walk keeps.
+     */
+    template <cpu_voxelizer::Precision precision, int Width, typename TestLeaf>
+    inline void walkLeaves(const WideBVH<Width> &wide, const cpu_voxelizer::Voxel &voxel,
+                           stats::Traversal *traversal, TestLeaf &&test_leaf)
+    {
+        const SceneBVH &bvh = wide.scene();
+        cpu_voxelizer::walkInstances<precision>(bvh, voxel, traversal, [&](int instance_index) {
+            const int root = wide.m_roots[instance_index];
+            if (root < 0)
+            {
+                return false;
+            }
+
+            const SceneBVH::GPUInstance &instance = bvh.m_instances[instance_index];
+            const glm::mat4 &inverse = wide.m_inverse_transforms[instance_index];
+            const glm::mat3 abs_inverse = glm::mat3(glm::abs(glm::vec3(inverse[0])), glm::abs(glm::vec3(inverse[1])),
+                                                    glm::abs(glm::vec3(inverse[2])));
+
+            glm::vec3 center = glm::vec3(inverse * glm::vec4(glm::vec3(voxel.center), 1.0f));
+            glm::vec3 extent = abs_inverse * glm::vec3((float)voxel.half_length);
+            extent += 1e-5f * (glm::vec3(std::max({std::abs(center.x), std::abs(center.y), std::abs(center.z)})) +
+                               extent);
+            const glm::vec3 box_min = center - extent;
+            const glm::vec3 box_max = center + extent;
+
+            // Deep enough for 512 levels of binary nodes, the deepest BVH the builder makes
+            int stack[512 * Width];
+            int sp = 0;
+            stack[sp++] = root;
+            while (sp > 0)
+            {
+                const Node<Width> &node = wide.m_nodes[stack[--sp]];
+                if (traversal != nullptr)
+                {
+                    traversal->nodes_visited++;
+                }
+
+                // The order of the walk does not change the value, see cpu_voxelizer::testTriangles
+                uint32_t mask = intersectMask(node, box_min, box_max);
+                for (int i = 0; i < Width; i++)
+                {
+                    if ((mask >> i & 1) != 0 && node.count[i] == 0)
+                    {
+                        stack[sp++] = root + node.child[i];
+                    }
+                }
+
+                for (int i = 0; i < Width; i++)
+                {
+                    if ((mask >> i & 1) != 0 && node.count[i] > 0 &&
+                        test_leaf(instance_index, instance, node.child[i], node.count[i]))
+                    {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        });
+    }
+
+    /**
+     * @brief Value of one voxel, see cpu_voxelizer::voxelValue
+     */
+    template <int Width>
+    inline int voxelValue(const WideBVH<Width> &wide, const cpu_voxelizer::Voxel &voxel, float splat_threshold,
+                          stats::Traversal *traversal = nullptr, const material::Materials *materials = nullptr)
+    {
+        if (traversal != nullptr)
+        {
+            traversal->voxels++;
+        }
+
+        const SceneBVH &bvh = wide.scene();
+        if (bvh.empty())
+        {
+            return 0;
+        }
+
+        cpu_voxelizer::Hit hit;
+        auto test_leaf = [&](int, const SceneBVH::GPUInstance &instance, int leaf, int count) {
+            return cpu_voxelizer::testTriangles(bvh, instance, instance.triangle_offset + leaf, count, voxel,
+                                                splat_threshold, traversal, materials, hit);
+        };
+        walkLeaves<cpu_voxelizer::PRECISION_DOUBLE>(wide, voxel, traversal, test_leaf);
+        return cpu_voxelizer::hitValue(hit, traversal, materials);
+    }
+
+    /**
+     * @brief voxelValue with the float walk, see cpu_voxelizer::LocalMeshes
+     */
+    template <int Width>
+    inline int voxelValue(const WideBVH<Width> &wide, const cpu_voxelizer::LocalMeshes &local,
+                          const cpu_voxelizer::Voxel &voxel, float splat_threshold,
+                          stats::Traversal *traversal = nullptr, const material::Materials *materials = nullptr)
+    {
+        if (traversal != nullptr)
+        {
+            traversal->voxels++;
+        }
+
+        const SceneBVH &bvh = wide.scene();
+        if (bvh.empty())
+        {
+            return 0;
+        }
+
+        cpu_voxelizer::Hit hit;
+        // The wide nodes keep their padded mesh space test, only the leaves read the local triangles
+        auto test_leaf = [&](int instance_index, const SceneBVH::GPUInstance &instance, int leaf, int count) {
+            return cpu_voxelizer::testTrianglesFloat(bvh, local, instance_index, instance, leaf, count, voxel,
+                                                     splat_threshold, traversal, materials, hit);
+        };
+        walkLeaves<cpu_voxelizer::PRECISION_FLOAT>(wide, voxel, traversal, test_leaf);
+        return cpu_voxelizer::hitValue(hit, traversal, materials);
+    }
+
+    template <int Width>
+    inline cpu_voxelizer::LocalMeshes localMeshes(const WideBVH<Width> &wide, const cpu_voxelizer::Grid &grid)
+    {
+        return cpu_voxelizer::LocalMeshes(wide.scene(), wide.scene().m_instances, grid);
+    }
+} // namespace wide_bvh